@@ -0,0 +1,53 @@
+#!/usr/bin/perl -w
+#
+# carmel-client.pl socket [request ...]
+#
+# sends requests to a carmel --serve=socket server: the arguments, or else the lines of stdin, one request
+# each (see carmel -h for them).  prints the lines of each "ok n" answer to stdout; an "error" answer goes to
+# stderr (and the exit status is 1).  e.g.
+#
+#   carmel --serve=/tmp/carmel.sock -k 5 cascade.1 cascade.2 &
+#   echo '"a" "b" "c"' | sed 's/^/b /' | carmel-client.pl /tmp/carmel.sock
+#   carmel-client.pl /tmp/carmel.sock 'k 10' shutdown
+
+use strict;
+use IO::Socket::UNIX;
+
+my $path = shift or die "usage: $0 socket [request ...]\n";
+my $server;
+for (my $tries = 0; !$server; ++$tries) {  # wait a bit for a server that's still loading
+    $server = IO::Socket::UNIX->new(Type => SOCK_STREAM, Peer => $path);
+    last if $server || $tries >= 100;
+    select(undef, undef, undef, 0.1);
+}
+$server or die "$0: can't connect to $path: $!\n";
+
+my $status = 0;
+sub request {
+    my ($r) = @_;
+    print $server "$r\n";
+    return if $r =~ /^quit\s*$/;  # no answer
+    my $answer = <$server>;
+    defined $answer or die "$0: $path closed the connection after: $r\n";
+    if ($answer =~ /^ok (\d+)$/) {
+        for (my $n = $1; $n > 0; --$n) {
+            my $line = <$server>;
+            defined $line or die "$0: $path closed the connection in the answer to: $r\n";
+            print $line;
+        }
+    } else {
+        print STDERR $answer;
+        $status = 1;
+    }
+}
+
+if (@ARGV) {
+    request($_) for @ARGV;
+} else {
+    while (<STDIN>) {
+        chomp;
+        request($_);
+    }
+}
+close $server;
+exit $status;
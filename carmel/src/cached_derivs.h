@@ -3,9 +3,13 @@
 
 #include <carmel/src/derivations.h>
 #include <carmel/src/cascade.h>
+#include <carmel/src/packed_derivs.h>
 #include <graehl/shared/serialize_batch.hpp>
 #include <graehl/shared/time_space_report.hpp>
 #include <graehl/shared/periodic.hpp>
+#include <graehl/shared/parallel_workers.hpp>
+#include <graehl/shared/read_ahead.hpp>
+#include <boost/scoped_ptr.hpp>
 
 namespace graehl {
 
@@ -15,6 +19,9 @@ struct cached_derivs
 {
   WFST &x;
   serialize_batch<derivations> derivs;
+  // --disk-cache-format=packed or lz4: the cached derivations are in this file instead of derivs
+  boost::scoped_ptr<packed_derivs_file> packed;
+  fixed_array<packed_derivation> decoded;  // per thread
   typedef arcs_table<arc_counts> arcs_t;
   arcs_t arcs;
   std::string out_derivfile;
@@ -25,16 +32,20 @@ struct cached_derivs
 
   unsigned size()
   {
-    return cached?derivs.size():corpus.size();
+    return cached ? (packed ? packed->size() : derivs.size()) : corpus.size();
   }
   double n_output() const
   {
     return corpus.n_output;
   }
 
-  cached_derivs(WFST &x, cascade_parameters const& cascade, training_corpus &corpus, WFST::deriv_cache_opts const& copt)
-      : x(x), derivs(copt.use_disk(), copt.disk_cache_filename, true, copt.disk_cache_bufsize), arcs(x), out_derivfile(copt.out_derivfile), cascade(cascade), corpus(corpus), copt(copt)
+  // allow_packed false: keep derivations objects even on disk (gibbs needs random access to them).
+  // n_threads: compute the cached derivations with this many threads
+  cached_derivs(WFST &x, cascade_parameters const& cascade, training_corpus &corpus, WFST::deriv_cache_opts const& copt, bool allow_packed = true, unsigned n_threads = 1)
+      : x(x), derivs(copt.use_disk() && !(allow_packed && copt.use_packed()), copt.disk_cache_filename, true, copt.disk_cache_bufsize), arcs(x), out_derivfile(copt.out_derivfile), cascade(cascade), corpus(corpus), copt(copt), cache_threads(n_threads ? n_threads : 1)
   {
+    if (allow_packed && copt.use_packed())
+      packed.reset(new packed_derivs_file(copt.disk_cache_filename, copt.disk_format == WFST::deriv_cache_opts::disk_lz4));
     if ((cached = copt.cache()))
       cache_derivations();
     first = true; // for non-caching
@@ -64,7 +75,20 @@ struct cached_derivs
     bool fem = od&&first;
     if (fem)
       cascade.arcids(aid);
-    if (cached) {
+    if (packed) {
+      // rebuilt as derivations for f; EM uses foreach_deriv_threads, which doesn't
+      unsigned n = 0;
+      packed_batch record;
+      packed_derivation p;
+      derivations d;
+      for (packed->rewind(); packed->next_batch(record, 1);) {
+        p.decode(record.records[0]);
+        p.unpack(d, arcs);
+        f(++n, d);
+        if (fem)
+          cascade.fem_deriv(*od, arcs, aid, d);
+      }
+    } else if (cached) {
       unsigned n = 0;
       for (derivs.rewind(); derivs.advance();) {
         ++n;
@@ -100,11 +124,220 @@ struct cached_derivs
     first = false;
   }
 
+  // workers[t](n, derivations &) is called on thread t for a contiguous run (in corpus order) of each block
+  template <class Workers>
+  struct deriv_block {
+    Workers &workers;
+    unsigned n_threads;
+    derivations *const* block;
+    unsigned n_block, n_before;
+    deriv_block(Workers &workers, unsigned n_threads, derivations *const* block, unsigned n_block, unsigned n_before)
+        : workers(workers), n_threads(n_threads), block(block), n_block(n_block), n_before(n_before) {}
+    void operator()(std::size_t t) const {
+      worker_range_type r = worker_range(t, n_threads, n_block);
+      for (std::size_t i = r.first; i != r.second; ++i)
+        workers[t](n_before + i + 1, *block[i]);
+    }
+  };
+
+  // uncached: compute derivations on the worker thread; failures are noted for the caller to warn/prune in order
+  template <class Workers>
+  struct derive_block {
+    cached_derivs &c;
+    Workers &workers;
+    unsigned n_threads;
+    wfst_io_index const& io;
+    dynamic_array<IOSymSeq *> const& examples;
+    fixed_array<dynamic_array<unsigned> > no_derivation; // per thread, 0-based example index
+    derive_block(cached_derivs &c, Workers &workers, unsigned n_threads, wfst_io_index const& io, dynamic_array<IOSymSeq *> const& examples)
+        : c(c), workers(workers), n_threads(n_threads), io(io), examples(examples), no_derivation(n_threads) {}
+    void operator()(std::size_t t) {
+      worker_range_type r = worker_range(t, n_threads, examples.size());
+      for (std::size_t i = r.first; i != r.second; ++i) {
+        IOSymSeq const& s = *examples[i];
+        derivations d;
+        if (d.init_and_compute(c.x, io, c.arcs, s.i, s.o, s.weight, i + 1, c.copt.cache_backward(), c.copt.prune()))
+          workers[t](i + 1, d);
+        else
+          no_derivation[t].push_back(i);
+      }
+    }
+  };
+
+  // as deriv_block, for packed records: each thread decodes its own
+  template <class Workers>
+  struct packed_block {
+    cached_derivs &c;
+    Workers &workers;
+    unsigned n_threads;
+    std::vector<const_byteptr> const& block;
+    unsigned n_before;
+    packed_block(cached_derivs &c, Workers &workers, unsigned n_threads, std::vector<const_byteptr> const& block, unsigned n_before)
+        : c(c), workers(workers), n_threads(n_threads), block(block), n_before(n_before) {}
+    void operator()(std::size_t t) const {
+      worker_range_type r = worker_range(t, n_threads, block.size());
+      packed_derivation &d = c.decoded[t];
+      for (std::size_t i = r.first; i != r.second; ++i) {
+        d.decode(block[i]);
+        workers[t](n_before + i + 1, d);
+      }
+    }
+  };
+
+  enum { deriv_block_per_thread = 16 };
+
+  // read_ahead fill for packed: the next block of records
+  struct read_packed {
+    packed_derivs_file &file;
+    std::size_t max;
+    read_packed(packed_derivs_file &file, std::size_t max) : file(file), max(max) {}
+    bool operator()(packed_batch &b, std::size_t &bytes) const {
+      if (!file.next_batch(b, max)) return false;
+      bytes = b.bytes;
+      return true;
+    }
+  };
+
+  // a block of derivations deserialized from the disk cache
+  struct deriv_batch {
+    fixed_array<derivations> d;
+    unsigned n;
+  };
+
+  // read_ahead fill for the (--disk-cache-format=serialize) disk cache: the next block of derivations
+  struct read_derivs {
+    serialize_batch<derivations> &derivs;
+    unsigned block_size;
+    std::size_t left;
+    read_derivs(serialize_batch<derivations> &derivs, unsigned block_size)
+        : derivs(derivs), block_size(block_size), left(derivs.size()) {}
+    bool operator()(deriv_batch &b, std::size_t &bytes) {
+      if (!left) return false;
+      if (b.d.size() != block_size) b.d.reinit(block_size);
+      b.n = (unsigned)std::min<std::size_t>(block_size, left);
+      std::streamoff before = derivs.f.tellg();
+      for (unsigned i = 0; i < b.n; ++i)
+        if (!derivs.advance_into(b.d[i]))
+          throw serialize_batch_index_error();
+      bytes = (std::size_t)(derivs.f.tellg() - before);
+      left -= b.n;
+      return true;
+    }
+  };
+
+  /// --disk-cache-format=serialize
+  bool disk_derivs() const { return cached && derivs.use_file; }
+
+  // like foreach_deriv, but spread over n_threads: workers[t] sees a contiguous run of each block of
+  // derivations read from the cache, or of the whole corpus if uncached.  which derivations each worker sees
+  // depends only on n_threads.  packed records are given to workers as packed_derivation, so workers[t](n, d)
+  // must accept that too.  disk caches are read a block at a time by a read_ahead thread, which stays at least
+  // one block (and up to --disk-cache-bufsize bytes) ahead of the workers, so reading overlaps counting and
+  // memory stays bounded
+  template <class Workers>
+  void foreach_deriv_threads(Workers &workers, unsigned n_threads)
+  {
+    if ((n_threads <= 1 && !packed && !disk_derivs()) || (first && !out_derivfile.empty())) {
+      foreach_deriv(workers[0]);
+      return;
+    }
+    if (packed) {
+      decoded.reinit(n_threads);
+      unsigned n = 0;
+      packed->rewind();
+      read_ahead<packed_batch> blocks(read_packed(*packed, n_threads * deriv_block_per_thread),
+                                      copt.disk_cache_bufsize);
+      while (packed_batch *b = blocks.next()) {
+        packed_block<Workers> run(*this, workers, n_threads, b->records, n);
+        run_workers(run, n_threads);
+        n += b->records.size();
+      }
+    } else if (disk_derivs()) {
+      fixed_array<derivations *> block(n_threads * deriv_block_per_thread);
+      unsigned n = 0;
+      derivs.rewind();
+      read_ahead<deriv_batch> blocks(read_derivs(derivs, block.size()), copt.disk_cache_bufsize);
+      while (deriv_batch *b = blocks.next()) {
+        for (unsigned i = 0; i < b->n; ++i) block[i] = &b->d[i];
+        deriv_block<Workers> run(workers, n_threads, block.begin(), b->n, n);
+        run_workers(run, n_threads);
+        n += b->n;
+      }
+    } else if (cached) {
+      std::size_t N = derivs.size();
+      fixed_array<derivations *> block(N);
+      derivations none;
+      derivs.rewind();
+      for (std::size_t i = 0; i < N; ++i)
+        if (!(block[i] = derivs.advance_into(none)))
+          throw serialize_batch_index_error();
+      deriv_block<Workers> run(workers, n_threads, block.begin(), (unsigned)N, 0);
+      run_workers(run, n_threads);
+    } else {
+      wfst_io_index io(x);
+      List<IOSymSeq> &ex = corpus.examples;
+      dynamic_array<IOSymSeq *> examples;
+      for (List<IOSymSeq>::val_iterator i = ex.val_begin(), e = ex.val_end(); i != e; ++i)
+        examples.push_back(&*i);
+      derive_block<Workers> run(*this, workers, n_threads, io, examples);
+      run_workers(run, n_threads);
+      if (first) {
+        // per-thread lists are each increasing, and so is their concatenation
+        unsigned n = 0;
+        List<IOSymSeq>::erase_iterator i = ex.erase_begin();
+        for (unsigned t = 0; t < n_threads; ++t)
+          for (unsigned const* b = run.no_derivation[t].begin(), *e = run.no_derivation[t].end(); b != e; ++b) {
+            for (; n < *b; ++n) ++i;
+            warn_no_derivations(x, *i, ++n);
+            if (copt.prune())
+              i = ex.erase(i);
+            else
+              ++i;
+          }
+        corpus.count();
+      }
+    }
+    first = false;
+  }
+
+  unsigned cache_threads;
+
+  enum { derive_chunk_per_thread = 64 };
+
+  // cache_derivations: compute (and for packed, encode) a chunk of examples, each of n_threads workers a
+  // contiguous run of it, into slots that are then added to the cache in corpus order
+  struct derive_chunk {
+    cached_derivs &c;
+    unsigned n_threads;
+    wfst_io_index const& io;
+    IOSymSeq *const* examples;
+    unsigned n_chunk, n_before;
+    fixed_array<derivations> &d;
+    std::vector<char> &ok;
+    std::vector<std::string> &rec;
+    fixed_array<derivations::statistics> stats; // global_stats of threads t>0, to merge in order
+    derive_chunk(cached_derivs &c, unsigned n_threads, wfst_io_index const& io, IOSymSeq *const* examples, unsigned n_chunk,
+                 unsigned n_before, fixed_array<derivations> &d, std::vector<char> &ok, std::vector<std::string> &rec)
+        : c(c), n_threads(n_threads), io(io), examples(examples), n_chunk(n_chunk), n_before(n_before), d(d), ok(ok)
+        , rec(rec), stats(n_threads) {}
+    void operator()(std::size_t t) {
+      if (t) derivations::global_stats = derivations::statistics();
+      worker_range_type r = worker_range(t, n_threads, n_chunk);
+      for (std::size_t i = r.first; i != r.second; ++i) {
+        IOSymSeq const& s = *examples[i];
+        ok[i] = d[i].init_and_compute(c.x, io, c.arcs, s.i, s.o, s.weight, n_before + i + 1, c.copt.cache_backward(), c.copt.prune());
+        if (ok[i] && c.packed) {
+          rec[i].clear();
+          packed_derivation::encode(d[i], rec[i]);
+        }
+      }
+      if (t) stats[t] = derivations::global_stats;
+    }
+  };
+
   //TODO: cascade arc ids for fem deriv out
   void cache_derivations()
   {
-    bool cache_backward = copt.cache_backward();
-    bool prune = copt.prune();
     typedef List<IOSymSeq> Examples;
     Examples &ex = corpus.examples;
     cached = true;
@@ -112,28 +345,54 @@ struct cached_derivs
     log<<"Caching derivations:\n";
     graehl::time_space_report r(log,"Computed cached derivations: ");
     wfst_io_index io(x);
-    unsigned n = 1;
     derivs.clear();
-    for (Examples::const_iterator i = ex.begin(), end = ex.end();
-         i!=end ; ++i, ++n) {
-      num_progress(log, n, 10, 70,".","\n");
-      derivations &d = derivs.start_new();
-      corpus.clear_counts();
-      if (!d.init_and_compute(x, io, arcs, i->i, i->o, i->weight, n, cache_backward, prune)) {
-        warn_no_derivations(x, *i, n);
-        derivs.drop_new();
-      } else {
+    if (packed)
+      packed->clear();
+    dynamic_array<IOSymSeq *> examples;
+    for (Examples::val_iterator i = ex.val_begin(), e = ex.val_end(); i != e; ++i)
+      examples.push_back(&*i);
+    unsigned n_threads = cache_threads, chunk_size = n_threads * derive_chunk_per_thread;
+    fixed_array<derivations> d(chunk_size);
+    std::vector<char> ok(chunk_size);
+    std::vector<std::string> rec(packed ? chunk_size : 0);
+    for (unsigned n = 0, N = (unsigned)examples.size(); n < N;) {
+      unsigned n_chunk = std::min(chunk_size, N - n);
+      derive_chunk run(*this, n_threads, io, examples.begin() + n, n_chunk, n, d, ok, rec);
+      run_workers(run, n_threads);
+      for (unsigned t = 1; t < n_threads; ++t)
+        derivations::global_stats.merge(run.stats[t]);
+      for (unsigned i = 0; i < n_chunk; ++i, ++n) {
+        IOSymSeq const& s = *examples[n];
+        num_progress(log, n + 1, 10, 70,".","\n");
+        corpus.clear_counts();
+        if (!ok[i]) {
+          warn_no_derivations(x, s, n + 1);
+          continue;
+        }
 #ifdef DEBUG_DERIVATIONS_EXTRA
-        Config::debug() << "Derivations in transducer for input/output #"<<n<<" (final="<<d.final()<<"):\n";
-        i->print(Config::debug(), x,"\n");
-        printGraph(d.graph(), Config::debug());
+        Config::debug() << "Derivations in transducer for input/output #"<<n + 1<<" (final="<<d[i].final()<<"):\n";
+        s.print(Config::debug(), x,"\n");
+        printGraph(d[i].graph(), Config::debug());
 #endif
-        derivs.keep_new();
-        corpus.count(*i);
+        if (packed) {
+          packed->start_new().swap(rec[i]);
+          packed->keep_new();
+        } else {
+          derivs.start_new().swap(d[i]);
+          derivs.keep_new();
+        }
+        corpus.count(s);
       }
     }
     log << "\n";
-    derivs.mark_end();
+    if (packed) {
+      packed->mark_end();
+      log << "Packed " << packed->size() << " derivations into " << packed->file_bytes() << " bytes";
+      if (packed->lz4)
+        log << " (" << packed->record_bytes() << " before LZ4)";
+      log << " in " << packed->filename << "\n";
+    } else
+      derivs.mark_end();
     log << derivations::global_stats;
   }
 };
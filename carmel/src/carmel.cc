@@ -42,6 +42,12 @@
 #include <graehl/shared/split_noquote.hpp>
 #include <boost/config.hpp>
 #include <graehl/shared/random.hpp>
+#include <graehl/shared/ordered_pipeline.hpp>
+#include <graehl/shared/line_server.hpp>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <sstream>
 
 #define DEBUG_CASCADE 0
 
@@ -240,10 +246,31 @@ struct carmel_main {
               : (flags[(unsigned)':'] ? WFST::cache_forward_backward
                                       : (flags[(unsigned)'?'] ? WFST::cache_forward : WFST::cache_nothing));
     copt.do_prune = !have_opt("cache-no-prune");
+    get_opt("threads", topt.threads);
+    if ((topt.online = have_opt("online-em"))) {
+      get_opt("minibatch", topt.minibatch);
+      if (!topt.minibatch) topt.minibatch = 1;
+      get_opt("stepsize-alpha", topt.stepsize_alpha);
+      if (!(topt.stepsize_alpha >= 0 && topt.stepsize_alpha <= 1))
+        throw std::runtime_error("--stepsize-alpha: expected a number in [0,1] (.5 < alpha <= 1 to converge)");
+    }
+    if (have_opt("semiring") && !WFST::parse_semiring(text_long_opts["semiring"], topt.semiring))
+      throw std::runtime_error("--semiring=" + text_long_opts["semiring"] + ": expected log, tropical or real");
     if (have_opt("disk-cache-derivations")) {
       copt.cache_level = WFST::cache_disk;
       copt.disk_cache_filename = set_default_text("disk-cache-derivations", "/tmp/carmel.derivations.XXXXXX");
       get_default_opt("disk-cache-bufsize", copt.disk_cache_bufsize, "1M");
+      if (have_opt("disk-cache-format")) {
+        std::string const& f = text_long_opts["disk-cache-format"];
+        if (f == "packed")
+          copt.disk_format = WFST::deriv_cache_opts::disk_packed;
+        else if (f == "lz4")
+          copt.disk_format = WFST::deriv_cache_opts::disk_lz4;
+        else if (f == "serialize")
+          copt.disk_format = WFST::deriv_cache_opts::disk_serialize;
+        else
+          throw std::runtime_error("--disk-cache-format=" + f + ": expected packed, lz4 or serialize");
+      }
       Config::log() << "Disk cache of derivations will be created at " << copt.disk_cache_filename
                     << " using read buffer of " << copt.disk_cache_bufsize << " bytes.\n";
     }
@@ -269,6 +296,8 @@ struct carmel_main {
       gopt.include_self = have_opt("include-self");
       gopt.random_start = have_opt("random-start");
       get_opt("crp-restarts", gopt.restarts);
+      get_opt("gibbs-threads", gopt.threads);
+      if (gopt.threads < 1) gopt.threads = 1;
       gopt.argmax_final = have_opt("crp-argmax-final");
       gopt.argmax_sum = have_opt("crp-argmax-sum");
       gopt.norm_order = have_opt("norm-order");
@@ -376,24 +405,30 @@ struct carmel_main {
     }
   }
 
-  void print_kbest(unsigned kPaths, WFST* result) {
+  void print_kbest(unsigned kPaths, WFST* result) { record_best(print_kbest(cout, kPaths, result)); }
+
+  /// prints to out without counting; returns the best path's weight (0 if none)
+  Weight print_kbest(std::ostream& out, unsigned kPaths, WFST* result) const {
     unsigned kPathsLeft = kPaths;
+    Weight best;
     if (result->valid()) {
-      wfst_paths_printer pp(*result, cout, flags);
+      wfst_paths_printer pp(*result, out, flags);
       result->visit_kbest(kPaths, pp);
       kPathsLeft -= pp.n_paths;
-      if (pp.best_w.isZero())
-        ++n_0prob;
-      else {
-        non0_viterbi_prob(pp.best_w);
-      }
-    } else {
-      n_0prob++;
+      best = pp.best_w;
     }
     for (unsigned fill = 0; fill < kPathsLeft; ++fill) {
-      if (!(flags[(unsigned)'W'] || flags[(unsigned)'@'])) cout << '0';
-      cout << "\n";
+      if (!(flags[(unsigned)'W'] || flags[(unsigned)'@'])) out << '0';
+      out << "\n";
     }
+    return best;
+  }
+
+  void record_best(Weight best) {
+    if (best.isZero())
+      ++n_0prob;
+    else
+      non0_viterbi_prob(best);
   }
 
   bool* flags;
@@ -503,6 +538,12 @@ struct carmel_main {
 
   bool have_opt(std::string const& key) const { return long_opts.find(key) != long_opts.end(); }
 
+  /// long_opts[key] without adding it (so --threads workers may ask)
+  double long_opt(std::string const& key) const {
+    long_opts_t::const_iterator i = long_opts.find(key);
+    return i == long_opts.end() ? 0 : i->second;
+  }
+
   template <class V>
   bool get_opt(std::string const& key, V& v) const {
     long_opts_t::const_iterator i = long_opts.find(key);
@@ -625,6 +666,8 @@ struct carmel_main {
     maybe_project(result);
     if (flags[(unsigned)'Y'])
       result->writeGraphViz(o);
+    else if (long_opts["write-binary"])
+      result->writeBinary(o);
     else {
       result->writeLegible(o, show0);
     }
@@ -635,15 +678,113 @@ struct carmel_main {
     if (prunePath()) result->prunePaths(max_states, keep_path_ratio);
   }
 
+  /// --lazy-compose applies only to -b -k output of the composed cascade, when nothing else needs the whole
+  /// composition and the best-first search is exact (all arc weights <= 1); otherwise we warn and compose
+  /// eagerly.  chain[skip] (the -b input line) is a weight 1 acceptor.
+  bool lazy_compose_ok(WFST* chain, unsigned nChain, unsigned skip, int kPaths) {
+    if (!have_opt("lazy-compose")) return false;
+    char const* why = 0;
+    if (!flags[(unsigned)'b'] || kPaths < 1 || nChain < 2)
+      why = "needs -b -k with at least two transducers";
+    else if (flags[(unsigned)'a'] || flags[(unsigned)'m'] || flags[(unsigned)'A'] || flags[(unsigned)'N']
+             || flags[(unsigned)'C'] || flags[(unsigned)'p'] || prunePath() || flags[(unsigned)'v']
+             || flags[(unsigned)'n'] || flags[(unsigned)'1'] || flags[(unsigned)'c'] || have_opt("sum")
+             || have_opt("post-b") || have_opt("constant-weight") || long_opts["random-set"]
+             || long_opts["final-sink"] || long_opts["openfst-roundtrip"])
+      why = "an option given needs the whole composition";
+    else
+      for (unsigned i = 0; i < nChain; ++i)
+        if (i != skip && chain[i].maxArcWeight() > Weight::ONE()) {
+          why = "best-first search needs arc weights <= 1";
+          break;
+        }
+    if (why) Config::warn() << "--lazy-compose ignored (" << why << ")\n";
+    return !why;
+  }
+
+  /// --cache-cascade composes the -b cascade's other transducers once, for every line, which needs at least two
+  /// of them, nothing done to each intermediate composition, and (as for batch_lines) nothing but the k-best
+  /// done per line; otherwise we warn and compose each line with the whole cascade
+  bool cache_cascade_ok(unsigned nChain, bool lazy, bool remember_cascade, bool serving) {
+    if (!have_opt("cache-cascade")) return false;
+    char const* why = 0;
+    if (!flags[(unsigned)'b'] || nChain < 3)
+      why = "needs -b with at least two transducers";
+    else if (lazy)
+      why = "--lazy-compose";
+    else if (serving)
+      why = "--serve";
+    else if (flags[(unsigned)'m'] || flags[(unsigned)'C'] || flags[(unsigned)'p'] || prunePath())
+      why = "an option given works on each composition";
+    else
+      why = not_concurrent(remember_cascade);
+    if (why) Config::warn() << "--cache-cascade ignored (" << why << ")\n";
+    return !why;
+  }
+
+  /// the composition of chain[0]...chain[nChain-1] but for chain[skip] (the -b input, first or last), reduced
+  /// after each step, or 0 (after a warning) once a step has more than max_arcs arcs
+  WFST* compose_cached(WFST* chain, unsigned nChain, unsigned skip, double max_arcs) {
+    unsigned begin = skip ? 0 : 1, end = skip ? nChain - 1 : nChain;
+    WFST* result = &chain[begin];
+    if (!flags[(unsigned)'q']) Config::log() << "--cache-cascade: composing the cascade without the input";
+    for (unsigned i = begin + 1; i < end; ++i) {
+      WFST* next = NEW WFST(*result, chain[i]);
+      if (result != &chain[begin]) delete result;
+      result = next;
+      if (!flags[(unsigned)'q'])
+        Config::log() << "\n\t(" << result->size() << " states / " << result->numArcs() << " arcs" << std::flush;
+      if (!result->valid()) {
+        if (!flags[(unsigned)'q']) Config::log() << ")";
+        break;
+      }
+      shrink(result, true, false, false, ")");
+      if (result->numArcs() > max_arcs) {
+        if (!flags[(unsigned)'q']) Config::log() << std::endl;
+        Config::warn() << "--cache-cascade ignored (over --cache-cascade-max-arcs=" << max_arcs << ")\n";
+        delete result;
+        return 0;
+      }
+    }
+    if (!flags[(unsigned)'q']) Config::log() << std::endl;
+    return result;
+  }
+
+  /// --threads with -b composes and prints the lines concurrently (batch_lines), which needs the cascade to be
+  /// left as it is by each line and nothing done per line that depends on the lines before; otherwise we warn
+  /// and take the lines one at a time
+  bool batch_threads_ok(bool remember_cascade) const {
+    if (!flags[(unsigned)'b'] || topt.threads < 2) return false;
+    char const* why = not_concurrent(remember_cascade);
+    if (why) Config::warn() << "--threads ignored for -b (" << why << ")\n";
+    return !why;
+  }
+
+  /// why input lines can't be composed concurrently (-b --threads, --serve), or 0 if they can
+  char const* not_concurrent(bool remember_cascade) const {
+    char const* why = 0;
+    if (remember_cascade)
+      why = "--train-cascade or --compose-cascade";
+    else if (flags[(unsigned)'a'])
+      why = "-a composes through State::Index, which it builds in the shared transducers";
+    else if (flags[(unsigned)'A'] || flags[(unsigned)'N'] || flags[(unsigned)'%']
+             || flags[(unsigned)'v'] || flags[(unsigned)'n'] || flags[(unsigned)'1'] || flags[(unsigned)'c']
+             || have_opt("sum") || have_opt("post-b") || have_opt("constant-weight") || long_opt("random-set")
+             || long_opt("final-sink") || long_opt("openfst-roundtrip") || long_opt("minimize-compositions")
+             || long_opt("minimize-all-compositions"))
+      why = "an option given is done in input order";
+    return why;
+  }
+
   void minimize(WFST* result) {
     if (flags[(unsigned)'C'])
-      result->consolidateArcs(!long_opts["consolidate-max"], !long_opts["consolidate-unclamped"]);
+      result->consolidateArcs(!long_opt("consolidate-max"), !long_opt("consolidate-unclamped"));
     if (!flags[(unsigned)'d']) result->reduce();
   }
 
   struct shrink_monitor {
-    shrink_monitor(char const* name, WFST& result, bool print, bool& changed)
-        : name(name), result(result), print(print), changed(changed) {
+    shrink_monitor(char const* name, WFST& result, bool print, bool& changed, std::ostream& log)
+        : name(name), result(result), print(print), changed(changed), log(log) {
       st = result.size();
       arc = result.numArcs();
     }
@@ -651,35 +792,36 @@ struct carmel_main {
     WFST& result;
     bool print;
     bool& changed;
+    std::ostream& log;
     unsigned st, arc;
     ~shrink_monitor() {
       unsigned nst = result.size(), narc = result.numArcs();
       if (nst != st || narc != arc) {
         changed = true;
-        if (print) Config::log() << ' ' << name << "-> " << nst << '/' << narc;
+        if (print) log << ' ' << name << "-> " << nst << '/' << narc;
       }
     }
   };
 
 
   bool shrink(WFST* result, bool print = true, bool do_prune = true, bool openfst_min = false,
-              char const* end = "\n") {
+              char const* end = "\n", std::ostream& log = Config::log()) {
     WFST& w = *result;
     bool changed = false;
     print = print && !flags[(unsigned)'q'];
     {
-      shrink_monitor m("reduce", w, print, changed);
+      shrink_monitor m("reduce", w, print, changed, log);
       minimize(result);
     }
     if (do_prune) {
-      shrink_monitor m("prune", w, print, changed);
+      shrink_monitor m("prune", w, print, changed, log);
       prune(result);
     }
     if (openfst_min) {
-      shrink_monitor m("openfst-minimize", w, print, changed);
+      shrink_monitor m("openfst-minimize", w, print, changed, log);
       openfst_minimize(result);
     }
-    if (print) Config::log() << end;
+    if (print) log << end;
     return changed;
   }
 
@@ -748,6 +890,7 @@ struct carmel_main {
 
   void parse_opts() {
     parse_cache_opts();
+    if (topt.threads > 1) norm_method.threads = topt.threads;
     parse_gibbs_opts();
     parse_fem_opts();
     no_compose = have_opt("no-compose");
@@ -859,6 +1002,423 @@ struct carmel_main {
   }
 };
 
+/* composing input lines with the cascade on several threads at once (-b --threads, --serve): the cascade's
+   transducers are frozen first, so that composing only reads them.  each thread needs its own copy of the
+   --lazy-compose completions
+*/
+struct line_composer {
+  struct line {
+    std::string text;
+    unsigned lineno;
+    unsigned length;
+    bool bad;  // couldn't make the input acceptor
+    Weight best;
+  };
+  typedef std::vector<std::vector<Weight> > completions_type;
+
+  carmel_main& cm;
+  bool* flags;
+  WFST* chain;
+  unsigned nChain, nTarget, nInputs;
+  char const** filenames;
+  completions_type lazy_completions;  // empty unless --lazy-compose
+  WFST* cached;  // --cache-cascade: the rest of the cascade, composed (or 0)
+  std::ostringstream out_format, log_format;  // cout's and cerr's, for the threads' buffers
+
+  line_composer(carmel_main& cm, bool* flags, WFST* chain, unsigned nChain, unsigned nTarget, unsigned nInputs,
+                char const** filenames, std::vector<Weight>* lazy_completions, WFST* cached = 0)
+      : cm(cm)
+      , flags(flags)
+      , chain(chain)
+      , nChain(nChain)
+      , nTarget(nTarget)
+      , nInputs(nInputs)
+      , filenames(filenames)
+      , cached(cached) {
+    for (unsigned i = 0; i < nChain; ++i)
+      if (i != nTarget) {
+        chain[i].freeze(kInput);
+        chain[i].freeze(kOutput);
+        if (lazy_completions && lazy_completions[i].empty()) chain[i].bestCompletions(lazy_completions[i]);
+      }
+    if (cached) {
+      cached->freeze(kInput);
+      cached->freeze(kOutput);
+    }
+    if (lazy_completions) this->lazy_completions.assign(lazy_completions, lazy_completions + nChain);
+    out_format.copyfmt(cout);
+    log_format.copyfmt(cerr);
+    log_format.tie(0);  // as cerr is to cout, which only the writer may flush
+  }
+
+  /// as the -b loop in main does for one line (l.text and l.lineno), with kPaths paths, except that the output
+  /// and log go to out and log.  completions: this thread's copy of lazy_completions
+  void compose_and_print(line& l, unsigned kPaths, std::ostream& out, std::ostream& log,
+                         completions_type& completions) const {
+    WFST* input;
+    l.best = Weight();
+    if (flags[(unsigned)'P'])
+      input = NEW WFST(l.text.c_str(), l.length, 1);
+    else {
+      input = NEW WFST(l.text.c_str());
+      l.length = input->numStates() - 1;
+    }
+    if (!quiet()) log << "Input line " << l.lineno << ": " << l.text.c_str();
+    if (!(l.bad = !input->valid())) {
+      std::vector<WFST*> ch(nChain);
+      for (unsigned i = 0; i < nChain; ++i) ch[i] = i == nTarget ? input : &chain[i];
+      bool r = flags[(unsigned)'r'];
+      WFST* result = r ? ch[nChain - 1] : ch[0];
+      cm.minimize(result);
+      if (nInputs < 2) cm.prune(result);
+      if (!completions.empty())
+        result = compose_lazy(ch, completions, kPaths, log);
+      else if (cached) {
+        static char const* const names[] = {"--cache-cascade", "--cache-cascade"};
+        ch.assign(2, cached);
+        ch[r ? 1 : 0] = input;
+        result = compose(ch, names, input, kPaths, log);
+      } else
+        result = compose(ch, filenames, result, kPaths, log);
+      l.best = cm.print_kbest(out, kPaths, result);
+      if (result != input) delete result;
+    }
+    delete input;
+  }
+
+ protected:
+  bool quiet() const { return flags[(unsigned)'q'] != 0; }
+
+  WFST* compose_lazy(std::vector<WFST*>& ch, completions_type& completions, unsigned kPaths,
+                     std::ostream& log) const {
+    WFST* result = NEW WFST();
+    completions[nTarget].clear();
+    unsigned n_expanded = result->set_compose_lazy(&ch[0], nChain, kPaths, flags[(unsigned)'r'], &completions[0]);
+    if (!quiet())
+      log << "\n\t(lazy: " << n_expanded << " states expanded, " << result->size() << " states / "
+          << result->numArcs() << " arcs kept";
+    if (result->valid())
+      cm.shrink(result, true, false, false, ")", log);
+    else if (!quiet())
+      log << ")";
+    if (!quiet()) log << std::endl;
+    return result;
+  }
+
+  /// result is ch's first (or with -r, last) transducer, names ch's filenames.  kPaths > 0: may prune the
+  /// final result for that many best paths
+  WFST* compose(std::vector<WFST*>& ch, char const* const* names, WFST* result, unsigned kPaths,
+                std::ostream& log) const {
+    bool r = flags[(unsigned)'r'];
+    unsigned n = ch.size();
+    cascade_parameters cascade;
+    if (n < 2) cascade.set_trivial();
+    cascade.add(result);
+    bool first = true;
+    for (unsigned i = (r ? n - 2 : 1); (r ? ~i : i < n) && result->valid(); (r ? --i : ++i), first = false) {
+      cascade.add(ch[i]);
+      if (first)
+        cascade.prepare_compose();
+      else
+        cascade.prepare_compose(r);
+      WFST& t1 = (r ? *ch[i] : *result);
+      WFST& t2 = (r ? *result : *ch[i]);
+      WFST* next = NEW WFST(cascade, t1, t2, flags[(unsigned)'m'], flags[(unsigned)'a']);
+      if (!first) delete result;
+      result = next;
+      if (!quiet()) log << "\n\t(" << result->size() << " states / " << result->numArcs() << " arcs";
+      if (!result->valid()) {
+        log << ")\nEmpty or invalid result of composition with transducer \"" << names[i] << "\".\n";
+        return result;
+      }
+      bool nok = !(kPaths > 0 && i == (r ? 0 : n - 1));
+      cm.shrink(result, true, nok, false, ")", log);
+      cascade.done_composing(result);
+    }
+    if (!quiet()) log << std::endl;
+    return result;
+  }
+};
+
+/* -b --threads: a reader thread takes the lines, workers compose each with the cascade and print its k-best
+   into a buffer, and the main thread writes the buffers to stdout (and the per line log to stderr) in input
+   order, as if the lines were done one at a time.  batch_threads_ok says which options allow this
+*/
+struct batch_lines : line_composer {
+  struct line : line_composer::line {
+    std::string out, log;
+  };
+
+  unsigned kPaths;
+  std::istream& in;
+  std::vector<completions_type> completions;  // each worker's copy of lazy_completions
+  unsigned n_lines;
+  bool failed;
+
+  batch_lines(carmel_main& cm, bool* flags, WFST* chain, unsigned nChain, unsigned nTarget, unsigned nInputs,
+              unsigned kPaths, char const** filenames, std::istream& in,
+              std::vector<Weight>* lazy_completions, unsigned n_threads, WFST* cached = 0)
+      : line_composer(cm, flags, chain, nChain, nTarget, nInputs, filenames, lazy_completions, cached)
+      , kPaths(kPaths)
+      , in(in)
+      , completions(n_threads, this->lazy_completions)
+      , n_lines()
+      , failed() {}
+
+  /// false if a line couldn't be handled (after a warning).  logs the per line latency percentiles
+  bool run(unsigned n_threads) {
+    latency_percentiles latency, compute;
+    run_ordered_pipeline<line>(*this, n_threads, 4 * n_threads, &latency, &compute);
+    if (!n_lines) Config::warn() << "No lines of input provided.\n";
+    if (latency.size()) {
+      Config::log() << n_lines << " input lines on " << n_threads << " threads: latency ";
+      latency.print(Config::log());
+      Config::log() << " (composing and k-best: ";
+      compute.print(Config::log());
+      Config::log() << ")\n";
+    }
+    return !failed;
+  }
+
+  bool read(line& l) {
+    if (!getline(in, l.text)) return false;
+    l.lineno = ++n_lines;
+    return true;
+  }
+
+  void work(line& l, unsigned worker) {
+    WFST::output_format(flags);  // the per thread defaults
+    std::ostringstream out, log;
+    out.copyfmt(out_format);
+    log.copyfmt(log_format);
+    compose_and_print(l, kPaths, out, log, completions[worker]);
+    l.out = out.str();
+    l.log = log.str();
+  }
+
+  bool write(line& l) {
+    Config::log() << l.log << std::flush;
+    if (l.bad) {
+      Config::warn() << "Couldn't handle input line: " << l.text << "\n";
+      failed = true;
+      return false;
+    }
+    cm.n_symbols += l.length;
+    cout << l.out;
+    cm.record_best(l.best);
+    return true;
+  }
+};
+
+/* --serve=socket: the cascade stays loaded (and frozen, as for -b --threads), and clients' requests, one per
+   line, are answered concurrently (each connection on its own thread):
+
+     b [k] symbols...          the k (default -k) best paths of the cascade composed with the input symbols,
+                               as -b prints them
+     k n                       the n best paths of the cascade itself (as carmel -k n without -b)
+     S in-symbols TAB out-symbols
+                               the sum of the cascade's paths (--semiring) for the pair, as -S prints it
+     quit                      close the connection
+     shutdown                  stop serving, once the requests already sent are answered
+
+   the answer is "ok n" and then the n lines carmel would have printed, or "error message".  the cascade
+   without input is composed (and indexed for S) at the first k or S request.  the per request log (without
+   -q) goes to stderr, and when the server stops, the request latency percentiles
+*/
+struct serve_requests : line_composer {
+  unsigned kPaths;
+  WFST::path_semiring semiring;
+  line_server server;
+  std::once_flag composed;
+  WFST* whole;  // the cascade composed
+  WFST::path_sums* sums;
+  std::mutex log_mutex;  // for stderr, latency and n_requests
+  latency_percentiles latency;
+  unsigned long n_requests;
+
+  serve_requests(carmel_main& cm, bool* flags, WFST* chain, unsigned nChain, unsigned nTarget, unsigned nInputs,
+                 unsigned kPaths, char const** filenames, std::vector<Weight>* lazy_completions,
+                 WFST::path_semiring semiring)
+      : line_composer(cm, flags, chain, nChain, nTarget, nInputs, filenames, lazy_completions)
+      , kPaths(kPaths)
+      , semiring(semiring)
+      , whole()
+      , sums()
+      , n_requests() {}
+
+  ~serve_requests() {
+    delete sums;
+    if (whole && !in_chain(whole)) delete whole;
+  }
+
+  void run(std::string const& path) {
+    Config::log() << "Serving requests on " << path << "\n";
+    connect c = {this};
+    server.serve(path, c);
+    Config::log() << n_requests << " requests on " << server.connections() << " connections: latency ";
+    latency.print(Config::log());
+    Config::log() << "\n";
+  }
+
+ private:
+  struct connection {
+    serve_requests* s;
+    completions_type completions;
+    bool operator()(std::string const& request, std::string& response) {
+      return s->answer(request, response, completions);
+    }
+  };
+  struct connect {
+    serve_requests* s;
+    line_server::reply_type operator()() const {
+      WFST::output_format(s->flags);  // the per thread defaults
+      connection c = {s, s->lazy_completions};
+      return c;
+    }
+  };
+
+  bool in_chain(WFST* w) const { return w >= chain && w < chain + nChain; }
+
+  static bool error(std::string& response, std::string const& message) {
+    response = "error " + message + "\n";
+    return true;
+  }
+
+  bool answer(std::string const& request, std::string& response, completions_type& completions) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::string::size_type sp = request.find(' ');
+    std::string verb(request, 0, sp), args(sp == std::string::npos ? std::string() : request.substr(sp + 1));
+    if (verb == "quit") return false;
+    if (verb == "shutdown") {
+      server.stop();
+      response = "ok 0\n";
+      return false;
+    }
+    std::ostringstream out, log;
+    out.copyfmt(out_format);
+    log.copyfmt(log_format);
+    if (verb == "b") {
+      line l;
+      l.text = args;
+      unsigned k = kPaths;
+      std::string::size_type first = args.find_first_not_of(" \t");
+      if (first != std::string::npos && isdigit((unsigned char)args[first])) {  // (symbols can't be numbers)
+        std::istringstream is(args);
+        if (!(is >> k)) return error(response, "b: bad k in: " + request);
+        std::getline(is, l.text);
+      }
+      {
+        std::lock_guard<std::mutex> lock(log_mutex);
+        l.lineno = ++n_requests;
+      }
+      compose_and_print(l, k, out, log, completions);
+      if (l.bad) return error(response, "couldn't handle input line: " + l.text);
+    } else if (verb == "k") {
+      unsigned k;
+      std::istringstream is(args);
+      if (!(is >> k)) return error(response, "k: expected the number of paths in: " + request);
+      compose_whole();
+      cm.print_kbest(out, k, whole);
+      count_request();
+    } else if (verb == "S") {
+      std::string::size_type tab = args.find('\t');
+      if (tab == std::string::npos) return error(response, "S: expected input TAB output symbols in: " + request);
+      compose_whole();
+      List<unsigned> ins, outs;
+      Weight prob;
+      if (whole->valid() && whole->knownSymbolList(&ins, args.substr(0, tab).c_str(), kInput)
+          && whole->knownSymbolList(&outs, args.substr(tab + 1).c_str(), kOutput))
+        prob = (*sums)(ins, outs);  // else a symbol not in the alphabet, so no paths
+      out << prob << std::endl;
+      count_request();
+    } else
+      return error(response, "unknown request (expected b, k, S, quit or shutdown): " + request);
+    std::string const& o = out.str();
+    std::ostringstream header;
+    header << "ok " << std::count(o.begin(), o.end(), '\n') << "\n";
+    response = header.str() + o;
+    std::lock_guard<std::mutex> lock(log_mutex);
+    Config::log() << log.str() << std::flush;
+    latency.add(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    return true;
+  }
+
+  void count_request() {
+    std::lock_guard<std::mutex> lock(log_mutex);
+    ++n_requests;
+  }
+
+  void compose_whole() { std::call_once(composed, &serve_requests::compose_whole_once, this); }
+
+  void compose_whole_once() {
+    std::vector<WFST*> ch;
+    std::vector<char const*> names;
+    for (unsigned i = 0; i < nChain; ++i)
+      if (i != nTarget) {
+        ch.push_back(&chain[i]);
+        names.push_back(filenames[i]);
+      }
+    std::ostringstream log;
+    log.copyfmt(log_format);
+    whole = compose(ch, &names[0], flags[(unsigned)'r'] ? ch.back() : ch.front(), 0, log);
+    if (whole->valid()) sums = new WFST::path_sums(*whole, semiring);
+    std::lock_guard<std::mutex> lock(log_mutex);
+    if (!quiet() || !whole->valid())
+      Config::log() << "Composed the cascade for k and S requests:" << log.str() << std::flush;
+  }
+};
+
+/* -S --threads: the pairs are read on a reader thread (looking up their symbols, which may add to the
+   alphabets, in order), their sums of paths are taken by the workers, and they're printed in order */
+struct scored_pairs {
+  struct pair {
+    List<unsigned> in, out;
+    Weight prob;
+  };
+
+  WFST& x;
+  WFST::path_sums sums;
+  std::istream& in;
+  unsigned& lineno;
+  std::string buf;
+  unsigned n_pairs;
+  Weight prod_prob;
+
+  scored_pairs(WFST& x, std::istream& in, WFST::path_semiring semiring, unsigned& lineno)
+      : x(x), sums(x, semiring), in(in), lineno(lineno), n_pairs(), prod_prob(1) {}
+
+  void run(unsigned n_threads) {
+    latency_percentiles latency, compute;
+    run_ordered_pipeline<pair>(*this, n_threads, 16 * n_threads, &latency, &compute);
+    if (latency.size()) {
+      Config::log() << n_pairs << " pairs on " << n_threads << " threads: latency ";
+      latency.print(Config::log());
+      Config::log() << " (sum of paths: ";
+      compute.print(Config::log());
+      Config::log() << ")\n";
+    }
+  }
+
+  bool read(pair& p) {
+    if (!getline(in, buf)) return false;
+    p.in.clear();
+    x.symbolList(&p.in, buf.c_str(), kInput, ++lineno);
+    if (!getline(in, buf)) return false;
+    p.out.clear();
+    x.symbolList(&p.out, buf.c_str(), kOutput, ++lineno);
+    return true;
+  }
+
+  void work(pair& p, unsigned) { p.prob = sums(p.in, p.out); }
+
+  bool write(pair& p) {
+    ++n_pairs;
+    prod_prob *= p.prob;
+    cout << p.prob << std::endl;
+    return true;
+  }
+};
+
 
 #ifndef GRAEHL_TEST
 int
@@ -1076,6 +1636,8 @@ int
     setOutputFormat(flags, &cout);
     setOutputFormat(flags, &cerr);
     WFST::setIndexThreshold(thresh);
+    cm.get_opt("compose-threads", WFST::compose_threads);
+    if (!WFST::compose_threads) WFST::compose_threads = 1;
     if (flags[(unsigned)'h']) {
       cout << endl
            << endl;
@@ -1087,6 +1649,9 @@ int
       std::cout << ". Copyright C " << COPYRIGHT_YEAR << ", the University of Southern California.\n";
       return 0;
     }
+    std::string serve_path;
+    if (cm.set_text("serve", serve_path))  // the -b input acceptor, but from requests rather than stdin
+      flags[(unsigned)'s'] = flags[(unsigned)'b'] = 1;
     if (flags[(unsigned)'b'] && kPaths < 1) kPaths = 1;
     istream** inputs, **files, **newed_inputs;
     char const** filenames;
@@ -1132,6 +1697,12 @@ int
 #endif
     if (trainc) flags[(unsigned)'t'] = 1;
     if (flags[(unsigned)'t']) flags[(unsigned)'S'] = 1;
+    if (!serve_path.empty()) {
+      if (flags[(unsigned)'S'])
+        throw std::runtime_error("--serve answers S requests, but can't train or -S score a file");
+      if (char const* why = cm.not_concurrent(remember_cascade))
+        throw std::runtime_error(std::string("--serve can't answer requests concurrently: ") + why);
+    }
     if (nChain < 1 || (flags[(unsigned)'A'] && nInputs < 2)) {
       Config::warn() << "No inputs supplied.\n";
       return -12;
@@ -1194,7 +1765,7 @@ int
     for (i = 0; i < nInputs; ++i) {
       if (i != nTarget) {
         WFST* w = chain + i;
-        PLACEMENT_NEW(w) WFST(*inputs[i], !flags[(unsigned)'K']);
+        PLACEMENT_NEW(w) WFST(*inputs[i], !flags[(unsigned)'K'], inputs[i] != &cin ? filenames[i] : 0);
         cm.fem_add(w, filenames[i]);
         if (i < exponents.size()) w->raisePower(exponents[i]);
         if (!flags[(unsigned)'m'] && nInputs > 1) w->unNameStates();
@@ -1243,11 +1814,36 @@ int
 
     cm.fem_in();
 
-    if (cm.no_compose) {
+    std::vector<WFST*> lazy_chain;
+    std::vector<std::vector<Weight> > lazy_completions(nChain);  // kept for all but the input line
+    if (cm.lazy_compose_ok(chain, nChain, nTarget, kPaths))
+      for (i = 0; i < nChain; ++i) lazy_chain.push_back(chain + i);
+
+    unsigned batch_threads = ~nTarget && cm.batch_threads_ok(remember_cascade) ? train_opt.threads : 0;
+
+    WFST* cached = 0;  // --cache-cascade
+    if (~nTarget && cm.cache_cascade_ok(nChain, !lazy_chain.empty(), remember_cascade, !serve_path.empty())) {
+      double max_arcs = 1e7;
+      cm.get_opt("cache-cascade-max-arcs", max_arcs);
+      cached = cm.compose_cached(chain, nChain, nTarget, max_arcs);
+    }
+
+    if (!serve_path.empty()) {
+      serve_requests requests(cm, flags, chain, nChain, nTarget, nInputs, kPaths, filenames,
+                              lazy_chain.empty() ? 0 : &lazy_completions[0], train_opt.semiring);
+      requests.run(serve_path);
+    } else if (cm.no_compose) {
       cm.fem_stats();
     } else {
       if (cm.have_opt("cascade-stats")) cm.fem_stats();
       for (;;) {  // input transducer from string line reading loop
+        if (batch_threads) {  // all the lines at once instead
+          batch_lines lines(cm, flags, chain, nChain, nTarget, nInputs, kPaths, filenames, *line_in,
+                            lazy_chain.empty() ? 0 : &lazy_completions[0], batch_threads, cached);
+          if (!lines.run(batch_threads)) return -3;
+          input_lineno = lines.n_lines;
+          break;
+        }
         if (~nTarget) {  // if to construct a finite state from input
           if (!*line_in) {
           fail_ntarget:
@@ -1298,8 +1894,38 @@ int
 
         unsigned n_compositions = 0;
         bool first = true;
-        cascade.add(result);
         bool anycomposed = false;
+        if (!lazy_chain.empty()) {
+          result = NEW WFST();
+          if (~nTarget) lazy_completions[nTarget].clear();
+          unsigned n_expanded
+              = result->set_compose_lazy(&lazy_chain[0], nChain, kPaths, r, &lazy_completions[0]);
+          if (!flags[(unsigned)'q'])
+            Config::log() << "\n\t(lazy: " << n_expanded << " states expanded, " << result->size() << " states / "
+                          << result->numArcs() << " arcs kept" << std::flush;
+          if (result->valid())
+            cm.shrink(result, true, false, false, ")");
+          else if (!flags[(unsigned)'q'])
+            Config::log() << ")";
+          if (!flags[(unsigned)'q']) Config::log() << std::endl;
+          cm.print_kbest(kPaths, result);
+          goto nextInput;
+        }
+        if (cached) {  // --cache-cascade: composing with the rest of the cascade is the last step
+          result = r ? NEW WFST(*cached, *result) : NEW WFST(*result, *cached);
+          if (!flags[(unsigned)'q'])
+            Config::log() << "\n\t(" << result->size() << " states / " << result->numArcs() << " arcs"
+                          << std::flush;
+          if (!result->valid())
+            Config::warn() << ")\nEmpty or invalid result of composition with --cache-cascade.\n";
+          else {
+            cm.shrink(result, true, kPaths <= 0, false, ")");
+            if (!flags[(unsigned)'q']) Config::log() << std::endl;
+          }
+          cm.print_kbest(kPaths, result);
+          goto nextInput;
+        }
+        cascade.add(result);
         for (i = (r ? nChain - 2 : 1); (r ? ~i : i < nChain) && result->valid();
              (r ? --i : ++i), first = false) {
           // composition loop
@@ -1392,7 +2018,13 @@ int
         if (!flags[(unsigned)'b']) {
           if (flags[(unsigned)'S']) {
             n_pairs = 0;
-            if (pairStream) {
+            if (pairStream && train_opt.threads > 1) {
+              scored_pairs pairs(*result, *pairStream, train_opt.semiring, input_lineno);
+              pairs.run(train_opt.threads);
+              n_pairs = pairs.n_pairs;
+              prod_prob *= pairs.prod_prob;
+            } else if (pairStream) {
+              WFST::path_sums sums(*result, train_opt.semiring);
               for (;;) {
                 getline(*pairStream, buf);
                 if (!*pairStream) break;
@@ -1402,7 +2034,7 @@ int
                 if (!*pairStream) break;
                 ++input_lineno;
                 WFST::symbol_ids outs(*result, buf.c_str(), kOutput, input_lineno);
-                Weight prob = result->sumOfAllPaths(ins, outs);
+                Weight prob = sums(ins, outs);
                 ++n_pairs;
                 prod_prob *= prob;
                 cout << prob << std::endl;
@@ -1410,7 +2042,7 @@ int
             } else {
               List<unsigned> empty_list;
               n_pairs = 1;
-              cout << (prod_prob = result->sumOfAllPaths(empty_list, empty_list)) << std::endl;
+              cout << (prod_prob = result->sumOfAllPaths(empty_list, empty_list, train_opt.semiring)) << std::endl;
             }
           } else if (flags[(unsigned)'t']) {
             show_seed();
@@ -1522,6 +2154,12 @@ int
           chain[nTarget].~WFST();
         if (!flags[(unsigned)'b']) break;
       }  // end of all input
+      if (cached) {
+        Config::log() << "--cache-cascade: " << input_lineno << " input lines composed with the cascade's other "
+                      << nChain - 1 << " transducers composed once (" << cached->size() << " states / "
+                      << cached->numArcs() << " arcs)\n";
+        delete cached;
+      }
       cm.report_batch();
     }
 
@@ -1650,8 +2288,8 @@ void usageHelp(void) {
           "results\n\t\tdefault seed = current time\n-L n\t\twhile generating input/output p";
   cout << "airs with -g or -G, give up if\n\t\tfinal state isn't reached after n steps (default n=1000)\n-T "
           "n\t\tduring composit";
-  cout << "ion, index arcs in a hash table when the\n\t\tproduct of the num";
-  cout << "ber of arcs of two states is greater than n \n\t\t(by default, n";
+  cout << "ion, merge join arcs sorted by the shared letter\n\t\twhen either ";
+  cout << "state has more than n arcs (by default, n";
   cout << " = 32)\n-N n\t\tassign each arc in the result transducer a uniq";
   cout << "ue parameter-tie group number\n\t\tstarting at n and counting up.  If n is 0 (";
   cout << "the special group\n\t\tfor unchangeable arcs), all the arcs are ";
@@ -1749,6 +2387,19 @@ void usageHelp(void) {
           "--final-restart-tolerance (exponentially) and then holds constant from restarts N,N+1,...\n";
 
   cout << "\n\n--final-sink : if needed, add a new final state with no outgoing arcs\n";
+  cout << "\n--write-binary : write the result transducer in carmel's binary format, which reads much faster "
+          "(mmapped, no text to parse or symbols to look up, though the arcs are still copied into the usual "
+          "per-state lists, so the whole file is read before it's usable).  binary transducer files are recognized automatically wherever a "
+          "transducer is read\n";
+  cout << "\n--lazy-compose : with -b -k, compose the cascade for each input lazily: composed states are built "
+          "only as the best-first k-best search reaches them, instead of composing everything first.  needs "
+          "arc weights <= 1 (else ignored); state numbers in -k output refer to the partial composition\n";
+  cout << "\n--cache-cascade : with -b, compose the transducers other than the input lines once (reducing after "
+          "each step) instead of for every line, which is then composed with just that.  the same paths, but "
+          "-k state numbers refer to the cached composition.  ignored with -m -C -p and the options that keep "
+          "-b --threads to one line at a time\n";
+  cout << "\n--cache-cascade-max-arcs=1e7 : bounds the memory --cache-cascade keeps: if composing the other "
+          "transducers gives more arcs than this, it's ignored\n";
   cout << "\n--consolidate-max : for -C, use max instead of sum for duplicate arcs\n";
   cout << "\n--consolidate-unclamped : for -C sums, clamp result to max of 1\n";
   cout << "\n--project-left : replace arc x:y with x:*e*\n";
@@ -1770,9 +2421,42 @@ void usageHelp(void) {
           "unique-filename-making string.  the file will be deleted after training completes\n"
           "\n"
           "--disk-cache-bufsize=1M : unless 0, replace the default file read buffer with one of this many "
-          "bytes (k=1000, K = 1024, M=1024K, etc)"
+          "bytes (k=1000, K = 1024, M=1024K, etc).  also how far (in bytes of derivations) training reads the disk "
+          "cache ahead on a background thread; at least one block is always read ahead\n"
+          "\n"
+          "--disk-cache-format=packed : how the disk cache stores derivations: packed (compact varint records "
+          "read in place, default), lz4 (packed, in LZ4 compressed blocks: smaller files for a little cpu), or "
+          "serialize (the old in-memory layout; --crp always uses this)"
           "\n--cache-no-prune : don't prune unreachable states in derivation cache (not recommended)."
-          "\n";
+          "\n"
+          "\n--threads=1 : (training) split each iteration's forward/backward, and computing the -? or -: cached "
+          "derivations, over this many threads; results depend only on the number of threads, not on scheduling.  "
+          "normalizing (-n, and after each iteration) splits the states over them, with the same result as one "
+          "thread.  with -b, composes (and prints the -k best of) this many input lines at once, and with -S sums this "
+          "many pairs at once; output is in input order, and the latency percentiles per line/pair are logged.  "
+          "-b falls back to one line at a time with -a -A -N -% -v -n -1 -c --sum --post-b --constant-weight "
+          "--random-set --final-sink --openfst-roundtrip --minimize-compositions --train-cascade or "
+          "--compose-cascade (the same output either way)\n"
+          "\n--serve=socket : keep the cascade loaded and answer requests, one per line, on the Unix socket, each "
+          "connection on its own thread.  \"b [k] symbols\": the k (default -k) best paths of the cascade "
+          "composed with the symbols, as -b; \"k n\": the n best paths of the cascade; \"S in TAB out\": the sum "
+          "of paths for the pair, as -S; \"quit\"; \"shutdown\".  answers are \"ok n\" then n lines, or "
+          "\"error message\".  see carmel/carmel-client.pl\n"
+          "\n--online-em : (training) stepwise EM: reestimate weights after each --minibatch of examples rather "
+          "than once per pass over the corpus.  the counts used are the previous ones interpolated with the "
+          "minibatch's (scaled up to the size of the corpus), which get weight (k+2)^-alpha at the k-th update.  "
+          "each pass is an iteration for -M and the perplexity ratio; passes are sequential (--threads only "
+          "computes the cached derivations).  a pass's perplexity is of each example under the weights as it "
+          "was seen, but the weights kept for the best pass (the ones finally used) are those at its end, which "
+          "weren't measured.  ignores -o, and not with --matrix-fb\n"
+          "\n--minibatch=1000 : (with --online-em) examples per update\n"
+          "\n--stepsize-alpha=.7 : (with --online-em) step size decay; .5 < alpha <= 1 for convergence.  smaller "
+          "forgets the counts from older (worse) weights faster\n"
+          "\n--semiring=log : (training, -S) how paths are summed: log (default), tropical (only the best path: "
+          "Viterbi EM, and -S gives the best path's weight; no log-add), or real (double precision, faster; an "
+          "example that underflows is done in log space).  not with --matrix-fb\n"
+          "\n--compose-threads=1 : (if >1) compose (without -a) using this many threads, a breadth first level of "
+          "states at a time; result states are then numbered breadth first, the same for any number of threads\n";
   cout << "\n"
           "--exponents=2,.1 : comma separated list of exponents, applied left to right to the input WFSTs "
           "(including stdin if -s).  if more inputs than exponents, use (noop) exponent of 1.  this differs "
@@ -1828,6 +2512,10 @@ void usageHelp(void) {
          "--crp-restarts : number of additional runs (0 means just 1 run), using cache-prob at the final "
          "iteration select the best for .trained and --print-to output.  --init-em affects each start.  "
          "TESTME: print-every with path weights may screw up start weights\n"
+         "--gibbs-threads=1 : (if >1) approximate parallel sampling: each thread resamples a contiguous share "
+         "of the examples against its own copy of the counts from the start of the iteration; samples are "
+         "merged in example order after every iteration, and the drift from exact sequential sampling is "
+         "logged.  needs the derivations in memory (-? or -:)\n"
          "--high-temp=n : (default 1) raise probs to 1/temp power before making each choice - deterministic "
          "annealing for --unsupervised\n"
          "--low-temp=n : (default 1) temperature at final iteration (linear interpolation from high->low)\n"
@@ -4,13 +4,18 @@
 #include <carmel/src/fst.h>
 #include <carmel/src/cascade.h>
 #include <graehl/shared/array.hpp>
+#include <graehl/shared/parallel_workers.hpp>
+#include <algorithm>
 #include <cstring>
+#include <queue>
+#include <vector>
 
 namespace graehl {
 
 unsigned WFST::indexThreshold = 12;
-unsigned TrioKey::gAStates = 0;
-unsigned TrioKey::gBStates = 0;
+unsigned WFST::compose_threads = 1;
+THREADLOCAL unsigned TrioKey::gAStates = 0;
+THREADLOCAL unsigned TrioKey::gBStates = 0;
 
 
 // FIXME: use stringstream so there are no artifical name length limits
@@ -160,7 +165,313 @@ WFST::WFST(WFST& a, WFST& b, bool namedStates, bool preserveGroups) {
 }
 
 
+namespace {
+
+/// an arc out of a state of the composition a*b, before its destination has a state number
+struct composed_arc {
+  enum { from_l = 1, from_r = 2, from_lr = 3 };  // made from an a arc, a b arc, or both
+  TrioKey dest;
+  unsigned in, out;
+  Weight weight;
+  char from;
+  FSTArc const* l, * r;
+  unsigned dest_id;  // if it was already numbered when found (see compose_levels), else -1
+  composed_arc(TrioKey const& dest, unsigned in, unsigned out, Weight weight, char from, FSTArc const* l,
+               FSTArc const* r)
+      : dest(dest), in(in), out(out), weight(weight), from(from), l(l), r(r), dest_id((unsigned)-1) {}
+  /// the cascade parameter group (see cascade_parameters::record) - must be called in state number order
+  FSTArc::group_t group(cascade_parameters& cascade) const {
+    return from == from_l ? cascade.record1(l) : from == from_r ? cascade.record2(r) : cascade.record(l, r);
+  }
+};
+typedef std::vector<composed_arc> composed_arcs;
+
+/// the arcs out of a state of a*b under set_compose's 3 state filter, in the order set_compose numbers their
+/// destinations.  when either state has more than WFST::indexThreshold arcs, the smaller state's arcs (sorted by
+/// the shared letter) are merge joined with the larger's frozen layout
+struct compose3 {
+  enum { from_l = composed_arc::from_l, from_r = composed_arc::from_r, from_lr = composed_arc::from_lr };
+  WFST& a, & b;
+  unsigned const* map, * revMap;
+  frozen_arcs const* fa, * fb;
+  mapped_arcs a_by_b, b_by_a;
+  std::vector<frozen_arcs::range> joined;
+
+  compose3(WFST& a, WFST& b, unsigned const* map, unsigned const* revMap)
+      : a(a)
+      , b(b)
+      , map(map)
+      , revMap(revMap)
+      , fa()
+      , fb()
+      , a_by_b(a.states, a.numStates(), kOutput, map)
+      , b_by_a(b.states, b.numStates(), kInput, revMap) {}
+
+  /// so that expand doesn't change a or b, and copies may expand concurrently
+  void freeze() {
+    fa = &a.freeze(kOutput);
+    fb = &b.freeze(kInput);
+  }
+
+  void expand(TrioKey const& triSource, composed_arcs& arcs) {
+    unsigned const EMPTY = WFST::epsilon_index;
+    unsigned in, out;
+    Weight weight;
+    TrioKey triDest;
+    frozen_arcs::range m;
+#define COMPOSE3_ARC(from, l, r) arcs.push_back(composed_arc(triDest, in, out, weight, from, l, r))
+    State* larger;
+    State* qa = &a.states[triSource.qa], * qb = &b.states[triSource.qb];
+    if (qa->size > qb->size) {
+      larger = qa;
+    } else {
+      larger = qb;
+    }
+    if (larger->size > WFST::indexThreshold) {
+      // merge join the smaller state's arcs, sorted by the shared letter, with the larger's frozen layout
+      if (larger == qa) {
+        if (!fa) fa = &a.freeze(kOutput);
+      } else if (!fb)
+        fb = &b.freeze(kInput);
+      if (larger == qb) {  // qb (rhs transducer) is larger
+        mapped_arcs::range as = a_by_b.sorted(triSource.qa);
+        fb->join(triSource.qb, as.first, as.second, joined);
+        unsigned i = 0;
+        for (List<FSTArc>::const_iterator l = qa->arcs.const_begin(), end = qa->arcs.const_end(); l != end;
+             ++l, ++i) {
+          in = l->in;
+          triDest.qa = l->dest;
+          if (l->out == EMPTY) {
+            if (triSource.filter != 2) {
+              out = EMPTY;
+              weight = l->weight;
+              triDest.filter = 1;
+              triDest.qb = triSource.qb;
+              COMPOSE3_ARC(from_l, &*l, 0);
+            }
+            if (triSource.filter == 0)
+              if ((m = joined[i]).first != m.second) {
+                triDest.filter = 0;
+                for (frozen_arcs::iterator r = m.first; r != m.second; ++r) {
+                  Assert((*r)->in == EMPTY);
+                  out = (*r)->out;
+                  weight = l->weight * (*r)->weight;
+                  triDest.qb = (*r)->dest;
+                  COMPOSE3_ARC(from_lr, &*l, *r);
+                }
+              }
+          } else {
+            if ((m = joined[i]).first != m.second) {
+              triDest.filter = 0;
+              for (frozen_arcs::iterator r = m.first; r != m.second; ++r) {
+                Assert(map[l->out] == (*r)->in);
+                out = (*r)->out;  // FIXME: uninit
+                weight = l->weight * (*r)->weight;
+                triDest.qb = (*r)->dest;
+                COMPOSE3_ARC(from_lr, &*l, *r);
+              }
+            }
+          }
+        }
+        if (triSource.filter != 1 && (m = fb->matches(triSource.qb, EMPTY)).first != m.second) {
+          in = EMPTY;
+          triDest.qa = triSource.qa;
+          triDest.filter = 2;
+          for (frozen_arcs::iterator r = m.first; r != m.second; ++r) {
+            Assert((*r)->in == EMPTY);
+            out = (*r)->out;
+            weight = (*r)->weight;
+            triDest.qb = (*r)->dest;
+            COMPOSE3_ARC(from_r, 0, *r);
+          }
+        }
+      } else {  // qa (lhs transducer) is larger
+        // FIXME: total duplicated code from above case, except switching order of in/out.  a macro could
+        // factor this w/ no runtime cost
+        mapped_arcs::range bs = b_by_a.sorted(triSource.qb);
+        fa->join(triSource.qa, bs.first, bs.second, joined);
+        unsigned i = 0;
+        for (List<FSTArc>::const_iterator r = qb->arcs.const_begin(), end = qb->arcs.const_end(); r != end;
+             ++r, ++i) {
+          out = r->out;
+          triDest.qb = r->dest;
+          if (r->in == EMPTY) {
+            if (triSource.filter != 1) {
+              in = EMPTY;
+              weight = r->weight;
+              triDest.filter = 2;
+              triDest.qa = triSource.qa;
+              COMPOSE3_ARC(from_r, 0, &*r);
+            }
+            if (triSource.filter == 0)
+              if ((m = joined[i]).first != m.second) {
+                triDest.filter = 0;
+                for (frozen_arcs::iterator l = m.first; l != m.second; ++l) {
+                  Assert((*l)->out == EMPTY);
+                  in = (*l)->in;
+                  weight = (*l)->weight * r->weight;
+                  triDest.qa = (*l)->dest;
+                  COMPOSE3_ARC(from_lr, *l, &*r);
+                }
+              }
+          } else {
+            triDest.filter = 0;
+            if ((m = joined[i]).first != m.second) {
+              for (frozen_arcs::iterator l = m.first; l != m.second; ++l) {
+                Assert(map[(*l)->out] == r->in);
+                in = (*l)->in;
+                weight = (*l)->weight * r->weight;
+                triDest.qa = (*l)->dest;
+                COMPOSE3_ARC(from_lr, *l, &*r);
+              }
+            }
+          }
+        }
+        if (triSource.filter != 2 && (m = fa->matches(triSource.qa, EMPTY)).first != m.second) {
+          out = EMPTY;
+          triDest.qb = triSource.qb;
+          triDest.filter = 1;
+          for (frozen_arcs::iterator l = m.first; l != m.second; ++l) {
+            Assert((*l)->out == EMPTY);
+            in = (*l)->in;
+            weight = (*l)->weight;
+            triDest.qa = (*l)->dest;
+            COMPOSE3_ARC(from_l, *l, 0);
+          }
+        }
+      }
+    } else {  // both states too small to bother hashing
+      for (List<FSTArc>::const_iterator l = qa->arcs.const_begin(), end = qa->arcs.const_end(); l != end;
+           ++l) {
+        in = l->in;
+        triDest.qa = l->dest;
+        if (l->out == EMPTY) {
+          if (triSource.filter != 2) {
+            out = EMPTY;
+            weight = l->weight;
+            triDest.filter = 1;
+            triDest.qb = triSource.qb;
+            COMPOSE3_ARC(from_l, &*l, 0);
+          }
+          if (triSource.filter == 0) {
+            for (List<FSTArc>::const_iterator r = qb->arcs.const_begin(), end = qb->arcs.const_end();
+                 r != end; ++r) {
+              if (r->in == EMPTY) {
+                out = r->out;
+                weight = l->weight * r->weight;
+                triDest.qb = r->dest;
+                triDest.filter = 0;
+                COMPOSE3_ARC(from_lr, &*l, &*r);
+              }
+            }
+          }
+        } else {
+          triDest.filter = 0;
+          for (List<FSTArc>::const_iterator r = qb->arcs.const_begin(), end = qb->arcs.const_end();
+               r != end; ++r) {
+            if (map[l->out] == r->in) {
+              out = r->out;
+              weight = l->weight * r->weight;
+              triDest.qb = r->dest;
+              COMPOSE3_ARC(from_lr, &*l, &*r);
+            }
+          }
+        }
+      }
+      if (triSource.filter != 1) {
+        in = EMPTY;
+        triDest.qa = triSource.qa;
+        triDest.filter = 2;
+        for (List<FSTArc>::const_iterator r = qb->arcs.const_begin(), end = qb->arcs.const_end(); r != end;
+             ++r) {
+          if (r->in == EMPTY) {
+            out = r->out;
+            weight = r->weight;
+            triDest.qb = r->dest;
+            COMPOSE3_ARC(from_r, 0, &*r);
+          }
+        }
+      }
+    }
+#undef COMPOSE3_ARC
+  }
+};
+
+/// for compose_levels: worker w expands its share of a level into arcs[w], with ends[w] the end of each source
+/// state's arcs, and looks up the destinations already numbered (stateMap isn't changed while workers run)
+struct compose_level_worker {
+  std::vector<compose3>& xs;
+  std::vector<TrioKey> const& level;
+  HashTable<TrioKey, unsigned> const& stateMap;
+  std::vector<composed_arcs>& arcs;
+  std::vector<std::vector<unsigned> >& ends;
+  std::size_t n;
+  unsigned a_states, b_states;  // the composing thread's TrioKey::gAStates, gBStates
+  void operator()(std::size_t w) {
+    TrioKey::gAStates = a_states;
+    TrioKey::gBStates = b_states;
+    worker_range_type r = worker_range(w, n, level.size());
+    composed_arcs& out = arcs[w];
+    out.clear();
+    ends[w].clear();
+    for (std::size_t i = r.first; i < r.second; ++i) {
+      xs[w].expand(level[i], out);
+      ends[w].push_back(out.size());
+    }
+    unsigned const* id;
+    for (composed_arcs::iterator a = out.begin(), end = out.end(); a != end; ++a)
+      if ((id = find_second(stateMap, a->dest))) a->dest_id = *id;
+  }
+};
+
+/* --compose-threads: the rest of set_compose's 3 state filter composition (state 0 already numbered), a breadth
+   first level at a time.  the level is split among n_threads copies of x; then, in level order, new
+   destinations are numbered and the arcs are added to c.  so states are numbered breadth first (unlike the
+   serial depth first order) but identically for any number of threads.
+*/
+void compose_levels(WFST& c, compose3& x, unsigned n_threads, cascade_parameters& cascade,
+                    HashTable<TrioKey, unsigned>& stateMap, TrioNamer& namer, bool namedStates) {
+  typedef HashTable<TrioKey, unsigned> HT;
+  x.freeze();
+  std::vector<compose3> xs(n_threads, x);
+  std::vector<composed_arcs> arcs(n_threads);
+  std::vector<std::vector<unsigned> > ends(n_threads);
+  std::vector<TrioKey> level(1, TrioKey(0, 0, 0)), next;
+  unsigned source = 0;
+  while (!level.empty()) {
+    std::size_t n = std::min<std::size_t>(n_threads, (level.size() + 63) / 64);  // >= 64 states per worker
+    compose_level_worker work = {xs, level, stateMap, arcs, ends, n, TrioKey::gAStates, TrioKey::gBStates};
+    run_workers(work, n);
+    next.clear();
+    for (std::size_t w = 0; w < n; ++w) {
+      composed_arcs const& out = arcs[w];
+      std::vector<unsigned> const& e = ends[w];
+      for (unsigned i = 0, a = 0; i < e.size(); ++i, ++source)
+        for (; a < e[i]; ++a) {
+          composed_arc const& arc = out[a];
+          unsigned dest = arc.dest_id;
+          if (dest == (unsigned)-1) {
+            hash_traits<HT>::insert_result_type ins = stateMap.insert(HT::value_type(arc.dest, c.numStates()));
+            if (ins.second) {
+              push_back(c.states);
+              next.push_back(arc.dest);
+              if (namedStates)
+                c.stateNames.add(namer.make(arc.dest.qa, arc.dest.qb, arc.dest.filter), ins.first->second);
+            }
+            dest = ins.first->second;
+          }
+          c.states[source].addArc(FSTArc(arc.in, arc.out, dest, arc.weight, arc.group(cascade)));
+        }
+    }
+    level.swap(next);
+  }
+}
+
+
+}
+
 void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool namedStates, bool preserveGroups) {
+  thaw();
   deleteAlphabet();
   owner_alph[0] = owner_alph[1] = 0;
   alph[0] = a.alph[0];
@@ -322,180 +633,25 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
        2->0 or 1->0 : a:c from a:b (l) b:c (r) where b != *e*
     */
 
-    while (queue.notEmpty()) {
-      sourceState = queue.top().num;
-      triSource = queue.top().tri;
-      queue.pop();
-      State* larger;
-      State* qa = &a.states[triSource.qa], * qb = &b.states[triSource.qb];
-      if (qa->size > qb->size) {
-        larger = qa;
-      } else {
-        larger = qb;
-      }
-      if (larger->size > WFST::indexThreshold) {
-        larger->indexBy(larger == qa ? kOutput : kInput);  // create hash table
-        if (larger == qb) {  // qb (rhs transducer) is larger
-          for (List<FSTArc>::const_iterator l = qa->arcs.const_begin(), end = qa->arcs.const_end(); l != end;
-               ++l) {
-            in = l->in;
-            triDest.qa = l->dest;
-            if (l->out == EMPTY) {
-              if (triSource.filter != 2) {
-                out = EMPTY;
-                weight = l->weight;
-                triDest.filter = 1;
-                triDest.qb = triSource.qb;
-                COMPOSEARC_GROUP(cascade.record1(&*l));
-              }
-              if (triSource.filter == 0)
-                if ((matches = find_second(*qb->index, (UnsignedKey)EMPTY))) {
-                  triDest.filter = 0;
-                  for (List<HalfArc>::const_iterator r = matches->const_begin(), end = matches->const_end();
-                       r != end; ++r) {
-                    Assert((*r)->in == EMPTY);
-                    out = (*r)->out;
-                    weight = l->weight * (*r)->weight;
-                    triDest.qb = (*r)->dest;
-                    COMPOSEARC_GROUP(cascade.record(&*l, *r));
-                  }
-                }
-            } else {
-              if ((matches = find_second(*qb->index, (UnsignedKey)map[l->out]))) {
-                triDest.filter = 0;
-                for (List<HalfArc>::const_iterator r = matches->const_begin(), end = matches->const_end();
-                     r != end; ++r) {
-                  Assert(map[l->out] == (*r)->in);
-                  out = (*r)->out;  // FIXME: uninit
-                  weight = l->weight * (*r)->weight;
-                  triDest.qb = (*r)->dest;
-                  COMPOSEARC_GROUP(cascade.record(&*l, *r));
-                }
-              }
-            }
-          }
-          if (triSource.filter != 1 && (matches = find_second(*qb->index, (UnsignedKey)EMPTY))) {
-            in = EMPTY;
-            triDest.qa = triSource.qa;
-            triDest.filter = 2;
-            for (List<HalfArc>::const_iterator r = matches->const_begin(), end = matches->const_end();
-                 r != end; ++r) {
-              Assert((*r)->in == EMPTY);
-              out = (*r)->out;
-              weight = (*r)->weight;
-              triDest.qb = (*r)->dest;
-              COMPOSEARC_GROUP(cascade.record2(*r));
-            }
-          }
-        } else {  // qa (lhs transducer) is larger
-          // FIXME: total duplicated code from above case, except switching order of in/out.  a macro could
-          // factor this w/ no runtime cost
-          for (List<FSTArc>::const_iterator r = qb->arcs.const_begin(), end = qb->arcs.const_end(); r != end;
-               ++r) {
-            out = r->out;
-            triDest.qb = r->dest;
-            if (r->in == EMPTY) {
-              if (triSource.filter != 1) {
-                in = EMPTY;
-                weight = r->weight;
-                triDest.filter = 2;
-                triDest.qa = triSource.qa;
-                COMPOSEARC_GROUP(cascade.record2(&*r));
-              }
-              if (triSource.filter == 0)
-                if ((matches = find_second(*qa->index, (UnsignedKey)EMPTY))) {
-                  triDest.filter = 0;
-                  for (List<HalfArc>::const_iterator l = matches->const_begin(), end = matches->const_end();
-                       l != end; ++l) {
-                    Assert((*l)->out == EMPTY);
-                    in = (*l)->in;
-                    weight = (*l)->weight * r->weight;
-                    triDest.qa = (*l)->dest;
-                    COMPOSEARC_GROUP(cascade.record(*l, &*r));
-                  }
-                }
-            } else {
-              triDest.filter = 0;
-              if ((matches = find_second(*qa->index, (UnsignedKey)revMap[r->in]))) {
-                for (List<HalfArc>::const_iterator l = matches->const_begin(), end = matches->const_end();
-                     l != end; ++l) {
-                  Assert(map[(*l)->out] == r->in);
-                  in = (*l)->in;
-                  weight = (*l)->weight * r->weight;
-                  triDest.qa = (*l)->dest;
-                  COMPOSEARC_GROUP(cascade.record(*l, &*r));
-                }
-              }
-            }
-          }
-          if (triSource.filter != 2 && (matches = find_second(*qa->index, (UnsignedKey)EMPTY))) {
-            out = EMPTY;
-            triDest.qb = triSource.qb;
-            triDest.filter = 1;
-            for (List<HalfArc>::const_iterator l = matches->const_begin(), end = matches->const_end();
-                 l != end; ++l) {
-              Assert((*l)->out == EMPTY);
-              in = (*l)->in;
-              weight = (*l)->weight;
-              triDest.qa = (*l)->dest;
-              COMPOSEARC_GROUP(cascade.record1(*l));
-            }
-          }
-        }
-      } else {  // both states too small to bother hashing
-        for (List<FSTArc>::const_iterator l = qa->arcs.const_begin(), end = qa->arcs.const_end(); l != end;
-             ++l) {
-          in = l->in;
-          triDest.qa = l->dest;
-          if (l->out == EMPTY) {
-            if (triSource.filter != 2) {
-              out = EMPTY;
-              weight = l->weight;
-              triDest.filter = 1;
-              triDest.qb = triSource.qb;
-              COMPOSEARC_GROUP(cascade.record1(&*l));
-            }
-            if (triSource.filter == 0) {
-              for (List<FSTArc>::const_iterator r = qb->arcs.const_begin(), end = qb->arcs.const_end();
-                   r != end; ++r) {
-                if (r->in == EMPTY) {
-                  out = r->out;
-                  weight = l->weight * r->weight;
-                  triDest.qb = r->dest;
-                  triDest.filter = 0;
-                  COMPOSEARC_GROUP(cascade.record(&*l, &*r));
-                }
-              }
-            }
-          } else {
-            triDest.filter = 0;
-            for (List<FSTArc>::const_iterator r = qb->arcs.const_begin(), end = qb->arcs.const_end();
-                 r != end; ++r) {
-              if (map[l->out] == r->in) {
-                out = r->out;
-                weight = l->weight * r->weight;
-                triDest.qb = r->dest;
-                COMPOSEARC_GROUP(cascade.record(&*l, &*r));
-              }
-            }
-          }
-        }
-        if (triSource.filter != 1) {
-          in = EMPTY;
-          triDest.qa = triSource.qa;
-          triDest.filter = 2;
-          for (List<FSTArc>::const_iterator r = qb->arcs.const_begin(), end = qb->arcs.const_end(); r != end;
-               ++r) {
-            if (r->in == EMPTY) {
-              out = r->out;
-              weight = r->weight;
-              triDest.qb = r->dest;
-              COMPOSEARC_GROUP(cascade.record2(&*r));
-            }
-          }
+    compose3 x(a, b, map, revMap);
+    composed_arcs arcs;
+    if (compose_threads > 1)
+      compose_levels(*this, x, compose_threads, cascade, stateMap, namer, namedStates);
+    else
+      while (queue.notEmpty()) {
+        sourceState = queue.top().num;
+        triSource = queue.top().tri;
+        queue.pop();
+        arcs.clear();
+        x.expand(triSource, arcs);
+        for (composed_arcs::const_iterator e = arcs.begin(), end = arcs.end(); e != end; ++e) {
+          triDest = e->dest;
+          in = e->in;
+          out = e->out;
+          weight = e->weight;
+          COMPOSEARC_GROUP(e->group(cascade));
         }
       }
-    }
   }
   delete[] map;
   delete[] revMap;
@@ -531,4 +687,285 @@ void WFST::set_compose(cascade_parameters& cascade, WFST& a, WFST& b, bool named
 }
 
 
+// lazy composition of a whole cascade, nested from one end: m[0] is chain[0] (or chain[n-1] if right nested)
+// and levels[d-1] holds the states of m[d-1]...m[0] composed with m[d] that have been reached so far, keyed by
+// (inner state, m[d] state, filter), and the arcs of those that have been expanded.  expanding a state of
+// level d expands its inner state in level d-1 first, so the intermediate compositions are only ever built
+// as far as the top level search needs them.  arcs into states that can't reach final in one of the
+// transducers (h = 0) are dropped as they're found.  the inner side plays the role of the lhs in set_compose's 3
+// state filter either way, which is still a correct epsilon filter when it's really the rhs.
+namespace {
+struct lazy_level {
+  WFST* b;
+  frozen_arcs const* fb;
+  std::vector<Weight> const* hb;  // b's bestCompletions
+  std::vector<Weight> h;  // product of the bestCompletions of the state's components
+  std::vector<unsigned> map;  // inner side's matched letter -> b's (~0 if none)
+  HashTable<LazyTrioKey, unsigned> ids;
+  std::vector<TrioKey> keys;
+  std::vector<std::vector<FSTArc> > arcs;
+  std::vector<char> expanded;
+};
+
+struct lazy_path {
+  Weight f, g;  // f = g (path so far) * h (bound on the rest)
+  unsigned s;
+  lazy_path(Weight f, Weight g, unsigned s) : f(f), g(g), s(s) {}
+  bool operator<(lazy_path const& o) const { return f < o.f || (f == o.f && s > o.s); }  // best on top
+};
+
+struct lazy_cascade {
+  enum { final_path = ~0u };
+  bool right;
+  std::vector<WFST*> m;
+  std::vector<lazy_level> levels;
+  std::vector<Weight> const* h0;
+  unsigned n_expanded;
+
+  // m and their bestCompletions hs in nesting order
+  lazy_cascade(std::vector<WFST*> const& m, std::vector<std::vector<Weight>*> const& hs, bool right)
+      : right(right), m(m), levels(m.size() - 1), h0(hs[0]), n_expanded(0) {
+    unsigned n = m.size();
+    for (unsigned d = 1; d < n; ++d) {
+      levels[d - 1].hb = hs[d];
+      levels[d - 1].fb = 0;
+    }
+    LabelType inner = right ? kInput : kOutput, outer = right ? kOutput : kInput;
+    for (unsigned d = 1; d < n; ++d) {
+      lazy_level& L = levels[d - 1];
+      L.b = m[d];
+      WFST::alphabet_type& a = m[d - 1]->alphabet(inner);
+      L.map.resize(a.size());
+      a.computeMap(L.b->alphabet(outer), &L.map[0]);
+      id(d, TrioKey(0, 0, 0), h(d, TrioKey(0, 0, 0)));
+    }
+  }
+
+  Weight h(unsigned d, unsigned s) const { return d == 0 ? (*h0)[s] : levels[d - 1].h[s]; }
+  Weight h(unsigned d, TrioKey const& t) const { return (*levels[d - 1].hb)[t.qb] * h(d - 1, t.qa); }
+
+  unsigned id(unsigned d, TrioKey const& t, Weight ht) {
+    lazy_level& L = levels[d - 1];
+    hash_traits<HashTable<LazyTrioKey, unsigned> >::insert_result_type i
+        = L.ids.insert(HashTable<LazyTrioKey, unsigned>::value_type(t, L.keys.size()));
+    if (i.second) {
+      L.keys.push_back(t);
+      L.h.push_back(ht);
+      L.arcs.push_back(std::vector<FSTArc>());
+      L.expanded.push_back(0);
+    }
+    return i.first->second;
+  }
+
+  bool is_final(unsigned d, unsigned s) const {
+    if (d == 0) return s == m[0]->final;
+    TrioKey const& t = levels[d - 1].keys[s];
+    return t.qb == levels[d - 1].b->final && is_final(d - 1, t.qa);
+  }
+
+  // arcs out of state s of level d>0; valid until the next expansion in level d
+  std::vector<FSTArc> const& arcs(unsigned d, unsigned s) {
+    lazy_level& L = levels[d - 1];
+    if (!L.expanded[s]) {
+      L.expanded[s] = 1;
+      ++n_expanded;
+      std::vector<FSTArc> out;
+      TrioKey t = L.keys[s];
+      if (d == 1) {
+        State::Arcs const& la = m[0]->states[t.qa].arcs;
+        compose_state(d, t, la.const_begin(), la.const_end(), out);
+      } else {
+        std::vector<FSTArc> const& la = arcs(d - 1, t.qa);
+        compose_state(d, t, la.begin(), la.end(), out);
+      }
+      L.arcs[s].swap(out);
+    }
+    return L.arcs[s];
+  }
+
+  unsigned matched(FSTArc const& inner) const { return right ? inner.in : inner.out; }
+  unsigned matched_b(FSTArc const& b) const { return right ? b.out : b.in; }
+
+  // composed arc from the unmatched letters of the inner side and b
+  void add(unsigned d, std::vector<FSTArc>& out, unsigned inner, unsigned b, TrioKey const& dest, Weight w) {
+    Weight hd = h(d, dest);
+    if (hd.isZero()) return;
+    unsigned dest_id = id(d, dest, hd);
+    out.push_back(right ? FSTArc(b, inner, dest_id, w) : FSTArc(inner, b, dest_id, w));
+  }
+
+  // b arcs out of qb matching letter, as in set_compose: looked up in the frozen layout for large states
+  template <class F>
+  void matches(lazy_level& L, unsigned qb_id, State& qb, unsigned letter, F& f) {
+    if (qb.size > WFST::indexThreshold) {
+      if (!L.fb) L.fb = &L.b->freeze(right ? kOutput : kInput);
+      frozen_arcs::range ms = L.fb->matches(qb_id, letter);
+      for (frozen_arcs::iterator r = ms.first; r != ms.second; ++r) f(**r);
+    } else
+      for (State::Arcs::const_iterator r = qb.arcs.const_begin(), end = qb.arcs.const_end(); r != end; ++r)
+        if (matched_b(*r) == letter) f(*r);
+  }
+
+  struct emit {
+    lazy_cascade& c;
+    unsigned d;
+    std::vector<FSTArc>& out;
+    unsigned inner;
+    TrioKey dest;
+    Weight w;
+    emit(lazy_cascade& c, unsigned d, std::vector<FSTArc>& out) : c(c), d(d), out(out) {}
+    void operator()(FSTArc const& b) {
+      dest.qb = b.dest;
+      c.add(d, out, inner, c.right ? b.in : b.out, dest, w * b.weight);
+    }
+  };
+
+  template <class InnerArcs>
+  void compose_state(unsigned d, TrioKey const& src, InnerArcs l, InnerArcs end, std::vector<FSTArc>& out) {
+    const unsigned EMPTY = WFST::epsilon_index;
+    lazy_level& L = levels[d - 1];
+    State& qb = L.b->states[src.qb];
+    emit e(*this, d, out);
+    for (; l != end; ++l) {
+      unsigned letter = matched(*l);
+      e.inner = right ? l->out : l->in;
+      e.dest.qa = l->dest;
+      e.w = l->weight;
+      if (letter == EMPTY) {
+        if (src.filter != 2) add(d, out, e.inner, EMPTY, TrioKey(l->dest, src.qb, 1), l->weight);
+        if (src.filter == 0) {
+          e.dest.filter = 0;
+          matches(L, src.qb, qb, EMPTY, e);
+        }
+      } else {
+        e.dest.filter = 0;
+        matches(L, src.qb, qb, L.map[letter], e);
+      }
+    }
+    if (src.filter != 1) {
+      e.inner = EMPTY;
+      e.dest.qa = src.qa;
+      e.dest.filter = 2;
+      e.w.setOne();
+      matches(L, src.qb, qb, EMPTY, e);
+    }
+  }
+};
+}
+
+Weight WFST::maxArcWeight() const {
+  Weight m;
+  for (unsigned s = 0, n = numStates(); s < n; ++s)
+    for (State::Arcs::const_iterator a = states[s].arcs.const_begin(), end = states[s].arcs.const_end(); a != end;
+         ++a)
+      if (m < a->weight) m = a->weight;
+  return m;
+}
+
+unsigned WFST::set_compose_lazy(WFST** chain, unsigned n, unsigned k, bool right_nested,
+                                std::vector<Weight>* completions) {
+  Assert(n > 1 && k > 0);
+  thaw();
+  deleteAlphabet();
+  owner_alph[0] = owner_alph[1] = 0;
+  alph[0] = chain[0]->alph[0];
+  alph[1] = chain[n - 1]->alph[1];
+  named_states = false;
+  states.clear();
+  for (unsigned j = 0; j < n; ++j)
+    if (!chain[j]->valid()) {
+      invalidate();
+      return 0;
+    }
+
+  std::vector<std::vector<Weight> > own_completions;
+  if (!completions) {
+    own_completions.resize(n);
+    completions = &own_completions[0];
+  }
+  std::vector<WFST*> m(n);
+  std::vector<std::vector<Weight>*> hs(n);
+  for (unsigned d = 0; d < n; ++d) {
+    unsigned j = right_nested ? n - 1 - d : d;
+    m[d] = chain[j];
+    hs[d] = &completions[j];
+    if (hs[d]->empty()) m[d]->bestCompletions(*hs[d]);
+  }
+
+  // the innermost composition (usually the input with its neighbor) is small, so it's built in full and
+  // reduced: that gives an exact heuristic for it, where the product of completions would let the search
+  // wander into states that can't finish the input
+  unsigned n_composed = 0;
+  WFST inner;
+  std::vector<Weight> inner_completions;
+  if (n > 2) {
+    cascade_parameters trivial;
+    if (right_nested)
+      inner.set_compose(trivial, *m[1], *m[0]);
+    else
+      inner.set_compose(trivial, *m[0], *m[1]);
+    n_composed = inner.size();
+    if (inner.valid()) inner.reduce();
+    if (!inner.valid()) {
+      invalidate();
+      return n_composed;
+    }
+    inner.bestCompletions(inner_completions);
+    m.erase(m.begin());
+    hs.erase(hs.begin());
+    m[0] = &inner;
+    hs[0] = &inner_completions;
+  }
+
+  // k shortest paths by A* search, allowing each state to be popped up to k times. a prefix of one of the k
+  // best paths is among the k best paths to its last state, so every state on those paths gets expanded; with
+  // arc weights <= 1 the heuristic is consistent and nothing popped later can improve on them.
+  unsigned const top = m.size() - 1;
+  lazy_cascade c(m, hs, right_nested);
+  std::vector<unsigned> n_pops;
+  std::priority_queue<lazy_path> queue;
+  queue.push(lazy_path(c.h(top, 0), Weight::ONE(), 0));
+  for (unsigned n_final = 0; !queue.empty();) {
+    lazy_path p = queue.top();
+    queue.pop();
+    if (p.s == (unsigned)lazy_cascade::final_path) {
+      if (++n_final == k) break;
+      continue;
+    }
+    if (p.s >= n_pops.size()) n_pops.resize(p.s + 1);
+    if (n_pops[p.s] == k) continue;
+    ++n_pops[p.s];
+    if (c.is_final(top, p.s)) queue.push(lazy_path(p.g, p.g, lazy_cascade::final_path));
+    std::vector<FSTArc> const& arcs = c.arcs(top, p.s);
+    for (std::vector<FSTArc>::const_iterator a = arcs.begin(), end = arcs.end(); a != end; ++a) {
+      Weight g = p.g * a->weight;
+      queue.push(lazy_path(g * c.h(top, a->dest), g, a->dest));
+    }
+  }
+
+  // the states reached so far, with arcs only out of the expanded ones
+  lazy_level& L = c.levels[top - 1];
+  unsigned n_reached = L.keys.size(), n_final = 0;
+  states.resize(n_reached);
+  for (unsigned s = 0; s < n_reached; ++s) {
+    std::vector<FSTArc> const& arcs = L.arcs[s];
+    for (std::vector<FSTArc>::const_iterator a = arcs.begin(), end = arcs.end(); a != end; ++a)
+      states[s].addArc(*a);
+    if (c.is_final(top, s)) {
+      ++n_final;
+      final = s;
+    }
+  }
+  if (n_final == 0) {
+    invalidate();
+  } else if (n_final > 1) {
+    final = numStates();
+    push_back(states);
+    for (unsigned s = 0; s < n_reached; ++s)
+      if (c.is_final(top, s)) states[s].addArc(FSTArc(epsilon_index, epsilon_index, final, 1.0, locked_group));
+  }
+  return n_composed + c.n_expanded;
+}
+
+
 }
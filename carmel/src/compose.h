@@ -3,13 +3,15 @@
 
 #include <graehl/shared/myassert.h>
 #include <graehl/shared/2hash.h>
+#include <graehl/shared/threadlocal.hpp>
 
 
 namespace graehl {
 
 struct TrioKey {
-  static unsigned gAStates;
-  static unsigned gBStates;
+  // set by set_compose for its hash function; per thread, so separate compositions may run at once
+  static THREADLOCAL unsigned gAStates;
+  static THREADLOCAL unsigned gBStates;
   unsigned qa;
   unsigned qb;
   char filter;
@@ -26,6 +28,14 @@ struct TrioKey {
 };
 
 
+/// TrioKey for lazy composition: hashed without gAStates/gBStates, since the lhs state count isn't known in
+/// advance and several compositions of a cascade are expanded at once
+struct LazyTrioKey : TrioKey {
+  LazyTrioKey() {}
+  LazyTrioKey(TrioKey const& t) : TrioKey(t) {}
+  size_t hash() const { return uint32_hash(qa ^ uint32_hash(3 * qb + filter)); }
+};
+
 struct HalfArcState {
   unsigned l_dest;  // in unshared (lhs) transducer
   unsigned r_source;  // in (rhs) transducer with the shared arcs
@@ -55,6 +65,11 @@ BEGIN_HASH(graehl::TrioKey) {
 }
 END_HASH
 
+BEGIN_HASH(graehl::LazyTrioKey) {
+  return x.hash();
+}
+END_HASH
+
 BEGIN_HASH(graehl::HalfArcState) {
   return x.hash();
 }
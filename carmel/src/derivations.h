@@ -26,6 +26,8 @@
 //#define GRAEHL__DEBUG_print
 #include <graehl/shared/debugprint.hpp>
 #include <graehl/shared/weight.h>
+#include <graehl/shared/threadlocal.hpp>
+#include <graehl/shared/random.hpp>
 #include <boost/utility.hpp>
 #include <graehl/shared/myassert.h>
 #include <graehl/shared/hashtable_fwd.hpp>
@@ -35,6 +37,7 @@
 #include <carmel/src/train.h>
 #include <graehl/shared/dynamic_array.hpp>
 #include <boost/cstdint.hpp>
+#include <limits>
 #include <graehl/shared/array.hpp>
 #include <graehl/shared/io.hpp>
 
@@ -155,6 +158,38 @@ struct wfst_io_index : boost::noncopyable {
 };
 
 
+/* the E-step's --semiring (WFST::path_semiring) as a type, for collect_counts: forward/backward sums (or for
+   a viterbi semiring, maxes) of paths are value_type, with arc id of an arcs_table t weighing weight(t,id).
+   a sum that isn't normal() (a double that underflowed) can't be used */
+struct log_paths {  // WFST::sum_semiring
+  typedef Weight value_type;
+  enum { viterbi = 0 };
+  template <class arcs_table>
+  Weight weight(arcs_table const& t, unsigned id) const {
+    return t[id].weight();
+  }
+  static bool normal(Weight) { return true; }
+};
+
+struct best_path : log_paths {  // WFST::max_semiring (Viterbi EM): max and log-space multiply only
+  enum { viterbi = 1 };
+};
+
+struct real_paths {  // WFST::real_semiring: sums of paths in double precision
+  typedef double value_type;
+  enum { viterbi = 0 };
+  double const* w;  // arc weights as doubles, indexed like the arcs_table
+  explicit real_paths(double const* w) : w(w) {}
+  template <class arcs_table>
+  double weight(arcs_table const&, unsigned id) const {
+    return w[id];
+  }
+  static bool normal(double p) {
+    return p >= std::numeric_limits<double>::min() && p <= std::numeric_limits<double>::max();
+  }
+};
+
+
 // all the derivations for one in/out pair through WFST x
 // note that the reverse graph and topo (cache_backward saves them) point to arcs directly via pointers, so
 // serialization omits those (forces cache_backward=false on load), so they're rebuilt when needed
@@ -227,6 +262,19 @@ struct derivations {
 
     states_arcs pre, post;
 
+    /// add the statistics another thread kept, as if its derivations were recorded after ours (pre.states
+    /// and, when pruning, post are the last derivation's)
+    void merge(statistics const& later) {
+      if (!later.N) return;
+      N += later.N;
+      sum_paths += later.sum_paths;
+      prod_paths *= later.prod_paths;
+      pruned = later.pruned;
+      pre.states = later.pre.states;
+      pre.arcs += later.pre.arcs;
+      post = pruned ? later.post : pre;
+    }
+
     void print(std::ostream& o) const {
       states_arcs ratio = post;
       ratio /= pre;
@@ -246,7 +294,7 @@ struct derivations {
     TO_OSTREAM_PRINT
   };
 
-  static statistics global_stats;
+  static THREADLOCAL statistics global_stats;  // per thread, so --threads E-step workers don't race
 
   double weight;
   unsigned lineno;
@@ -344,6 +392,13 @@ struct derivations {
   //  WeightFor is carmel_gibbs typically (or else p_init for EM init samples).  2 req listed below:
   template <class WeightFor>
   void random_path(WeightFor const& wf, double power = 1.) {
+    global_random rng;
+    random_path(wf, power, rng);
+  }
+
+  // as above, but choices are made by rng.choose_p (e.g. a per-thread graehl::random)
+  template <class WeightFor, class Random>
+  void random_path(WeightFor const& wf, double power, Random& rng) {
     if (empty()) return;
     unsigned nst = g.size();
     get_order();
@@ -365,8 +420,8 @@ struct derivations {
         normed[s] = true;
         pf.global_normalize(arcs.val_begin(), arcs.val_end(), power);
       }
-      GraphArc const& a = *choose_p(arcs.const_begin(), arcs.const_end(),
-                                    pf);  // no empty states allowed that aren't final.
+      GraphArc const& a = *rng.choose_p(arcs.const_begin(), arcs.const_end(),
+                                        pf);  // no empty states allowed that aren't final.
       // use the re-normalizing choose_p rather than choose_p01 to protect from rounding issues with
       // Weight::getReal sum to 1
       wf.choose_arc(a);  // req 2: wf.choose_arc(GraphArc a)
@@ -385,6 +440,7 @@ struct derivations {
     unsigned nst = g.size();
     fb_weights f(nst), b(nst);  // default 0-init
     Weight prob = compute_fb(f, b, gi);
+    check_fb_agree(prob, b[0]);
     for (unsigned s = 0; s < nst; ++s) {
       arcs_type const& arcs = g[s].arcs;
       for (arcs_type::const_iterator i = arcs.begin(), e = arcs.end(); i != e; ++i) {
@@ -397,25 +453,42 @@ struct derivations {
     return prob;
   }
 
-  template <class V>
-  Weight compute_fb(fb_weights& f, fb_weights& b, V& gi) {
+  template <class Array, class V>
+  typename Array::value_type compute_fb(Array& f, Array& b, V& gi) {
     assert(!empty());
     unsigned nst = g.size();
     f.reinit(nst);
     b.reinit(nst);
     f[0] = 1;
     get_order();
-    propagate_paths_in_order(graph(), reverse_order.rbegin(), reverse_order.rend(), gi, f);
-    Weight prob = f[fin];
     get_reverse();
+    gather_paths_in_order(r.graph(), reverse_order.rbegin(), reverse_order.rend(), gi, f);
+    typename Array::value_type prob = f[fin];
     b[fin] = 1;
-    propagate_paths_in_order(r.graph(), reverse_order.begin(), reverse_order.end(), gi, b);
+    gather_paths_in_order(graph(), reverse_order.begin(), reverse_order.end(), gi, b);
     free_order();
     free_reverse();
-    check_fb_agree(prob, b[0]);
     return prob;
   }
 
+  // as above, for real_paths: doubles are summed as they come (there's no log_sum_exp to batch them for)
+  template <class V>
+  double compute_fb(fixed_array<double>& f, fixed_array<double>& b, V& gi) {
+    assert(!empty());
+    unsigned nst = g.size();
+    f.reinit(nst, 0.);
+    b.reinit(nst, 0.);
+    f[0] = 1;
+    get_order();
+    get_reverse();
+    propagate_paths_in_order(graph(), reverse_order.rbegin(), reverse_order.rend(), gi, f);
+    b[fin] = 1;
+    propagate_paths_in_order(r.graph(), reverse_order.begin(), reverse_order.end(), gi, b);
+    free_order();
+    free_reverse();
+    return f[fin];
+  }
+
   template <class arcs_table>
   Weight prob(arcs_table& t) {
     weight_for<arcs_table> wf(t);
@@ -428,24 +501,102 @@ struct derivations {
     return prob;
   }
 
+  // as above, but the sum is over paths in semiring s (the best path's weight for WFST::max_semiring)
+  template <class arcs_table>
+  Weight prob(arcs_table& t, WFST::path_semiring s) {
+    if (s == WFST::max_semiring) {
+      weight_for<arcs_table> wf(t);
+      fb_weights b;
+      return best_to_fin(b, wf);
+    }
+    if (s == WFST::real_semiring) {
+      real_weights w(0., t.size());
+      for (unsigned i = 0, n = t.size(); i < n; ++i) w[i] = t[i].weight().getReal();
+      real_paths real(w.begin());
+      semiring_weight_for<real_paths, arcs_table> wf(real, t);
+      real_weights f(0., g.size());
+      f[0] = 1;
+      get_order();
+      propagate_paths_in_order(graph(), reverse_order.rbegin(), reverse_order.rend(), wf, f);
+      free_order();
+      if (real_paths::normal(f[fin])) return Weight(f[fin]);
+    }
+    return prob(t);
+  }
+
+  // b[s] = the weight of the best path from s to fin.  returns b[0]
+  template <class Array, class V>
+  typename Array::value_type best_to_fin(Array& b, V& gi) {
+    b.reinit(g.size());
+    get_order();
+    get_reverse();
+    b[fin] = 1;
+    propagate_paths_in_order(r.graph(), reverse_order.begin(), reverse_order.end(), gi, b, max_paths());
+    free_order();
+    free_reverse();
+    return b[0];
+  }
+
+  // arc weights as doubles, indexed like an arcs_table (for real_paths)
+  typedef fixed_array<double> real_weights;
+
+  // S's weight for a derivation arc (by its arcs_table id)
+  template <class S, class arcs_table>
+  struct semiring_weight_for {
+    S const& s;
+    arcs_table const& t;
+    semiring_weight_for(S const& s, arcs_table const& t) : s(s), t(t) {}
+    typename S::value_type operator()(GraphArc const& a) const { return s.weight(t, a.data_as<unsigned>()); }
+  };
+
+  // counts[id] is t[id].counts
+  template <class arcs_table>
+  struct counts_in_table {
+    arcs_table& t;
+    counts_in_table(arcs_table& t) : t(t) {}
+    Weight& operator[](unsigned id) const { return t[id].counts; }
+  };
+
   // update expected counts and return prob (sum of paths)
   template <class arcs_table>
   Weight collect_counts(arcs_table& t) {
-    //        update_weights(t);
-    weight_for<arcs_table> wf(t);
+    counts_in_table<arcs_table> counts(t);
+    return collect_counts(log_paths(), t, counts);
+  }
+
+  /* as above, but in semiring S (see log_paths), adding to counts[arc id] (e.g. a per-thread array) rather
+     than t: weight times the arc's expected count, or for S::viterbi, weight for each time the arc is on the
+     (first) best derivation.  returns the prob; if that isn't S::normal, 0, and nothing is counted */
+  template <class S, class arcs_table, class Counts>
+  Weight collect_counts(S const& semiring, arcs_table const& t, Counts& counts) {
+    typedef typename S::value_type W;
+    semiring_weight_for<S, arcs_table> wf(semiring, t);
     unsigned nst = g.size();
-    fb_weights f(nst), b(nst);  // default 0-init
-    Weight prob = compute_fb(f, b, wf);
-    for (unsigned s = 0; s < nst; ++s) {
-      arcs_type const& arcs = g[s].arcs;
-      for (arcs_type::const_iterator i = arcs.begin(), e = arcs.end(); i != e; ++i) {
-        GraphArc const& a = *i;
-        arc_counts& ac = wf.ac(a);
-        Weight arc_contrib = ac.weight() * f[a.src] * b[a.dest];
-        ac.counts += arc_contrib * weight / prob;
+    fixed_array<W> f, b;
+    W prob = S::viterbi ? best_to_fin(b, wf) : compute_fb(f, b, wf);
+    if (!S::normal(prob)) return Weight();
+    if (!S::viterbi) check_fb_agree(Weight(prob), Weight(b[0]));
+    if (S::viterbi) {
+      if (!(prob > W())) return Weight(prob);
+      W w(weight);
+      for (unsigned s = 0; s != fin;) {  // take the first arc that keeps the best completion b[s]
+        arcs_type const& arcs = g[s].arcs;
+        arcs_type::const_iterator i = arcs.begin(), e = arcs.end();
+        while (i != e && wf(*i) * b[i->dest] < b[s]) ++i;
+        assert(i != e);
+        counts[i->data_as<unsigned>()] += w;
+        s = i->dest;
       }
-    }
-    return prob;
+    } else
+      for (unsigned s = 0; s < nst; ++s) {
+        arcs_type const& arcs = g[s].arcs;
+        for (arcs_type::const_iterator i = arcs.begin(), e = arcs.end(); i != e; ++i) {
+          GraphArc const& a = *i;
+          W arc_contrib = wf(a) * f[a.src] * b[a.dest];
+          counts[a.data_as<unsigned>()] += arc_contrib * weight / prob;
+        }
+      }
+    return Weight(prob);
   }
 
 
@@ -522,6 +673,40 @@ struct derivations {
     }
   }
 
+  /// exchange derivations with o (cache_derivations computes on worker threads, then swaps into the cache).
+  /// id_of_state, scratch for compute, stays with its object
+  void swap(derivations& o) {
+    using std::swap;
+    swap(in, o.in);
+    swap(out, o.out);
+    swap(g, o.g);
+    swap(fin, o.fin);
+    swap(no_goal, o.no_goal);
+    swap(cache_backward, o.cache_backward);
+    swap(weight, o.weight);
+    swap(lineno, o.lineno);
+    swap(r.b, o.r.b);
+    swap(reverse_order, o.reverse_order);
+  }
+
+  // for packed_derivation (--disk-cache-derivations): the states in forward topological order (from start())
+  void forward_order(std::vector<unsigned>& order) {
+    get_order();
+    order.assign(reverse_order.rbegin(), reverse_order.rend());
+    free_order();
+  }
+
+  // for packed_derivation: replace the forest with n states and no arcs (add them with add_arc)
+  void reset(unsigned n, unsigned fin_, double w, unsigned line) {
+    init(Seq(), Seq(), w, line);
+    g.resize(n);
+    fin = fin_;
+    no_goal = false;
+  }
+
+  // arcs out of src are visited in the reverse of the order they're added
+  void add_arc(unsigned src, unsigned dest, FLOAT_TYPE w, unsigned id) { g[src].add_data_as(src, dest, w, id); }
+
   void free_extras()  // no longer needed after compute
   {
     cache_backward = false;
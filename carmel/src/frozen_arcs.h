@@ -0,0 +1,177 @@
+#ifndef GRAEHL_CARMEL__FROZEN_ARCS_H
+#define GRAEHL_CARMEL__FROZEN_ARCS_H
+
+/* read-optimized (CSR) layout of a WFST's arcs: for every state, the arcs sorted (stably) by input or output
+   letter, contiguous, with the state's range given by offsets.  the letters are kept in their own array so a
+   lookup is a binary search over unsigned, and the arcs are pointers to the FSTArc in the state's list, so
+   weights may still change (training, normalization) but adding, removing or relabeling arcs invalidates it -
+   see WFST::freeze.
+
+   takes the place of the per-state State::Index (a hash table of lists, one list node per arc) for
+   transducers that aren't being modified, e.g. the fixed transducers composed with every -b input.  the arc
+   lists stay, so freezing by a direction costs a pointer and a letter per arc on top of them.
+
+   it's an index, not a by-value copy that replaces the lists: an arc's address is its identity to the cascade
+   parameters (cascade_parameters::record*, keyed by FSTArc const*), the trainer's arcs_table, normalize (which
+   writes weights through these pointers) and makeGraph (GraphArc::data, for k-best paths), and copying arcs
+   here would split that identity or, for the lists to be dropped, move all of those onto this layout.  so
+   there's no memory saving, k-best and makeGraph still walk the lists, and the binary format (wfstio.cc) is
+   parsed into lists rather than served from the file.
+*/
+
+#include <graehl/shared/arc.h>
+#include <carmel/src/state.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+namespace graehl {
+
+/* the arcs of one side of a composition sorted by their shared letter as numbered in the other side's alphabet
+   (map), so they can be merge joined with the other side's frozen_arcs.  each entry remembers the arc's position
+   in its state's list, which is the order composition visits them in.  a state is sorted the first time it's
+   asked for, since only the states reached by the composition are needed.
+*/
+struct mapped_arcs {
+  struct entry {
+    unsigned letter;
+    unsigned pos;  // in the state's arc list
+    bool operator<(entry const& o) const { return letter < o.letter || (letter == o.letter && pos < o.pos); }
+  };
+  typedef entry const* iterator;
+  typedef std::pair<iterator, iterator> range;
+
+  template <class States>
+  mapped_arcs(States& states, unsigned n_states, LabelType dir, unsigned const* map)
+      : states(n_states ? &states[0] : 0), dir(dir), map(map), offsets(n_states, (unsigned)-1) {}
+
+  range sorted(unsigned s) {
+    if (offsets[s] == (unsigned)-1) build(s);
+    iterator b = entries.empty() ? 0 : &entries[0] + offsets[s];
+    return range(b, b + states[s].size);
+  }
+
+ private:
+  void build(unsigned s) {
+    unsigned b = offsets[s] = entries.size();
+    entry e;
+    e.pos = 0;
+    State::Arcs& sa = states[s].arcs;
+    for (State::Arcs::val_iterator a = sa.val_begin(), end = sa.val_end(); a != end; ++a, ++e.pos) {
+      e.letter = map[dir == kInput ? a->in : a->out];
+      entries.push_back(e);
+    }
+    std::sort(entries.begin() + b, entries.end());
+  }
+  State* states;
+  LabelType dir;
+  unsigned const* map;
+  std::vector<unsigned> offsets;  // into entries, or -1 if not sorted yet
+  std::vector<entry> entries;
+};
+
+struct frozen_arcs {
+  typedef FSTArc* const* iterator;
+  typedef std::pair<iterator, iterator> range;
+
+  LabelType dir;
+
+  template <class States>
+  frozen_arcs(States& states, unsigned n_states, LabelType dir)
+      : dir(dir), offsets(n_states + 1) {
+    unsigned n_arcs = 0;
+    for (unsigned s = 0; s < n_states; ++s) n_arcs += states[s].size;
+    arcs.reserve(n_arcs);
+    letters.reserve(n_arcs);
+    for (unsigned s = 0; s < n_states; ++s) {
+      offsets[s] = arcs.size();
+      State::Arcs& sa = states[s].arcs;
+      for (State::Arcs::val_iterator a = sa.val_begin(), end = sa.val_end(); a != end; ++a) arcs.push_back(&*a);
+      // same order within a letter as State::Index (reversed), so compositions come out the same
+      std::reverse(arcs.begin() + offsets[s], arcs.end());
+      std::stable_sort(arcs.begin() + offsets[s], arcs.end(), by_letter(dir));
+    }
+    offsets[n_states] = arcs.size();
+    for (unsigned i = 0, n = arcs.size(); i < n; ++i) letters.push_back(letter(*arcs[i]));
+  }
+
+  unsigned letter(FSTArc const& a) const { return dir == kInput ? a.in : a.out; }
+
+  iterator begin(unsigned s) const { return arcs.empty() ? 0 : &arcs[0] + offsets[s]; }
+  iterator end(unsigned s) const { return arcs.empty() ? 0 : &arcs[0] + offsets[s + 1]; }
+  unsigned size(unsigned s) const { return offsets[s + 1] - offsets[s]; }
+
+  /// the arcs out of s with letter l
+  range matches(unsigned s, unsigned l) const {
+    unsigned const* b = letters.empty() ? 0 : &letters[0];
+    std::pair<unsigned const*, unsigned const*> r = std::equal_range(b + offsets[s], b + offsets[s + 1], l);
+    iterator a = arcs.empty() ? 0 : &arcs[0];
+    return range(a + (r.first - b), a + (r.second - b));
+  }
+
+  /// matched[e.pos] = the arcs out of s with letter e.letter, for each e in [a, a_end) (sorted).  a galloping
+  /// merge: linear when both sides are about the same size, and logarithmic in the gaps when one is much smaller
+  void join(unsigned s, mapped_arcs::iterator a, mapped_arcs::iterator a_end, std::vector<range>& matched) const {
+    matched.resize(a_end - a);
+    if (a == a_end) return;
+    unsigned const* b = letters.empty() ? 0 : &letters[0];
+    unsigned const* i = b + offsets[s], * end = b + offsets[s + 1];
+    iterator arc0 = arcs.empty() ? 0 : &arcs[0];
+    range none(arc0, arc0);
+    while (a != a_end) {
+      unsigned l = a->letter;
+      range m = none;
+      if (l != (unsigned)-1) {  // else not in this alphabet at all
+        i = gallop(i, end, l);
+        unsigned const* j = i;
+        while (j != end && *j == l) ++j;
+        m = range(arc0 + (i - b), arc0 + (j - b));
+        i = j;
+      }
+      for (; a != a_end && a->letter == l; ++a) matched[a->pos] = m;
+    }
+  }
+
+ private:
+  /// first position in [i, end) that isn't < l, probing i, i+1, i+3, i+7 ... and then binary searching
+  static unsigned const* gallop(unsigned const* i, unsigned const* end, unsigned l) {
+    unsigned const* lo = i;
+    for (std::size_t step = 1; i < end && *i < l; step *= 2) {
+      lo = i + 1;
+      i = (std::size_t)(end - i) > step ? i + step : end;
+    }
+    return std::lower_bound(lo, i, l);
+  }
+  struct by_letter {
+    LabelType dir;
+    by_letter(LabelType dir) : dir(dir) {}
+    bool operator()(FSTArc const* a, FSTArc const* b) const {
+      return dir == kInput ? a->in < b->in : a->out < b->out;
+    }
+  };
+  std::vector<unsigned> offsets;  // arcs of s are [offsets[s], offsets[s+1])
+  std::vector<unsigned> letters;
+  std::vector<FSTArc*> arcs;
+};
+
+/// a WFST's frozen layouts by input and output letter, or 0.  copies start out empty
+struct frozen_arcs_cache {
+  frozen_arcs* by[2];
+  frozen_arcs_cache() { by[0] = by[1] = 0; }
+  frozen_arcs_cache(frozen_arcs_cache const&) { by[0] = by[1] = 0; }
+  frozen_arcs_cache& operator=(frozen_arcs_cache const&) {
+    clear();
+    return *this;
+  }
+  ~frozen_arcs_cache() { clear(); }
+  void clear() {
+    for (unsigned d = 0; d < 2; ++d) {
+      delete by[d];
+      by[d] = 0;
+    }
+  }
+};
+
+}
+
+#endif
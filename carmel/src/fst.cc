@@ -4,6 +4,7 @@
 #include <graehl/shared/kbest.h>
 #include <graehl/shared/array.hpp>
 #include <graehl/shared/genio.h>
+#include <graehl/shared/parallel_workers.hpp>
 
 namespace graehl {
 
@@ -18,76 +19,205 @@ THREADLOCAL int WFST::default_arc_format = WFST::BRIEF;
 // http://www.cs.berkeley.edu/~pliang/papers/tutorial-acl2007.pdf
 
 void WFST::pruneArcs(Weight thresh) {
+  thaw();
   for (unsigned s = 0, n = numStates(); s < n; ++s) states[s].prune(thresh);
 }
 
 unsigned WFST::generate(unsigned* inSeq, unsigned* outSeq, unsigned minArcs, unsigned bufLen) {
   unsigned i, o, nArcs;
   unsigned s;
-  indexInput();
+  random_arcs& choices = random_choices();
   unsigned maxArcs = bufLen - 1;
   i = o = s = nArcs = 0;
   for (;;) {
     if (s == final && (states[s].arcs.isEmpty() || nArcs >= minArcs)) {
       inSeq[i] = outSeq[o] = 0;
-      indexFlush();
       return 1;
     }
-    unsigned whichInput = (unsigned)(states[s].index->size() * randomFloat());
-    const HashTable<UnsignedKey, List<HalfArc> >& hat = *states[s].index;
-    for (HashTable<UnsignedKey, List<HalfArc> >::const_iterator ha = hat.begin(); ha != hat.end(); ++ha)
-      if (!whichInput--) {
-        Weight which = randomFloat();
-        Weight cum;
+    std::vector<random_arcs::choice> const& by_input = choices[s].by_input;
+    if (by_input.empty()) return 0;
+    unsigned whichInput = (unsigned)(by_input.size() * randomFloat());
+    if (whichInput >= by_input.size()) whichInput = by_input.size() - 1;
+    FSTArc const& a = *by_input[whichInput](randomFloat(), randomFloat());
+    if (a.in) {
+      if (i >= maxArcs) return 0;
+      inSeq[i++] = a.in;
+    }
+    if (a.out) {
+      if (o >= maxArcs) return 0;
+      outSeq[o++] = a.out;
+    }
+    s = a.dest;
+    ++nArcs;
+  }
+}
 
-        List<HalfArc>::const_iterator a, begin = ha->second.const_begin(), end = ha->second.const_end();
+template <class charT, class Traits>
+std::basic_ostream<charT, Traits>& operator<<(std::basic_ostream<charT, Traits>& os, const NormGroupIter& arg) {
+  return gen_inserter(os, arg);
+}
 
-        for (a = begin; a != end; ++a) {
-          cum += (*a)->weight;
+namespace {
+typedef HashTable<UnsignedKey, Weight> tie_totals;
+
+// a tied arc's contribution to its tie group's totals (normalize pass 1)
+struct tie_share {
+  unsigned group;
+  Weight arc, state_sum, locked_sum;
+};
+
+// normalize pass 1 over worker t's range of states: add the prior count and sum each normalization group.
+// the tied arcs' shares are kept (in order) so they can be added up in the same order as with one thread
+struct normalize_sums {
+  WFST& x;
+  WFST::norm_group_by group;
+  frozen_arcs const* by_input;
+  Weight addc;
+  std::vector<std::vector<tie_share> > shares;
+  normalize_sums(WFST& x, WFST::norm_group_by group, frozen_arcs const* by_input, Weight addc, unsigned n)
+      : x(x), group(group), by_input(by_input), addc(addc), shares(n) {}
+
+  void operator()(std::size_t t) {
+    std::vector<tie_share>& out = shares[t];
+    worker_range_type r = worker_range(t, shares.size(), x.numStates());
+#include <graehl/shared/warning_push.h>
+    GCC_DIAG_IGNORE(maybe-uninitialized)
+    for (NormGroupIter g(group, x, by_input, r.first, r.second); g.moreGroups(); g.nextGroup()) {
+#include <graehl/shared/warning_pop.h>
+#ifdef DEBUGNORMALIZE
+      Config::debug() << "Normgroup=" << g;
+#endif
+      Weight sum, locked_sum;  // =0, sum of probability of all arcs that has this input
+      for (g.beginArcs(); g.moreArcs(); g.nextArc()) {
+        FSTArc& a = **g;
+        Weight& w = a.weight;
+        w += addc;
+        if (WFST::isLocked(a.groupId))  // note: training does not set any counts for locked arcs.  so this is
+          // the original weight
+          locked_sum += w;
+        else {
+          sum += w;
         }
-        which *= cum;
-        cum.setZero();
-        for (a = begin; a != end; ++a) {
-          if ((cum += (*a)->weight) >= which) {
-            if ((*a)->in) {
-              if (i >= maxArcs)
-                goto bad;
-              else
-                inSeq[i++] = (*a)->in;
-            }
-
-            if ((*a)->out) {
-              if (o >= maxArcs)
-                goto bad;
-              else
-                outSeq[o++] = (*a)->out;
-            }
-
-            s = (*a)->dest;
-            ++nArcs;
-            break;
-          }
+      }
+#ifdef DEBUGNORMALIZE
+      Config::debug() << " locked_sum=" << locked_sum << " sum=" << sum << std::endl;
+#endif
+      for (g.beginArcs(); g.moreArcs(); g.nextArc()) {
+        FSTArc const& a = **g;
+        if (WFST::isTied(a.groupId)) {
+          tie_share t = {a.groupId, a.weight, sum, locked_sum};
+          out.push_back(t);
         }
-        if (a == end) {
-        bad:
-          indexFlush();
-          return 0;
+      }
+    }
+  }
+};
+
+// normalize pass 2 over worker t's range of states: assign weights, given the tie group totals
+struct normalize_assign {
+  WFST& x;
+  WFST::norm_group_by group;
+  frozen_arcs const* by_input;
+  graehl::mean_field_scale const& scale;
+  bool uniform_zero_normgroups;
+  tie_totals const &groupArcTotal, &groupStateTotal, &groupMaxLockedSum;
+  unsigned n;
+
+  void operator()(std::size_t t) const {
+    worker_range_type r = worker_range(t, n, x.numStates());
+    unsigned pGroup;
+#include <graehl/shared/warning_push.h>
+    GCC_DIAG_IGNORE(maybe-uninitialized)
+    for (NormGroupIter g(group, x, by_input, r.first, r.second); g.moreGroups(); g.nextGroup()) {
+#include <graehl/shared/warning_pop.h>
+      Weight normal_sum;  //=0
+      Weight reserved;  // =0
+      Assert(reserved.isZero() && normal_sum.isZero());
+      // pass 2a: assign tied (and locked) arcs their weights, taking 'reserved' weight from the normal arcs in
+      // their group
+      // tied arc weight = sum (over arcs in tie group) of weight / sum (over arcs in tie group) of
+      // norm-group-total-weight
+      // also, compute sum of normal arcs
+      for (g.beginArcs(); g.moreArcs(); g.nextArc()) {
+        FSTArc& a = **g;
+        if (WFST::isTied(pGroup = a.groupId)) {  // tied:
+          Weight groupNorm
+              = *find_second(groupStateTotal,
+                             (UnsignedKey)pGroup);  // can be 0 if no counts at all for any states of group
+          Weight gmax = *find_second(groupMaxLockedSum, (UnsignedKey)pGroup);
+          NANCHECK(gmax);
+          Weight one(1.);
+          if (gmax > one) {
+            a.weight.setZero();
+          } else {
+            if (!gmax.isZero())
+              groupNorm /= (one - gmax);  // as described in NEW plan above: ensure tied arcs leave room for the
+            // worst case competing locked arcs sum in any norm-group
+            NANCHECK(groupNorm);
+
+            Weight groupTotal = *find_second(groupArcTotal, (UnsignedKey)pGroup);
+            NANCHECK(groupTotal);
+            if (!groupTotal.isZero()) {  // then groupNorm non0 also
+              a.weight = scale(groupTotal) / scale(groupNorm);
+
+              reserved += a.weight;
+            } else
+              a.weight.setZero();
+            NANCHECK(reserved);
+          }
+        } else if (WFST::isLocked(pGroup)) {  // locked:
+          reserved += a.weight;
+          NANCHECK(reserved);
+        } else {  // normal
+          normal_sum += a.weight;
         }
-        break;
       }
+
+#ifdef DEBUGNORMALIZE
+      if (reserved > 1.001)
+        Config::warn() << "Warning: sum of reserved arcs for " << g << " = " << reserved
+                       << " - should not exceed 1.0\n";
+#endif
+
+      // pass 2b: give normal arcs their share of however much is left
+      Weight fraction_remain = 1.;
+      fraction_remain -= reserved;
+      NANCHECK(fraction_remain);
+      bool something_left_for_normal = !fraction_remain.isZero();
+      if (something_left_for_normal && (uniform_zero_normgroups || !normal_sum.isZero())) {
+        NANCHECK(normal_sum);
+        Weight scaled_sum = scale(normal_sum);
+        for (g.beginArcs(); g.moreArcs(); g.nextArc()) {
+          FSTArc& a = **g;
+          if (WFST::isNormal(a.groupId)) {
+            a.weight = fraction_remain * scale(a.weight) / scaled_sum;
+            NANCHECK(a.weight);
+          }
+        }
+      } else  // nothing left, sorry
+        for (g.beginArcs(); g.moreArcs(); g.nextArc()) {
+          FSTArc& a = **g;
+          if (WFST::isNormal(a.groupId)) a.weight.setZero();
+        }
+    }
   }
-}
+};
 
-template <class charT, class Traits>
-std::basic_ostream<charT, Traits>& operator<<(std::basic_ostream<charT, Traits>& os, const NormGroupIter& arg) {
-  return gen_inserter(os, arg);
+// below this many states per thread, normalize isn't split
+unsigned const normalize_min_states_per_thread = 1024;
 }
 
 void WFST::normalize(NormalizeMethod const& method, bool uniform_zero_normgroups) {
   norm_group_by group = method.group;
 
   if (group == NONE) return;
-  if (group == CONDITIONAL) indexInput();
+  reweighted();
+  frozen_arcs const* by_input = 0;
+  bool thaw_after = false;
+  if (group == CONDITIONAL) {  // a conditional normgroup is a run of arcs with the same input
+    thaw_after = !frozen_by(kInput);
+    by_input = &freeze(kInput);
+  }
 
   graehl::mean_field_scale const& scale = method.scale;
 
@@ -104,133 +234,42 @@ void WFST::normalize(NormalizeMethod const& method, bool uniform_zero_normgroups
   //   room for locked ones in ALL states and should leave some room for normal arcs as well
   // step 4: give normal arcs their share of what's left, if anything
 
-  Weight addc = method.add_count;
-  unsigned pGroup;
-  HashTable<UnsignedKey, Weight> groupArcTotal;
-  HashTable<UnsignedKey, Weight> groupStateTotal;
-  HashTable<UnsignedKey, Weight> groupMaxLockedSum;
-// global pass 1: compute the sum of unnormalized weights for each normalization group.  sum for each arc in
-// a tie group, its weight and its normalization group's weight.
-#include <graehl/shared/warning_push.h>
-  GCC_DIAG_IGNORE(maybe-uninitialized)
-  for (NormGroupIter g(group, *this); g.moreGroups(); g.nextGroup()) {
-#include <graehl/shared/warning_pop.h>
+  // the states are split into contiguous ranges, one per thread.  groups never span states, so only the tie
+  // group totals need combining, which is done in state order
+  unsigned n = std::min(method.threads, numStates() / normalize_min_states_per_thread);
+  if (n < 1) n = 1;
+
+  tie_totals groupArcTotal;
+  tie_totals groupStateTotal;
+  tie_totals groupMaxLockedSum;
+  // global pass 1: compute the sum of unnormalized weights for each normalization group.  sum for each arc in
+  // a tie group, its weight and its normalization group's weight.
+  normalize_sums sums(*this, group, by_input, method.add_count, n);
+  run_workers(sums, n);
+  for (unsigned t = 0; t < n; ++t)
+    for (std::vector<tie_share>::const_iterator i = sums.shares[t].begin(), e = sums.shares[t].end(); i != e;
+         ++i) {
+      unsigned pGroup = i->group;
+      groupArcTotal[pGroup] += i->arc;  // default init is to 0
+      groupStateTotal[pGroup] += i->state_sum;
+      Weight& m = groupMaxLockedSum[pGroup];
+      if (i->locked_sum > m) m = i->locked_sum;
+      NANCHECK(groupStateTotal[pGroup]);
+      NANCHECK(groupMaxLockedSum[pGroup]);
 #ifdef DEBUGNORMALIZE
-    Config::debug() << "Normgroup=" << g;
+      Config::debug() << "Tiegroup=" << pGroup << " tie_weight=" << groupArcTotal[pGroup]
+                      << " sum_state_weight=" << groupStateTotal[pGroup] << " max_locked=" << m << std::endl;
 #endif
-    Weight sum, locked_sum;  // =0, sum of probability of all arcs that has this input
-    for (g.beginArcs(); g.moreArcs(); g.nextArc()) {
-      FSTArc& a = **g;
-      Weight& w = a.weight;
-      w += addc;
-      if (isLocked(a.groupId))  // note: training does not set any counts for locked arcs.  so this is the
-        // original weight
-        locked_sum += w;
-      else {
-        sum += w;
-      }
-    }
-#ifdef DEBUGNORMALIZE
-    Config::debug() << " locked_sum=" << locked_sum << " sum=" << sum << std::endl;
-#endif
-    for (g.beginArcs(); g.moreArcs(); g.nextArc()) {
-      FSTArc const& a = **g;
-      if (isTied(pGroup = a.groupId)) {
-        groupArcTotal[pGroup] += a.weight;  // default init is to 0
-        groupStateTotal[pGroup] += sum;
-        Weight& m = groupMaxLockedSum[pGroup];
-        if (locked_sum > m) m = locked_sum;
-        NANCHECK(groupStateTotal[pGroup]);
-        NANCHECK(groupStateTotal[pGroup]);
-        NANCHECK(groupMaxLockedSum[pGroup]);
-#ifdef DEBUGNORMALIZE
-        Config::debug() << "Tiegroup=" << pGroup << " Normgroup=" << g
-                        << " tie_weight=" << groupArcTotal[pGroup]
-                        << " sum_state_weight=" << groupStateTotal[pGroup] << " max_locked=" << m << std::endl;
-#endif
-      }
-    }
-  }
-
-
-// global pass 2: assign weights
-#include <graehl/shared/warning_push.h>
-  GCC_DIAG_IGNORE(maybe-uninitialized)
-  for (NormGroupIter g(group, *this); g.moreGroups(); g.nextGroup()) {
-#include <graehl/shared/warning_pop.h>
-    Weight normal_sum;  //=0
-    Weight reserved;  // =0
-    Assert(reserved.isZero() && normal_sum.isZero());
-    // pass 2a: assign tied (and locked) arcs their weights, taking 'reserved' weight from the normal arcs in
-    // their group
-    // tied arc weight = sum (over arcs in tie group) of weight / sum (over arcs in tie group) of
-    // norm-group-total-weight
-    // also, compute sum of normal arcs
-    for (g.beginArcs(); g.moreArcs(); g.nextArc()) {
-      FSTArc& a = **g;
-      if (isTied(pGroup = a.groupId)) {  // tied:
-        Weight groupNorm
-            = *find_second(groupStateTotal,
-                           (UnsignedKey)pGroup);  // can be 0 if no counts at all for any states of group
-        Weight gmax = *find_second(groupMaxLockedSum, (UnsignedKey)pGroup);
-        NANCHECK(gmax);
-        Weight one(1.);
-        if (gmax > one) {
-          a.weight.setZero();
-        } else {
-          if (!gmax.isZero())
-            groupNorm /= (one - gmax);  // as described in NEW plan above: ensure tied arcs leave room for the
-          // worst case competing locked arcs sum in any norm-group
-          NANCHECK(groupNorm);
-
-          Weight groupTotal = *find_second(groupArcTotal, (UnsignedKey)pGroup);
-          NANCHECK(groupTotal);
-          if (!groupTotal.isZero()) {  // then groupNorm non0 also
-            a.weight = scale(groupTotal) / scale(groupNorm);
-
-            reserved += a.weight;
-          } else
-            a.weight.setZero();
-          NANCHECK(reserved);
-        }
-      } else if (isLocked(pGroup)) {  // locked:
-        reserved += a.weight;
-        NANCHECK(reserved);
-      } else {  // normal
-        normal_sum += a.weight;
-      }
     }
 
-#ifdef DEBUGNORMALIZE
-    if (reserved > 1.001)
-      Config::warn() << "Warning: sum of reserved arcs for " << g << " = " << reserved
-                     << " - should not exceed 1.0\n";
-#endif
-
-    // pass 2b: give normal arcs their share of however much is left
-    Weight fraction_remain = 1.;
-    fraction_remain -= reserved;
-    NANCHECK(fraction_remain);
-    bool something_left_for_normal = !fraction_remain.isZero();
-    if (something_left_for_normal && (uniform_zero_normgroups || !normal_sum.isZero())) {
-      NANCHECK(normal_sum);
-      Weight scaled_sum = scale(normal_sum);
-      for (g.beginArcs(); g.moreArcs(); g.nextArc()) {
-        FSTArc& a = **g;
-        if (isNormal(a.groupId)) {
-          a.weight = fraction_remain * scale(a.weight) / scaled_sum;
-          NANCHECK(a.weight);
-        }
-      }
-    } else  // nothing left, sorry
-      for (g.beginArcs(); g.moreArcs(); g.nextArc()) {
-        FSTArc& a = **g;
-        if (isNormal(a.groupId)) a.weight.setZero();
-      }
-  }
+  // global pass 2: assign weights
+  normalize_assign assign
+      = {*this, group, by_input, scale, uniform_zero_normgroups, groupArcTotal, groupStateTotal, groupMaxLockedSum,
+         n};
+  run_workers(assign, n);
 
 #ifdef CHECKNORMALIZE
-  for (NormGroupIter g(group, *this); g.moreGroups(); g.nextGroup()) {
+  for (NormGroupIter g(group, *this, by_input); g.moreGroups(); g.nextGroup()) {
     Weight sum;
     for (g.beginArcs(); g.moreArcs(); g.nextArc()) sum += (*g)->weight;
 #define NORM_EPSILON .01
@@ -240,10 +279,11 @@ void WFST::normalize(NormalizeMethod const& method, bool uniform_zero_normgroups
   }
 #endif
 
-  if (group == CONDITIONAL) indexFlush();  // free up by-input index we created at start
+  if (thaw_after) thaw(kInput);  // free up by-input layout we created at start
 }
 
 void WFST::assignWeights(const WFST& source) {
+  thaw();
   HashTable<UnsignedKey, Weight> groupWeight;
   unsigned s;
   unsigned pGroup;
@@ -299,6 +339,7 @@ unsigned WFST::numberArcsFrom(unsigned label) {
 
 
 void WFST::invert() {
+  thaw();
   Assert(valid());
   unsigned temp;
   in_alph().swap(out_alph());
@@ -380,6 +421,7 @@ inline bool lesscost(const PFI& l, const PFI& r) {
 
 
 void WFST::prunePaths(unsigned max_states, Weight keep_paths_within_ratio) {
+  thaw();
   Assert(valid());
 #ifdef DEBUGPRUNE
   Config::debug() << "Prune - keep up to " << max_states << " states, and paths within "
@@ -465,7 +507,23 @@ void WFST::prunePaths(unsigned max_states, Weight keep_paths_within_ratio) {
   delete[] for_graph.states;
 }
 
+void WFST::bestCompletions(std::vector<Weight>& h) {
+  unsigned n_states = numStates();
+  h.clear();
+  h.resize(n_states);
+  if (!valid()) return;
+  Graph for_graph = makeGraph();
+  Graph rev_graph = reverseGraph(for_graph);
+  FLOAT_TYPE* rev_dist = NEW FLOAT_TYPE[n_states];
+  shortestDistancesFrom(rev_graph, final, rev_dist, NULL);
+  for (unsigned i = 0; i < n_states; ++i) h[i].setCost(rev_dist[i]);
+  delete[] rev_dist;
+  delete[] rev_graph.states;
+  delete[] for_graph.states;
+}
+
 void WFST::reduce() {
+  thaw();
   unsigned nStates = numStates();
 
   if (!valid()) {
@@ -524,10 +582,12 @@ void WFST::reduce() {
 }
 
 void WFST::consolidateArcs(bool sum, bool clamp) {
+  thaw();
   for (unsigned i = 0; i < numStates(); ++i) states[i].reduce(sum, clamp);
 }
 
 void WFST::removeMarkedStates(bool marked[]) {
+  thaw();
   Assert(valid());
   unsigned* oldToNew = NEW unsigned[numStates()];
   unsigned n_pre = numStates();
@@ -7,6 +7,7 @@
 #include <graehl/shared/gibbs_opts.hpp>
 #include <graehl/shared/graph.h>
 #include <graehl/shared/kbest.h>
+#include <graehl/shared/lazy_kbest_paths.hpp>
 #include <graehl/shared/list.h>
 #include <graehl/shared/mean_field_scale.hpp>
 #include <graehl/shared/myassert.h>
@@ -15,8 +16,11 @@
 #include <graehl/shared/threadlocal.hpp>
 #include <graehl/shared/weight.h>
 #include <boost/config.hpp>
+#include <boost/noncopyable.hpp>
 #include <carmel/src/compose.h>
 #include <carmel/src/config.hpp>
+#include <carmel/src/frozen_arcs.h>
+#include <carmel/src/random_arcs.h>
 #include <carmel/src/train.h>
 #include <algorithm>
 #include <cmath>
@@ -303,6 +307,7 @@ class WFST {
     // bear the final cost if not==1
 
     unsigned ns = o_n + (need_extra_final ? 1 : 0);
+    thaw();
     unNameStates();
     states.clear();
     states.resize(ns);
@@ -413,6 +418,7 @@ class WFST {
   // add a new final state with no exit, if necessary (and a p=1 epsilon transition from old final state to
   // new one)
   void ensure_final_sink() {
+    thaw();
     if (!states[final].size) return;
     state_id old_final = final;
     final = add_state("FINAL_SINK");
@@ -502,6 +508,16 @@ class WFST {
   // WFST & operator = (WFST &) {std::cerr <<"Unauthorized use of assignemnt operator\n";;return *this;}
   bool readLegible(istream&, bool alwaysNamed = false);  // returns false on failure (bad input)
   bool readLegible(const string& str, bool alwaysNamed = false);
+  // binary format (see wfstio.cc) is recognized by its first byte.  if filename is given, a binary file is
+  // mmapped instead of read through istr
+  bool read(istream&, bool alwaysNamed = false, char const* filename = 0);
+  static bool isBinary(istream& istr) { return istr.peek() == binary_magic_first; }
+  bool readBinary(istream&);
+  bool readBinaryFilename(std::string const& name);
+  bool readBinary(char const* data, std::size_t size);  // data must be 8-byte aligned
+  void writeBinary(ostream&) const;
+  void writeBinaryFilename(std::string const& name) const;
+  enum { binary_magic_first = 0x7f, binary_version = 1 };
   void writeArc(ostream& os, const FSTArc& a, bool GREEK_EPSILON = false);  // for graphviz
   void writeLegible(ostream&, bool include_zero = false);
   void writeLegibleFilename(std::string const& name, bool include_zero = false);
@@ -544,6 +560,7 @@ class WFST {
   }
 
   static unsigned indexThreshold;
+  static unsigned compose_threads;  // > 1: set_compose (without -a) expands a breadth first level in parallel
   enum norm_group_by {
     CONDITIONAL,  // all arcs from a state with the same input will add to one
     JOINT,  // all arcs from a state will add to one (thus sum of all paths from start to finish = 1 assuming
@@ -570,12 +587,14 @@ class WFST {
     norm_group_by group;
     mean_field_scale scale;
     Weight add_count;
+    unsigned threads;  // normalize splits the states over this many
     NormalizeMethod() { set_default(); }
     void set_default() {
       group = CONDITIONAL;
       scale.set_default();
       add_count = 0;
       priorgroup = SINGLE;
+      threads = 1;
     }
     void parse_group(char c) {
       if (c == 'j' || c == 'J')
@@ -625,6 +644,8 @@ class WFST {
 
  public:
   LabelType indexed_by;
+  frozen_arcs_cache frozen;
+  random_arcs_cache sampling;
 
   void index(LabelType dir) {
     if (indexed_by != dir) {
@@ -638,7 +659,37 @@ class WFST {
   void indexInput() { index(kInput); }
   void indexOutput() { index(kOutput); }
 
+  // build (if not already there) the frozen (sorted, contiguous) arc layout by dir, which set_compose,
+  // set_compose_lazy and normalize use instead of State::Index.  it indexes states[s].arcs (see
+  // frozen_arcs.h) rather than replacing them, so it adds memory.  promise not to add, remove or relabel arcs
+  // until thaw(); the WFST methods that do so thaw() first, but direct changes to states[s].arcs don't
+  frozen_arcs const& freeze(LabelType dir) {
+    frozen_arcs*& f = frozen.by[dir];
+    if (!f) f = NEW frozen_arcs(states, numStates(), dir);
+    return *f;
+  }
+  frozen_arcs const* frozen_by(LabelType dir) const { return frozen.by[dir]; }
+  void thaw() {
+    frozen.clear();
+    sampling.clear();
+  }
+  void thaw(LabelType dir) {
+    delete frozen.by[dir];
+    frozen.by[dir] = 0;
+    sampling.clear();
+  }
+
+  // the alias tables generate and randomPath choose arcs with, built for each state from its arc weights
+  // the first time it's visited.  the WFST methods that change weights (or arcs) drop them with reweighted()
+  // (or thaw()), but direct changes to arc weights don't
+  random_arcs& random_choices() {
+    if (!sampling.p) sampling.p = NEW random_arcs(states, numStates());
+    return *sampling.p;
+  }
+  void reweighted() { sampling.clear(); }
+
   void project(LabelType dir = kInput, bool identity_fsa = false) {
+    thaw();
     if (identity_fsa) identity_alphabet_from(dir);
     for (unsigned s = 0; s < numStates(); ++s) states[s].project(dir, identity_fsa);
   }
@@ -661,9 +712,9 @@ class WFST {
   // ownerInOut(1), in(((a.in == 0)? 0:(NEW Alphabet(*a.in)))), out(((a.out == 0)? 0:(NEW Alphabet(*a.out)))),
   // stateNames(a.stateNames), final(a.final), states(a.states),
 
-  WFST(istream& istr, bool alwaysNamed = false) {
+  WFST(istream& istr, bool alwaysNamed = false, char const* filename = 0) {
     init();
-    if (!this->readLegible(istr, alwaysNamed)) final = invalid_state;
+    if (!this->read(istr, alwaysNamed, filename)) final = invalid_state;
   }
 
   WFST(const string& str, bool alwaysNamed) {
@@ -684,6 +735,20 @@ class WFST {
   // resulting WFST has only reference to input/output alphabets - use ownAlphabet()
   // if the original source of the alphabets must be deleted
 
+  // sets *this to the part of chain[0]*chain[1]*...*chain[n-1] holding its k best paths, expanding composed
+  // states best-first (no intermediate composition is built in full).  the compositions nest from chain[0]
+  // outward, or from chain[n-1] if right_nested (put the most constraining transducer, e.g. the input, there).
+  // the search is A*, bounding the rest of a path through composed state (q0,...,qn-1) by the product of the
+  // chain[j] bestCompletions(qj), so states that can't reach final in any one transducer are never expanded
+  // (the innermost composition, with n>2, is built in full and reduced, for an exact bound there).
+  // completions (if given) holds those per chain[j]; empty ones are computed and left there for the next call
+  // (clear the ones for transducers that change).  requires every arc weight <= 1 (see maxArcWeight).  states
+  // reached but not expanded are left without arcs.  returns the number of composed states expanded (over all
+  // the intermediate compositions).  unnamed states, no groups.
+  unsigned set_compose_lazy(WFST** chain, unsigned n, unsigned k, bool right_nested = false,
+                            std::vector<Weight>* completions = 0);
+  Weight maxArcWeight() const;  // 0 if no arcs
+
   /* cascade usage (compose then train original transducers):
 
      cascade_parameters cascade;
@@ -720,38 +785,14 @@ class WFST {
       if (s == final) return len;
       if (len > max || states[s].arcs.isEmpty()) return ~0;
       // choose random arc:
-      Weight arcsum;
-      typedef List<FSTArc> LA;
-      typedef LA::const_iterator LAit;
-      const LA& arcs = states[s].arcs;
-      LAit start = arcs.const_begin(), end = arcs.const_end();
-      for (LAit li = start; li != end; ++li) {
-        arcsum += li->weight;
-      }
-      Weight which_arc = arcsum * randomFloat();
+      FSTArc const& arc = *random_choices()[s].any(randomFloat(), randomFloat());
+      setPathArc(&p, arc);
+      *i++ = p;
 #ifdef DEBUG_RANDOM_GENERATE
-      Config::debug() << " chose " << which_arc << "/" << arcsum;
+      Config::debug() << " arc=" << arc;
 #endif
-      arcsum.setZero();
-      for (LAit li = start; li != end; ++li) {
-        if ((arcsum += li->weight) >= which_arc) {
-          // add arc
-          setPathArc(&p, *li);
-          *i++ = p;
-#ifdef DEBUG_RANDOM_GENERATE
-          Config::debug() << " arc=" << *li;
-#endif
-          s = li->dest;
-          ++len;
-          //        if (!(i))
-          //          return -1;
-          goto next_arc;
-        }
-      }
-      throw std::runtime_error(
-          "Failed to choose a random arc when generating random paths.  Since we remove useless states, this "
-          "should never happen");
-    next_arc:
+      s = arc.dest;
+      ++len;
       ++len;
     }
   }
@@ -787,10 +828,18 @@ class WFST {
     void visit_sidetrack_arc(const GraphArc& a) { pv->visit_best_arc(*(FSTArc*)a.data); }
   };
 
+  // lazy_kbest_paths, or (for SIDETRACKS_ONLY visitors, since sidetracks are relative to its shortest path
+  // tree) Eppstein's bestPaths.  throw_on_cycle only matters for the latter; the lazy paths are always finite
   template <class Visitor>
   void visit_kbest(unsigned k, Visitor& v, bool throw_on_cycle = true) {
     arc_visitor<Visitor> wrap_visitor(v);
-    bestPaths(k, wrap_visitor, throw_on_cycle);
+    if (wrap_visitor.SIDETRACKS_ONLY) {
+      bestPaths(k, wrap_visitor, throw_on_cycle);
+      return;
+    }
+    Graph graph = makeGraph();
+    lazy_kbest_paths(graph, 0, final).visit(k, wrap_visitor);
+    freeGraph(graph);
   }
 
   template <class Visitor>
@@ -948,6 +997,9 @@ class WFST {
   /// takes space-separated symbols and returns a list of symbol numbers in the
   /// input or output alphabet
   void symbolList(List<unsigned>* ret, const char* buf, LabelType output = kInput, unsigned line = ~0);
+  /// as symbolList, but false (and ret is incomplete) if a symbol isn't in the alphabet, instead of adding it.
+  /// so the alphabet is only read
+  bool knownSymbolList(List<unsigned>* ret, const char* buf, LabelType output = kInput) const;
 
   char const* letter_or_eps(unsigned i, LabelType dir, char const* eps = "&#949", bool use_eps = true) {
     return (use_eps && i == epsilon_index) ? eps : letter(i, dir);
@@ -968,8 +1020,41 @@ class WFST {
     else
       return static_utoa(i);
   }
-  Weight sumOfAllPaths(List<unsigned>& inSeq, List<unsigned>& outSeq);
+
+  // how training's forward/backward and -S sum over paths (--semiring)
+  enum path_semiring {
+    sum_semiring,  // sum of paths, in log space (Weight)
+    max_semiring,  // best path only (Viterbi EM and scoring): max and add in log space, no log-add
+    real_semiring  // sum of paths in double precision, falling back to log space for an example that underflows
+  };
+  static bool parse_semiring(std::string const& name, path_semiring& s) {
+    if (name == "log" || name == "sum")
+      s = sum_semiring;
+    else if (name == "tropical" || name == "viterbi" || name == "max")
+      s = max_semiring;
+    else if (name == "real")
+      s = real_semiring;
+    else
+      return false;
+    return true;
+  }
+  Weight sumOfAllPaths(List<unsigned>& inSeq, List<unsigned>& outSeq, path_semiring semiring = sum_semiring);
   // gives sum of weights of all paths from initial->final with the input/output sequence (empties are elided)
+  // - or the best path's weight, for max_semiring
+
+  /// sumOfAllPaths for many pairs (-S): the arc index is made once, and the sums may then be taken on several
+  /// threads at once.  the WFST must not change meanwhile
+  struct path_sums : boost::noncopyable {
+    path_sums(WFST& x, path_semiring semiring = sum_semiring);
+    ~path_sums();
+    Weight operator()(List<unsigned> const& inSeq, List<unsigned> const& outSeq) const;
+
+   private:
+    struct index;
+    WFST& x;
+    path_semiring semiring;
+    index* p;
+  };
   void randomScale() {  // randomly scale weights (of unlocked arcs) before training by (0..1]
     changeEachParameter(scaleRandom());
   }
@@ -988,7 +1073,8 @@ class WFST {
   void zero_arcs() { set_constant_weights(Weight::ZERO()); }
 
   // bool uniform_zero_normgroups=true -> if a group's arcs' weights are all 0, set them uniform instead of
-  // leaving them 0
+  // leaving them 0.  with method.threads > 1, ranges of states are normalized at once (tie groups' totals
+  // are still summed in state order), with the same result as one thread
   void normalize(NormalizeMethod const& method, bool uniform_zero_normgroups = false);
 
   // if weight_is_prior_count, weights before training are prior counts.  smoothFloor counts are also added to
@@ -1063,7 +1149,12 @@ class WFST {
     unsigned cache_level;
     std::string disk_cache_filename;
     size_t_bytes disk_cache_bufsize;
+    // --disk-cache-format: packed_derivs.h records (LZ4 compressed blocks for disk_lz4), or
+    // derivations::serialize
+    enum disk_format_type { disk_packed, disk_lz4, disk_serialize };
+    disk_format_type disk_format;
     bool use_disk() const { return cache_level == cache_disk; }
+    bool use_packed() const { return use_disk() && disk_format != disk_serialize; }
     bool cache() const { return cache_level != cache_nothing && cache_level != matrix_fb; }
     bool cache_backward() const { return cache_level == cache_forward_backward; }
     deriv_cache_opts() { set_defaults(); }
@@ -1072,6 +1163,7 @@ class WFST {
       cache_level = cache_nothing;
       disk_cache_filename = "/tmp/carmel.derivations.XXXXXX";
       disk_cache_bufsize = 256 * 1024 * 1024;
+      disk_format = disk_packed;
     }
   };
 
@@ -1083,9 +1175,21 @@ class WFST {
     double learning_rate_growth_factor;
     int ran_restarts;
     random_restart_acceptor ra;
+    unsigned threads;  // E-step worker threads
+    path_semiring semiring;  // E-step over derivations (not --matrix-fb)
+    // --online-em: stepwise EM (Liang & Klein 2009) - reestimate after each minibatch of examples, from counts
+    // interpolated with step size (k+2)^-stepsize_alpha for the k-th update
+    bool online;
+    unsigned minibatch;
+    double stepsize_alpha;
 
     train_opts() { set_defaults(); }
     void set_defaults() {
+      threads = 1;
+      semiring = sum_semiring;
+      online = false;
+      minibatch = 1000;
+      stepsize_alpha = .7;
       max_iter = 500;
       cache.set_defaults();
       learning_rate_growth_factor = 1.;
@@ -1127,6 +1231,7 @@ class WFST {
   // throw out rank states by the weight of the best path through them, keeping only max_states of them (or
   // all of them, if max_states<0), after removing states and arcs that do not lie on any path of weight less
   // than (best_path/keep_paths_within_ratio)
+  void bestCompletions(std::vector<Weight>& h);  // h[s] = weight of the best path from s to final (0 if none)
 
 
   void assignWeights(const WFST& weightSource);  // for arcs in this transducer with the same group number as
@@ -1232,11 +1337,13 @@ class WFST {
 
   void raisePower(double exponent = 1.0) {
     if (exponent == 1.0) return;
+    reweighted();
     for (unsigned s = 0; s < numStates(); ++s) states[s].raisePower(exponent);
   }
 
   // returns id of newly added empty state
   unsigned add_state(char const* name = "NEWSTATE") {
+    thaw();
     unsigned r = states.size();
     states.push_back();
     if (named_states) {
@@ -1248,6 +1355,7 @@ class WFST {
   }
 
   void clear() {
+    thaw();
     final = invalid_state;
     unNameStates();
     states.clear();
@@ -1275,6 +1383,7 @@ class WFST {
 
   template <class F>
   F changeEachParameter(F f) {
+    reweighted();
     State::modify_parameter_once<F> m = f;
     for (unsigned s = 0; s < numStates(); ++s) states[s].visit_arcs(s, m);
     return m;
@@ -1311,6 +1420,7 @@ class WFST {
   // returns position of next unused weight, so you can use the same array for several WFST in a particular
   // order
   saved_weight_p restore_weights(saved_weight_p i) {
+    reweighted();
     param_restorer r = i;
     return visit_arcs(r).i;
   }
@@ -1370,25 +1480,46 @@ class NormGroupIter {
   Cit Ci;
   Cit2 Ci2, Cend;
   Jit Ji, Jend;
+  // conditional groups from the frozen by-input layout: the group is [Fi, Fend) and the state ends at Fstate_end
+  frozen_arcs const* frozen;
+  frozen_arcs::iterator Fi, Fend, Fstate_end, Fa;
   const WFST::norm_group_by method;
   bool empty_state() { return state->size == 0; }
+  void frozen_group() {
+    for (Fend = Fi; Fend != Fstate_end && (*Fend)->in == (*Fi)->in; ++Fend)
+      ;
+  }
   void beginState() {
     if (method == WFST::CONDITIONAL)
-      if (!empty_state()) Ci = state->index->begin();
+      if (!empty_state()) {
+        if (frozen) {
+          Fi = frozen->begin(source());
+          Fstate_end = frozen->end(source());
+          frozen_group();
+        } else
+          Ci = state->index->begin();
+      }
   }
+  bool end_of_state() { return frozen ? Fi == Fstate_end : Ci == state->index->end(); }
 
  public:
   unsigned source() { return state - begin; }
-  NormGroupIter(WFST::norm_group_by meth, WFST& wfst_) : wfst(wfst_), method(meth) {
-    state = begin = &*wfst.states.begin();
-    end = begin + wfst.numStates();
-    beginState();
+  // conditional groups come from the State::Index by input unless frozen (by input) is given.  only the
+  // groups of states [first_state, end_state) are visited
+  NormGroupIter(WFST::norm_group_by meth, WFST& wfst_, frozen_arcs const* frozen = 0, unsigned first_state = 0,
+                unsigned end_state = (unsigned)-1)
+      : wfst(wfst_), frozen(frozen), method(meth) {
+    begin = &*wfst.states.begin();
+    end = begin + std::min(end_state, wfst.numStates());
+    state = std::min(begin + first_state, end);
+    if (moreGroups()) beginState();
   }
   bool moreGroups() { return state != end; }
   template <class charT, class Traits>
   std::ios_base::iostate print(std::basic_ostream<charT, Traits>& os) const {
     if (method == WFST::CONDITIONAL) {
-      os << "(conditional normalization group for input=" << wfst.inLetter(Ci->first) << " in ";
+      os << "(conditional normalization group for input=" << wfst.inLetter(frozen ? (*Fi)->in : (unsigned)Ci->first)
+         << " in ";
     } else if (method == WFST::JOINT) {
       os << "(joint normalizaton group for ";
     } else {
@@ -1400,6 +1531,10 @@ class NormGroupIter {
   void beginArcs() {
     if (method == WFST::CONDITIONAL) {
       if (empty_state()) return;
+      if (frozen) {
+        Fa = Fi;
+        return;
+      }
       Ci2 = Ci->second.const_begin();  // segfault w/ *e* selfloop as only arc
       Cend = Ci->second.const_end();
     } else {
@@ -1410,29 +1545,38 @@ class NormGroupIter {
   bool moreArcs() {
     if (method == WFST::CONDITIONAL) {
       if (empty_state()) return false;
-      return Ci2 != Cend;
+      return frozen ? Fa != Fend : Ci2 != Cend;
     } else {
       return Ji != Jend;
     }
   }
   FSTArc* operator*() {
     if (method == WFST::CONDITIONAL) {
-      return *Ci2;
+      return frozen ? *Fa : *Ci2;
     } else {
       return &*Ji;
     }
   }
   void nextArc() {
     if (method == WFST::CONDITIONAL) {
-      ++Ci2;
+      if (frozen)
+        ++Fa;
+      else
+        ++Ci2;
     } else {
       ++Ji;
     }
   }
   void nextGroup() {
     if (method == WFST::CONDITIONAL) {
-      if (!empty_state()) ++Ci;
-      while (empty_state() || Ci == state->index->end()) {
+      if (!empty_state()) {
+        if (frozen) {
+          Fi = Fend;
+          frozen_group();
+        } else
+          ++Ci;
+      }
+      while (empty_state() || end_of_state()) {
         ++state;
         if (moreGroups())
           beginState();
@@ -20,10 +20,15 @@ struct carmel_gibbs : public gibbs_base {
       , cascade(cascade)
       , methods(methods)
       , printer(printer)
-      , derivs(composed, cascade, corpus, topt.cache)  // gets pre-init_sample_weights weight.
+      , derivs(composed, cascade, corpus, topt.cache, false, topt.threads)  // gets pre-init_sample_weights weight.
       , init_sample_weights(init_sample_weights) {
     // corpus.n_output,corpus.n_pairs,
     gibbs_base::init(derivs.n_output(), derivs.size());  // doesn't include input examples with no derivs
+    if (this->gopt.threads > 1 && derivs.derivs.use_file) {
+      Config::warn() << "--gibbs-threads needs the derivations in memory (not --disk-cache-derivations); "
+                        "resampling with 1 thread.\n";
+      this->gopt.threads = 1;
+    }
     set_cascadei();
     if (init_sample_weights && !cascade.trivial) composed.restore_weights(*init_sample_weights);
     have_names = gopt.rich_counts;
@@ -301,28 +306,19 @@ struct carmel_gibbs : public gibbs_base {
   }
 
 #define OUTGIBBS3(x)  // OUTGIBBS(x)
-  double block_weight(unsigned block) { return derivs.derivs[block].weight; }
+  // --gibbs-threads resamples blocks concurrently, so it can't use derivs.derivs' shared cursor
+  derivations& deriv(unsigned block) {
+    derivations* d = derivs.derivs.stored(block);
+    return d ? *d : derivs.derivs[block];
+  }
+  double block_weight(unsigned block) { return deriv(block).weight; }
 
   void resample_block(unsigned block) {
-    block_delta& b = sample[block];  // already cleared
-    derivations& d = derivs.derivs[block];
-    OUTGIBBS3(" block " << block << " line " << d.lineno << "\n");
-    blockp = &b.id;
-    if (gopt.expectation) {
-      // no support for init_prob yet.  (different initial weights than the base model for computing first
-      // iter expectation).  doesn't seem useful anyway.  gopt.random_start happens after anyway
-      blockd = &b;
-      b.prob = d.collect_counts_gibbs(*this);
-    } else {
-      if (init_prob)  // if iteration==0
-        d.random_path(p_init(*this), power);  // because init sample distribution may be different from p0
-                                              // e.g. from EM.  this also means we aren't using cache to
-                                              // generate first sample at all
-      else
-        d.random_path(*this, power);
-    }
-
-    OUTGIBBS3('\n')
+    global_random rng;
+    resample(block, sample[block], 0, rng);
+  }
+  void resample_block_local(unsigned block, block_delta& into, local_counts& local) {
+    resample(block, into, &local, local.rng);
   }
 
 #define CARMEL_GIBBS_FOR_ID(grapharc, paramid, body)  \
@@ -334,40 +330,67 @@ struct carmel_gibbs : public gibbs_base {
 #define OUTGIBBS2(x)  // OUTGIBBS(x)
 #define DGIBBS2(x)  // x
 
-  // for resample block:
-  struct p_init {
+  // for resample block: WeightFor in derivations pfor,random_path,collect_counts_gibbs.  proposal probs come
+  // from local (a --gibbs-threads worker's counts) if set, else the shared counts.  chosen ids go to b
+  struct sampler {
     carmel_gibbs const& c;
-    p_init(carmel_gibbs const& c) : c(c) {}
+    local_counts const* local;
+    block_delta* b;
+    sampler(carmel_gibbs const& c, local_counts const* local, block_delta& b) : c(c), local(local), b(&b) {}
+    param_list ac(GraphArc const& a) const { return c.ac(a); }
+    Weight operator()(GraphArc const& a) const {
+      Weight prob = one_weight();
+      OUTGIBBS2("p(" << a << "):");
+      CARMEL_GIBBS_FOR_ID(a, id, {
+        double p = local ? local->proposal_prob(id) : c.gibbs_base::proposal_prob(id);
+        prob *= p;
+        OUTGIBBS2(" p(" << id << ")=" << p);
+        // DGIBBS2(if (have_names) print_param(std::cerr<<"[",id)<<"]");
+      })
+      OUTGIBBS2(" = " << prob << '\n')
+      return prob;
+    }
+    void choose_arc(GraphArc const& a) const {
+      DGIBBS2(CARMEL_GIBBS_FOR_ID(a, id, c.out << " " << id));
+      OUTGIBBS2("=(ids for " << a << ")\n");
+      CARMEL_GIBBS_FOR_ID(a, id, b->id.push_back(id))
+    }
+    void choose_arc(GraphArc const& a, double wt) const {
+      DGIBBS2(CARMEL_GIBBS_FOR_ID(a, id, c.out << " " << id << "=" << wt << " "));
+      OUTGIBBS2("=(ids for " << a << ")\n");
+      CARMEL_GIBBS_FOR_ID(a, id, b->push_back(id, wt))
+    }
+  };
+
+  struct p_init {
+    sampler const& s;
+    p_init(sampler const& s) : s(s) {}
     double operator()(GraphArc const& a) const {
-      return c.composed_arc(a)->weight.getReal();  // TESTME
+      return s.c.composed_arc(a)->weight.getReal();  // TESTME
     }
-    void choose_arc(GraphArc const& a) const { return c.choose_arc(a); }
+    void choose_arc(GraphArc const& a) const { s.choose_arc(a); }
   };
-  // for resample block:
-  // *this is used as WeightFor in derivations pfor,random_path:
-  Weight operator()(GraphArc const& a) const {
-    Weight prob = one_weight();
-    OUTGIBBS2("p(" << a << "):");
-    CARMEL_GIBBS_FOR_ID(a, id, {
-      double p = gibbs_base::proposal_prob(id);
-      prob *= p;
-      OUTGIBBS2(" p(" << id << ")=" << p);
-      // DGIBBS2(if (have_names) print_param(std::cerr<<"[",id)<<"]");
-    })
-    OUTGIBBS2(" = " << prob << '\n')
-    return prob;
-  }
-  block_t* blockp;
-  block_delta* blockd;
-  void choose_arc(GraphArc const& a) const {
-    DGIBBS2(CARMEL_GIBBS_FOR_ID(a, id, out << " " << id));
-    OUTGIBBS2("=(ids for " << a << ")\n");
-    CARMEL_GIBBS_FOR_ID(a, id, blockp->push_back(id))
-  }
-  void choose_arc(GraphArc const& a, double wt) const {
-    DGIBBS2(CARMEL_GIBBS_FOR_ID(a, id, out << " " << id << "=" << wt << " "));
-    OUTGIBBS2("=(ids for " << a << ")\n");
-    CARMEL_GIBBS_FOR_ID(a, id, blockd->push_back(id, wt))
+
+  template <class Random>
+  void resample(unsigned block, block_delta& b, local_counts const* local, Random& rng) {
+    // b already cleared
+    derivations& d = deriv(block);
+    OUTGIBBS3(" block " << block << " line " << d.lineno << "\n");
+    sampler s(*this, local, b);
+    if (gopt.expectation) {
+      // no support for init_prob yet.  (different initial weights than the base model for computing first
+      // iter expectation).  doesn't seem useful anyway.  gopt.random_start happens after anyway
+      b.prob = d.collect_counts_gibbs(s);
+    } else {
+      if (init_prob)  // if iteration==0
+        d.random_path(p_init(s), power, rng);  // because init sample distribution may be different from p0
+                                               // e.g. from EM.  this also means we aren't using cache to
+                                               // generate first sample at all
+      else
+        d.random_path(s, power, rng);
+    }
+
+    OUTGIBBS3('\n')
   }
 
   bool init_prob;  // NOTE: unlike old method, composed weights don't get updated until all runs are done
@@ -386,6 +409,7 @@ struct carmel_gibbs : public gibbs_base {
 void WFST::train_gibbs(cascade_parameters& cascade, training_corpus& corpus, NormalizeMethods& methods,
                        train_opts const& topt, gibbs_opts const& gopt1, path_print const& printer,
                        double min_prior) {
+  reweighted();
   cascade.set_composed(this);  // FIXME: yes, this is done repeatedly. defensive programming!
   for (NormalizeMethods::iterator i = methods.begin(), e = methods.end(); i != e; ++i) {
     if (i->add_count <= 0) {
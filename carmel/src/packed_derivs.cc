@@ -0,0 +1,145 @@
+#include <graehl/shared/glibc_memcpy.hpp>
+#include <carmel/src/packed_derivs.h>
+#include <graehl/shared/lz4.hpp>
+#include <graehl/shared/memmap.hpp>
+#include <graehl/shared/os.hpp>
+#include <limits>
+#include <stdexcept>
+
+namespace graehl {
+
+namespace {
+// block header: # of records, bytes of records, bytes stored (== bytes of records if not compressed)
+enum { header_bytes = 3 * sizeof(boost::uint32_t) };
+
+void check_io(bool ok, std::string const& filename, char const* what) {
+  if (!ok) throw std::runtime_error(std::string("derivation cache ") + filename + ": couldn't " + what);
+}
+
+// fault in the mmapped pages of [p, p+n) now, on this thread, rather than when the records are decoded
+void touch_pages(const_byteptr p, std::size_t n) {
+  enum { page = 4096 };
+  byte sum = 0;
+  for (std::size_t i = 0; i < n; i += page) sum += ((byte const volatile*)p)[i];
+  if (n) sum += ((byte const volatile*)p)[n - 1];
+  (void)sum;
+}
+}
+
+packed_derivs_file::packed_derivs_file(std::string const& filename_template, bool lz4, std::size_t block_bytes)
+    : filename(maybe_tmpnam(filename_template))
+    , lz4(lz4)
+    , block_bytes(block_bytes)
+    , out()
+    , map()
+    , read()
+    , read_end()
+    , in_block()
+    , left_in_block() {
+  clear();
+}
+
+packed_derivs_file::~packed_derivs_file() {
+  if (out) std::fclose(out);
+  delete map;
+  safe_unlink(filename, false);
+}
+
+void packed_derivs_file::clear() {
+  delete map;
+  map = 0;
+  read = read_end = 0;
+  if (out) std::fclose(out);
+  check_io((out = std::fopen(filename.c_str(), "wb")) != 0, filename, "open for writing");
+  n_records = n_file_bytes = n_record_bytes = 0;
+  block.clear();
+  block_records = 0;
+}
+
+void packed_derivs_file::keep_new() {
+  byte len[8];
+  block.append((char const*)len, encode_leb128(len, rec.size()) - len);
+  block.append(rec);
+  ++block_records;
+  ++n_records;
+  n_record_bytes += rec.size();
+  if (block.size() >= block_bytes) write_block();
+}
+
+void packed_derivs_file::write_block() {
+  if (!block_records) return;
+  if (block.size() > (std::size_t)std::numeric_limits<int>::max())
+    throw std::runtime_error("derivation cache: a single example's derivations are too large to cache");
+  std::vector<char> compressed;
+  char const* stored = block.data();
+  boost::uint32_t header[3] = {block_records, (boost::uint32_t)block.size(), (boost::uint32_t)block.size()};
+  if (lz4) {
+    compressed.resize(lz4::LZ4_compressBound((int)block.size()));
+    int n = lz4::LZ4_compress(block.data(), &compressed[0], (int)block.size());
+    if (n > 0 && (std::size_t)n < block.size()) {
+      stored = &compressed[0];
+      header[2] = n;
+    }
+  }
+  check_io(std::fwrite(header, header_bytes, 1, out) == 1 && std::fwrite(stored, header[2], 1, out) == 1,
+           filename, "write");
+  n_file_bytes += header_bytes + header[2];
+  block.clear();
+  block_records = 0;
+}
+
+void packed_derivs_file::mark_end() {
+  write_block();
+  check_io(std::fclose(out) == 0, filename, "write");
+  out = 0;
+  if (n_file_bytes) map = new mapped_file(filename, std::ios::in, mapped_file::max_length, 0, false);
+  rewind();
+}
+
+void packed_derivs_file::rewind() {
+  read = map ? (const_byteptr)map->begin() : 0;
+  read_end = map ? (const_byteptr)map->end() : 0;
+  block_buf.reset();
+  left_in_block = 0;
+}
+
+bool packed_derivs_file::next_block() {
+  if (read == read_end) return false;
+  boost::uint32_t header[3];
+  std::memcpy(header, read, header_bytes);
+  const_byteptr data = read + header_bytes;
+  read = data + header[2];
+  if (header[2] == header[1]) {
+    block_buf.reset();
+    in_block = data;
+    touch_pages(data, header[1]);
+  } else {
+    block_buf.reset(new std::vector<char>(header[1]));
+    char* raw = &(*block_buf)[0];
+    check_io(lz4::LZ4_uncompress((char const*)data, raw, header[1]) == (int)header[2], filename,
+             "decompress (corrupt file?)");
+    in_block = (const_byteptr)raw;
+  }
+  left_in_block = header[0];
+  return true;
+}
+
+bool packed_derivs_file::next_batch(packed_batch& batch, std::size_t max) {
+  batch.records.clear();
+  batch.blocks.clear();
+  batch.bytes = 0;
+  while (batch.records.size() < max) {
+    if (!left_in_block && !next_block()) break;
+    if (block_buf && (batch.blocks.empty() || batch.blocks.back() != block_buf)) batch.blocks.push_back(block_buf);
+    std::size_t len;
+    in_block = decode_leb128(len, in_block);
+    batch.records.push_back(in_block);
+    batch.bytes += len;
+    in_block += len;
+    --left_in_block;
+  }
+  return !batch.records.empty();
+}
+
+
+}
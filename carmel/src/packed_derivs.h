@@ -0,0 +1,303 @@
+#ifndef GRAEHL_CARMEL__PACKED_DERIVS_H
+#define GRAEHL_CARMEL__PACKED_DERIVS_H
+
+/* the --disk-cache-derivations file: a flat, position independent encoding of each example's derivations.
+
+   a record is LEB128 varints: the number of states and arcs, the final state, the corpus line, then the
+   example weight (8 raw bytes), then for each state, its number of arcs and for each arc the destination (as
+   a zigzag coded delta from the source) and the arcs_table id (zigzag delta from the previous arc's).  states
+   are renumbered in topological order, so the start state is 0 and forward/backward are passes over the
+   states in order.
+
+   records go into blocks (optionally LZ4 compressed) of about block_bytes, and once they're all written the
+   file is mmapped, so an EM iteration decodes each record straight into the CSR arrays of a
+   packed_derivation (reused for each example) - no GraphState lists are rebuilt, and uncompressed records are
+   read in place.
+*/
+
+#include <carmel/src/derivations.h>
+#include <graehl/shared/leb128.hpp>
+#include <graehl/shared/log_sum_exp.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace graehl {
+
+struct mapped_file;
+
+inline unsigned zigzag(int x) {
+  return ((unsigned)x << 1) ^ (unsigned)(x >> 31);
+}
+inline int unzigzag(unsigned x) {
+  return (int)(x >> 1) ^ -(int)(x & 1);
+}
+
+// one example's derivations, decoded from its record
+struct packed_derivation {
+  double weight;
+  unsigned lineno;
+  unsigned fin;
+  std::vector<unsigned> first;  // arcs out of s are [first[s], first[s+1])
+  std::vector<unsigned> dest, id;  // per arc: destination state, arcs_table index
+
+  bool empty() const { return false; }  // examples with no derivation aren't cached
+  unsigned n_states() const { return (unsigned)first.size() - 1; }
+  unsigned n_arcs() const { return (unsigned)dest.size(); }
+
+  /// append d's record to rec (d must not be empty).  only the states reachable from start are written (all
+  /// of them, with --cache-no-prune); an arc to a state outside the forward order is dropped
+  static void encode(derivations& d, std::string& rec) {
+    unsigned const none = (unsigned)-1;
+    std::vector<unsigned> order, renumber(d.n_states(), none), n_out;
+    d.forward_order(order);
+    unsigned n = (unsigned)order.size();
+    for (unsigned i = 0; i < n; ++i) renumber[order[i]] = i;
+    assert(n && renumber[d.start()] == 0);
+    assert(renumber[d.final()] != none);
+    Graph g = d.graph();
+    n_out.resize(n);
+    unsigned n_arcs = 0;
+    for (unsigned i = 0; i < n; ++i) {
+      GraphState::arcs_type const& arcs = g.states[order[i]].arcs;
+      for (GraphState::arcs_type::const_iterator a = arcs.begin(), e = arcs.end(); a != e; ++a)
+        if (renumber[a->dest] != none) ++n_out[i];
+      n_arcs += n_out[i];
+    }
+    put(rec, n);
+    put(rec, n_arcs);
+    put(rec, renumber[d.final()]);
+    put(rec, d.lineno);
+    rec.append((char const*)&d.weight, sizeof(d.weight));
+    for (unsigned i = 0; i < n; ++i) {
+      GraphState::arcs_type const& arcs = g.states[order[i]].arcs;
+      put(rec, n_out[i]);
+      unsigned prev = 0;
+      for (GraphState::arcs_type::const_iterator a = arcs.begin(), e = arcs.end(); a != e; ++a) {
+        unsigned to = renumber[a->dest];
+        if (to == none) continue;
+        unsigned id = a->data_as<unsigned>();
+        put(rec, zigzag((int)(to - i)));
+        put(rec, zigzag((int)(id - prev)));
+        prev = id;
+      }
+    }
+  }
+
+  /// from the record at p; returns the end of the record
+  const_byteptr decode(const_byteptr p) {
+    unsigned n, n_arcs;
+    p = decode_leb128(n, p);
+    p = decode_leb128(n_arcs, p);
+    p = decode_leb128(fin, p);
+    p = decode_leb128(lineno, p);
+    std::memcpy(&weight, p, sizeof(weight));
+    p += sizeof(weight);
+    first.resize(n + 1);
+    dest.resize(n_arcs);
+    id.resize(n_arcs);
+    unsigned j = 0;
+    for (unsigned s = 0; s < n; ++s) {
+      first[s] = j;
+      unsigned n_out, prev = 0;
+      p = decode_leb128(n_out, p);
+      for (unsigned end = j + n_out; j < end; ++j) {
+        unsigned x;
+        p = decode_leb128(x, p);
+        dest[j] = s + unzigzag(x);
+        p = decode_leb128(x, p);
+        id[j] = prev += unzigzag(x);
+      }
+    }
+    first[n] = j;
+    return p;
+  }
+
+  /// rebuild d (for consumers of derivations, e.g. --out-derivation-file).  the GraphArc weights are t's
+  /// current arc weights
+  template <class arcs_table>
+  void unpack(derivations& d, arcs_table const& t) const {
+    unsigned n = n_states();
+    d.reset(n, fin, weight, lineno);
+    for (unsigned s = 0; s < n; ++s)
+      for (unsigned j = first[s + 1]; j-- > first[s];)
+        d.add_arc(s, dest[j], t[id[j]].arc->weight.getReal(), id[j]);
+  }
+
+  /// as derivations::collect_counts(semiring, t, counts)
+  template <class S, class arcs_table, class Counts>
+  Weight collect_counts(S const& semiring, arcs_table const& t, Counts& counts) {
+    typedef typename S::value_type W;
+    fb_arrays<W>& a = arrays((W*)0);
+    unsigned n = n_states();
+    a.w.resize(n_arcs());
+    for (unsigned j = 0, m = n_arcs(); j < m; ++j) a.w[j] = semiring.weight(t, id[j]);
+    W prob = S::viterbi ? best_to_fin(a) : compute_fb(a);
+    if (!S::normal(prob)) return Weight();
+    if (!S::viterbi) check_fb_agree(Weight(prob), Weight(a.b[0]));
+    if (S::viterbi) {
+      if (!(prob > W())) return Weight(prob);
+      W wt(weight);
+      for (unsigned s = 0; s != fin;) {  // take the first arc that keeps the best completion b[s]
+        unsigned j = first[s], e = first[s + 1];
+        while (j != e && a.w[j] * a.b[dest[j]] < a.b[s]) ++j;
+        assert(j != e);
+        counts[id[j]] += wt;
+        s = dest[j];
+      }
+    } else
+      for (unsigned s = 0; s < n; ++s)
+        for (unsigned j = first[s], e = first[s + 1]; j < e; ++j)
+          counts[id[j]] += a.w[j] * a.f[s] * a.b[dest[j]] * weight / prob;
+    return Weight(prob);
+  }
+
+ private:
+  // per arc weights (w), per state forward/backward (f, b), and scratch, in a semiring's value_type
+  template <class W>
+  struct fb_arrays {
+    std::vector<W> w, f, b, terms;
+  };
+  fb_arrays<Weight> log_fb;
+  fb_arrays<double> real_fb;
+  fb_arrays<Weight>& arrays(Weight*) { return log_fb; }
+  fb_arrays<double>& arrays(double*) { return real_fb; }
+  std::vector<unsigned> in_first, in_arc;  // arcs into s are in_arc[in_first[s] .. in_first[s+1])
+  std::vector<unsigned> src, fill;
+
+  static void put(std::string& rec, unsigned x) {
+    byte buf[8];
+    rec.append((char const*)buf, encode_leb128(buf, x) - buf);
+  }
+
+  // a.f (forward) and a.b (backward) for the arc weights a.w, each state's sum taken at once as in
+  // derivations::compute_fb; returns f[fin]
+  template <class W>
+  W compute_fb(fb_arrays<W>& a) {
+    unsigned n = n_states(), n_arcs = this->n_arcs();
+    in_first.assign(n + 1, 0);
+    for (unsigned j = 0; j < n_arcs; ++j) ++in_first[dest[j] + 1];
+    for (unsigned s = 0; s < n; ++s) in_first[s + 1] += in_first[s];
+    in_arc.resize(n_arcs);
+    src.resize(n_arcs);
+    fill.assign(in_first.begin(), in_first.end() - 1);
+    for (unsigned s = 0; s < n; ++s)
+      for (unsigned j = first[s], e = first[s + 1]; j < e; ++j) {
+        in_arc[fill[dest[j]]++] = j;
+        src[j] = s;
+      }
+    std::vector<W>&f = a.f, &b = a.b, &terms = a.terms;
+    f.assign(n, W());
+    b.assign(n, W());
+    f[0] = 1;
+    for (unsigned s = 0; s < n; ++s) {
+      terms.clear();
+      for (unsigned k = in_first[s], e = in_first[s + 1]; k < e; ++k) {
+        unsigned j = in_arc[k];
+        terms.push_back(f[src[j]] * a.w[j]);
+      }
+      if (!terms.empty()) f[s] += sum_all(&terms[0], terms.size());
+    }
+    b[fin] = 1;
+    for (unsigned s = n; s-- > 0;) {
+      terms.clear();
+      for (unsigned j = first[s], e = first[s + 1]; j < e; ++j) terms.push_back(b[dest[j]] * a.w[j]);
+      if (!terms.empty()) b[s] += sum_all(&terms[0], terms.size());
+    }
+    return f[fin];
+  }
+
+  // as above, for real_paths: doubles are summed as they come, so arcs into a state aren't needed together
+  double compute_fb(fb_arrays<double>& a) {
+    unsigned n = n_states();
+    std::vector<double>&f = a.f, &b = a.b;
+    f.assign(n, 0.);
+    b.assign(n, 0.);
+    f[0] = 1;
+    for (unsigned s = 0; s < n; ++s)
+      for (unsigned j = first[s], e = first[s + 1]; j < e; ++j) f[dest[j]] += f[s] * a.w[j];
+    b[fin] = 1;
+    for (unsigned s = n; s-- > 0;)
+      for (unsigned j = first[s], e = first[s + 1]; j < e; ++j) b[s] += a.w[j] * b[dest[j]];
+    return f[fin];
+  }
+
+  // a.b[s] = the weight of the best path from s to fin; returns b[0]
+  template <class W>
+  W best_to_fin(fb_arrays<W>& a) {
+    unsigned n = n_states();
+    std::vector<W>& b = a.b;
+    b.assign(n, W());
+    b[fin] = 1;
+    for (unsigned s = n; s-- > 0;)
+      for (unsigned j = first[s], e = first[s + 1]; j < e; ++j) {
+        W x = a.w[j] * b[dest[j]];
+        if (x > b[s]) b[s] = x;
+      }
+    return b[0];
+  }
+};
+
+/// some consecutive records of a packed_derivs_file.  holds on to the decompressed blocks they're in
+struct packed_batch {
+  std::vector<const_byteptr> records;
+  std::vector<boost::shared_ptr<std::vector<char> > > blocks;
+  std::size_t bytes;  // of records
+};
+
+/* the records of a --disk-cache-derivations file, written once (clear, then start_new/keep_new per record,
+   then mark_end) and then read any number of times (rewind, then next_batch until it's empty).  not thread
+   safe, but batches are independent of the file's cursor and each other, so one thread may read ahead while
+   others work on earlier batches
+*/
+struct packed_derivs_file : boost::noncopyable {
+  std::string filename;
+  bool lz4;
+  std::size_t block_bytes;
+
+  packed_derivs_file(std::string const& filename_template, bool lz4, std::size_t block_bytes = 1 << 20);
+  ~packed_derivs_file();
+
+  std::size_t size() const { return n_records; }
+  /// compressed (or not) bytes written
+  std::size_t file_bytes() const { return n_file_bytes; }
+  /// bytes of records before compression
+  std::size_t record_bytes() const { return n_record_bytes; }
+
+  void clear();
+  /// an empty string to encode the next record into
+  std::string& start_new() {
+    rec.clear();
+    return rec;
+  }
+  void keep_new();
+  void drop_new() {}
+  void mark_end();
+
+  void rewind();
+  /// the next (up to) max records; false at end.  they stay valid as long as the batch and the file do.
+  /// the pages of uncompressed records are touched, so they're read from disk by the calling thread
+  bool next_batch(packed_batch& batch, std::size_t max);
+
+ private:
+  std::FILE* out;
+  std::size_t n_records, n_file_bytes, n_record_bytes;
+  std::string rec, block;  // writing: the current record, and the records not yet written
+  unsigned block_records;
+  void write_block();
+
+  mapped_file* map;
+  const_byteptr read, read_end;  // next block header
+  boost::shared_ptr<std::vector<char> > block_buf;  // the current block, if decompressed
+  const_byteptr in_block;  // next record in the current block
+  unsigned left_in_block;
+  bool next_block();
+};
+
+
+}
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef GRAEHL_CARMEL__RANDOM_ARCS_H
+#define GRAEHL_CARMEL__RANDOM_ARCS_H
+
+/* alias tables for choosing a random arc out of a WFST state in proportion to its weight (WFST::randomPath,
+   -G), or first a random input letter (uniformly) and then an arc with that input (WFST::generate, -g), in
+   O(1) per choice.  a state's tables are built the first time it's visited, from the arc weights then - see
+   WFST::random_choices.  like frozen_arcs, it points at the FSTArc in the states' lists.
+*/
+
+#include <graehl/shared/alias_table.hpp>
+#include <carmel/src/state.h>
+#include <algorithm>
+#include <vector>
+
+namespace graehl {
+
+struct random_arcs {
+  typedef FSTArc const* arc_p;
+
+  /// some arcs and an alias table in proportion to their weights
+  struct choice {
+    std::vector<arc_p> arcs;
+    alias_table table;
+    arc_p operator()(double u_column, double u_coin) const { return arcs[table(u_column, u_coin)]; }
+    void build() {
+      Weight max;
+      for (unsigned i = 0, n = arcs.size(); i < n; ++i)
+        if (arcs[i]->weight > max) max = arcs[i]->weight;
+      std::vector<double> w(arcs.size());
+      if (!max.isZero())  // relative to the max, so tiny (log) weights don't underflow
+        for (unsigned i = 0, n = arcs.size(); i < n; ++i) w[i] = (arcs[i]->weight / max).getReal();
+      table.build(w.begin(), w.end());
+    }
+  };
+
+  struct state_choices {
+    choice any;  // all the arcs
+    std::vector<choice> by_input;  // one per input letter
+  };
+
+  template <class States>
+  random_arcs(States& states, unsigned n_states)
+      : states(n_states ? &states[0] : 0), choices(n_states) {}
+
+  /// the choices out of s (built now if s wasn't visited before)
+  state_choices const& operator[](unsigned s) {
+    state_choices*& c = choices[s];
+    if (!c) build(s, c = new state_choices);
+    return *c;
+  }
+
+  ~random_arcs() {
+    for (unsigned s = 0, n = choices.size(); s < n; ++s) delete choices[s];
+  }
+
+ private:
+  State* states;
+  std::vector<state_choices*> choices;
+
+  struct by_input {
+    bool operator()(arc_p a, arc_p b) const { return a->in < b->in; }
+  };
+
+  void build(unsigned s, state_choices* c) {
+    std::vector<arc_p>& arcs = c->any.arcs;
+    State::Arcs const& sa = states[s].arcs;
+    for (State::Arcs::const_iterator a = sa.const_begin(), end = sa.const_end(); a != end; ++a)
+      arcs.push_back(&*a);
+    c->any.build();
+    std::vector<arc_p> sorted(arcs);
+    std::stable_sort(sorted.begin(), sorted.end(), by_input());
+    for (unsigned i = 0, n = sorted.size(); i < n;) {
+      c->by_input.push_back(choice());
+      choice& in = c->by_input.back();
+      unsigned letter = sorted[i]->in;
+      for (; i < n && sorted[i]->in == letter; ++i) in.arcs.push_back(sorted[i]);
+      in.build();
+    }
+  }
+};
+
+/// a WFST's random_arcs, or 0.  copies start out empty
+struct random_arcs_cache {
+  random_arcs* p;
+  random_arcs_cache() : p() {}
+  random_arcs_cache(random_arcs_cache const&) : p() {}
+  random_arcs_cache& operator=(random_arcs_cache const&) {
+    clear();
+    return *this;
+  }
+  ~random_arcs_cache() { clear(); }
+  void clear() {
+    delete p;
+    p = 0;
+  }
+};
+
+
+}
+
+#endif
@@ -0,0 +1,47 @@
+// extended_sum (graehl/shared/extended_sum.hpp) keeps sums far outside a double's range exactly, and is more
+// accurate than logweight<float> += (how long and how far off each is) summing counts the way forest-em does:
+// many terms <= 1, some tiny
+// usage: Textsum [n-terms=10000000]
+#include <graehl/shared/extended_sum.hpp>
+#include <graehl/shared/weight.h>
+#include <carmel/src/tests/bench.hpp>
+#include <cmath>
+using namespace graehl;
+using namespace std;
+using namespace bench;
+
+int main(int argc, char* argv[]) {
+  unsigned n = arg(argc, argv, 1, 10000000);
+
+  extended_sum tiny;  // far below a double's range
+  for (unsigned i = 0; i < 1000; ++i) tiny.add_ln(-100000);
+  if (fabs(tiny.ln() - (-100000 + log(1000.))) > 1e-9) fail("1000 e^-100000 = e^%.10g", tiny.ln());
+  extended_sum big;  // far above one
+  big.add_ln(1000);
+  big.add_ln(0);
+  big.add_ln(-HUGE_VAL);
+  if (fabs(big.ln() - 1000) > 1e-12) fail("e^1000 + 1 + 0 = e^%.10g", big.ln());
+
+  extended_sum s, t;
+  logweight<float> f;
+  long double ref = 0;
+  for (unsigned i = 0; i < n; ++i) ref += expl(-3 * uniform());
+  reseed();
+  timer time;
+  for (unsigned i = 0; i < n; ++i) (i & 1 ? s : t).add_ln(-3 * uniform());
+  s += t;
+  double ext_s = time.lap();
+  reseed();
+  for (unsigned i = 0; i < n; ++i) {
+    logweight<float> x;
+    x.setLn(-3 * uniform());
+    f += x;
+  }
+  double float_s = time.lap();
+  double ext_err = fabs(exp(s.ln()) / (double)ref - 1), float_err = fabs(exp(f.getLn()) / (double)ref - 1);
+  printf("%u terms: sum %.10Lg; relative error extended_sum %.3g, logweight<float> %.3g\n", n, ref, ext_err,
+         float_err);
+  printf("extended_sum %.3g ns/term, logweight<float> += %.3g ns/term\n", 1e9 * ext_s / n, 1e9 * float_s / n);
+  if (ext_err > 1e-12) fail("extended_sum error");
+  return failed();
+}
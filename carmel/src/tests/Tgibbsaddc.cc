@@ -0,0 +1,66 @@
+// gibbs blocks (graehl/shared/gibbs.hpp) added and removed one id at a time vs. compacted (block_delta::compact:
+// each distinct param once) give the same counts; and the time each takes, for long blocks that repeat a few
+// params of many
+// usage: Tgibbsaddc [block-length=3000] [distinct-per-block=200] [n-blocks=200] [n-params=2000000]
+#include <graehl/shared/dynamic_array.hpp>
+#include <graehl/shared/fixed_array.hpp>
+#include <graehl/shared/weight.h>
+#include <graehl/shared/gibbs.hpp>
+#include <carmel/src/tests/bench.hpp>
+using namespace graehl;
+using namespace bench;
+using namespace std;
+
+typedef gibbs_base::block_delta block_delta;
+typedef gibbs_base::local_counts local_counts;
+
+int main(int argc, char* argv[]) {
+  unsigned n = arg(argc, argv, 1, 3000), u = arg(argc, argv, 2, 200), nb = arg(argc, argv, 3, 200),
+           np = arg(argc, argv, 4, 2000000), iter = 10;
+  gibbs_opts gopt;
+  gibbs_base g(gopt, cout, cerr);
+  g.init(1, nb);
+  for (unsigned i = 0; i < np; ++i) g.define_param(i / 10, 1);
+  g.restore_p0();
+
+  fixed_array<block_delta> blocks(nb);
+  fixed_array<unsigned> pool(u);
+  for (unsigned b = 0; b < nb; ++b) {
+    for (unsigned i = 0; i < u; ++i) pool[i] = below(np);
+    for (unsigned i = 0; i < n; ++i) blocks[b].id.push_back(pool[below(u)]);
+  }
+
+  local_counts ids, compacted;
+  ids.snapshot(g, 1);
+  compacted.snapshot(g, 1);
+  timer time;
+  for (unsigned t = 0; t < iter; ++t)
+    for (unsigned b = 0; b < nb; ++b) {
+      block_delta const& bd = blocks[b];
+      if (t)
+        for (unsigned i = 0; i < n; ++i) ids.addc(bd.id[i], -1);
+      for (unsigned i = 0; i < n; ++i) ids.addc(bd.id[i], 1);
+    }
+  double ids_s = time.lap();
+  for (unsigned t = 0; t < iter; ++t)
+    for (unsigned b = 0; b < nb; ++b) {
+      if (t) compacted.addc(blocks[b], -1);
+      compacted.addc(blocks[b], 1);
+    }
+  double compacted_s = time.lap();
+
+  for (unsigned i = 0; i < np; ++i)
+    if (ids.count[i] != compacted.count[i]) {
+      fail("count[%u] %g one id at a time, %g compacted", i, ids.count[i], compacted.count[i]);
+      break;
+    }
+  for (unsigned i = 0; i < ids.normsum.size(); ++i)
+    if (ids.normsum[i] != compacted.normsum[i]) {
+      fail("normsum[%u] %g one id at a time, %g compacted", i, ids.normsum[i], compacted.normsum[i]);
+      break;
+    }
+  double per = 1e9 / ((2. * iter - 1) * nb * n);
+  printf("%u blocks of %u ids (%u distinct) over %u params: one id at a time %.3g ns/id, compacted %.3g ns/id\n",
+         nb, n, u, np, ids_s * per, compacted_s * per);
+  return failed();
+}
@@ -0,0 +1,69 @@
+// lazy_kbest_paths (graehl/shared/lazy_kbest_paths.hpp) vs. Eppstein's bestPaths (kbest.h): the same path costs
+// in the same order on small random (cyclic) graphs, then throughput on a long lattice
+// usage: Tkbest [lattice-states=20000] [k=1000]
+#define GRAEHL__SINGLE_MAIN
+#include <graehl/shared/graph.h>
+#include <graehl/shared/kbest.h>
+#include <graehl/shared/lazy_kbest_paths.hpp>
+#include <carmel/src/tests/bench.hpp>
+#include <cmath>
+#include <vector>
+using namespace graehl;
+using namespace std;
+using namespace bench;
+
+struct path_costs {
+  enum { SIDETRACKS_ONLY = 0 };
+  vector<double> costs;
+  unsigned n_arcs;
+  path_costs() : n_arcs() {}
+  void start_path(unsigned k, FLOAT_TYPE cost) { costs.push_back(cost); }
+  void end_path() {}
+  void visit_best_arc(GraphArc const&) { ++n_arcs; }
+  void visit_sidetrack_arc(GraphArc const& a) { visit_best_arc(a); }
+};
+
+static Graph new_graph(unsigned n) {
+  Graph g;
+  g.nStates = n;
+  g.states = new GraphState[n];
+  return g;
+}
+
+// kbest.h tells the shortest path tree's arcs by their data, so it must be distinct
+static void add_arc(Graph& g, unsigned src, unsigned dest, double cost) {
+  static size_t id = 0;
+  g.states[src].add(src, dest, cost, (void*)++id);
+}
+
+int main(int argc, char* argv[]) {
+  unsigned n_lattice = arg(argc, argv, 1, 20000), k = arg(argc, argv, 2, 1000);
+  unsigned n_bad = 0;
+  for (unsigned t = 0; t < 1000; ++t) {
+    unsigned n = 2 + below(12);
+    Graph g = new_graph(n);
+    for (unsigned i = 0, m = below(4 * n); i < m; ++i) add_arc(g, below(n), below(n), .1 + .5 * below(5));
+    path_costs eppstein, lazy;
+    bestPaths(g, 0, n - 1, 50, eppstein);
+    lazy_kbest_paths(g, 0, n - 1).visit(50, lazy);
+    bool same = eppstein.costs.size() == lazy.costs.size();  // (tied paths may come in either order)
+    for (unsigned i = 0; same && i < lazy.costs.size(); ++i) same = fabs(eppstein.costs[i] - lazy.costs[i]) < 1e-4;
+    if (!same) ++n_bad;
+    freeGraph(g);
+  }
+  if (n_bad) fail("%u random graphs with different k-best costs", n_bad);
+
+  Graph g = new_graph(n_lattice);
+  for (unsigned s = 0; s + 1 < n_lattice; ++s)
+    for (unsigned j = 0; j < 8; ++j) add_arc(g, s, min(n_lattice - 1, s + 1 + below(3)), -log(1e-6 + uniform()));
+  path_costs eppstein, lazy;
+  timer time;
+  bestPaths(g, 0, n_lattice - 1, k, eppstein);
+  double eppstein_s = time.lap();
+  lazy_kbest_paths(g, 0, n_lattice - 1).visit(k, lazy);
+  double lazy_s = time.lap();
+  printf("%u best of a %u state lattice: Eppstein %gs, lazy %gs (%u and %u arcs)\n", k, n_lattice, eppstein_s,
+         lazy_s, eppstein.n_arcs, lazy.n_arcs);
+  freeGraph(g);
+  return failed();
+}
@@ -0,0 +1,75 @@
+// the batched log_sum (graehl/shared/log_sum_exp.hpp) is as accurate as folding logweight += (against a long
+// double reference), and how much faster
+// usage: Tlogsum [n-terms=32] [reps=200000]
+#include <graehl/shared/log_sum_exp.hpp>
+#include <graehl/shared/weight.h>
+#include <carmel/src/tests/bench.hpp>
+#include <cmath>
+#include <vector>
+using namespace graehl;
+using namespace std;
+using namespace bench;
+
+typedef logweight<double> W;
+
+static void random_terms(vector<W>& w) {
+  for (unsigned i = 0; i < w.size(); ++i)
+    if (uniform() < .05)
+      w[i].setZero();
+    else
+      w[i].setLn(-50 * uniform());
+}
+
+static double reference_ln(vector<W> const& w) {
+  long double max = -HUGE_VALL, s = 0;
+  for (unsigned i = 0; i < w.size(); ++i)
+    if (!w[i].isZero() && w[i].getLn() > max) max = w[i].getLn();
+  for (unsigned i = 0; i < w.size(); ++i)
+    if (!w[i].isZero()) s += expl(w[i].getLn() - max);
+  return s ? (double)(max + logl(s)) : -HUGE_VAL;
+}
+
+static W fold(vector<W> const& w) {
+  W s;
+  for (unsigned i = 0; i < w.size(); ++i) s += w[i];
+  return s;
+}
+
+static double rel_err(double a, double ref) {
+  return fabs(a - ref) / (fabs(ref) > 1 ? fabs(ref) : 1);
+}
+
+int main(int argc, char* argv[]) {
+  unsigned n = arg(argc, argv, 1, 32), reps = arg(argc, argv, 2, 200000);
+  vector<W> w;
+  double worst_batch = 0, worst_fold = 0;
+  for (unsigned t = 0; t < 100000; ++t) {
+    w.resize(1 + below(64));
+    random_terms(w);
+    double ref = reference_ln(w);
+    if (ref == -HUGE_VAL) continue;
+    worst_batch = max(worst_batch, rel_err(log_sum(&w[0], w.size()).getLn(), ref));
+    worst_fold = max(worst_fold, rel_err(fold(w).getLn(), ref));
+  }
+  printf("worst relative error: log_sum %g, += %g\n", worst_batch, worst_fold);
+  if (worst_batch >= 1e-14) fail("log_sum error");
+
+  w.resize(n);
+  random_terms(w);
+  double sink = 0;
+  timer time;
+  for (unsigned r = 0; r < reps; ++r) {
+    w[r % n].weight += 1e-9;
+    sink += log_sum(&w[0], n).getLn();
+  }
+  double batch_s = time.lap();
+  for (unsigned r = 0; r < reps; ++r) {
+    w[r % n].weight += 1e-9;
+    sink += fold(w).getLn();
+  }
+  double fold_s = time.lap();
+  double terms = (double)n * reps;
+  printf("%u terms x %u: log_sum %.3g ns/term, += %.3g ns/term (%.2fx) [%g]\n", n, reps, 1e9 * batch_s / terms,
+         1e9 * fold_s / terms, fold_s / batch_s, sink);
+  return failed();
+}
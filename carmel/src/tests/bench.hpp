@@ -0,0 +1,74 @@
+#ifndef GRAEHL_CARMEL__TESTS_BENCH_HPP
+#define GRAEHL_CARMEL__TESTS_BENCH_HPP
+
+/* shared by the T*.cc programs that check a graehl/shared header against a reference implementation and time
+   the two: a repeatable random sequence (an LCG, so reseed() replays it exactly), a cpu timer, and FAILED:
+   reporting.  each program's main returns bench::failed(), so make + running them is the test.
+*/
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+namespace bench {
+
+inline unsigned long long& seed() {
+  static unsigned long long s = 1;
+  return s;
+}
+inline void reseed(unsigned long long s = 1) {
+  seed() = s;
+}
+
+/// [0, 1)
+inline double uniform() {
+  unsigned long long& s = seed();
+  s = s * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (s >> 11) * (1. / 9007199254740992.);
+}
+
+/// [0, n)
+inline unsigned below(unsigned n) {
+  return (unsigned)(uniform() * n);
+}
+
+/// cpu seconds since construction or the last lap()
+struct timer {
+  std::clock_t start;
+  timer() : start(std::clock()) {}
+  double lap() {
+    std::clock_t now = std::clock();
+    double s = (double)(now - start) / CLOCKS_PER_SEC;
+    start = now;
+    return s;
+  }
+};
+
+/// command line argument i, or def if there aren't that many
+inline unsigned arg(int argc, char* argv[], int i, unsigned def) {
+  return argc > i ? (unsigned)std::atoi(argv[i]) : def;
+}
+
+inline int& failures() {
+  static int n = 0;
+  return n;
+}
+inline int failed() {
+  return failures() != 0;
+}
+
+/// prints FAILED: and the printf-formatted message (a newline is added)
+inline void fail(char const* format, ...) {
+  std::va_list a;
+  va_start(a, format);
+  std::printf("FAILED: ");
+  std::vprintf(format, a);
+  std::printf("\n");
+  va_end(a);
+  ++failures();
+}
+
+}  // namespace bench
+
+#endif
@@ -8,6 +8,10 @@
 #include <graehl/shared/periodic.hpp>
 #include <graehl/shared/segments.hpp>
 #include <graehl/shared/time_space_report.hpp>
+#include <graehl/shared/parallel_workers.hpp>
+#include <algorithm>
+#include <mutex>
+#include <vector>
 #define GRAEHL__DEBUG_PRINT_MAIN
 #include <graehl/shared/debugprint.hpp>
 //#define DEBUGTRAIN
@@ -27,7 +31,7 @@ void training_progress_scale(unsigned n, unsigned N, unsigned num_every) {
 }
 
 
-derivations::statistics derivations::global_stats;
+THREADLOCAL derivations::statistics derivations::global_stats;
 
 void check_fb_agree(Weight fin, Weight fin2) {
 #ifdef DEBUGTRAIN
@@ -99,22 +103,40 @@ struct matrix_io_index : boost::noncopyable {
 };
 
 
-// similar to transposition but not quite: instead of replacing w.ij with w.ji, replace w.ij with w.(I-i)(J-j)
-// ... matrix has the same dimensions.  it's a 180 degree rotation, not a reflection about the identity line
-void matrix_reverse_io(Weight*** w, int max_i, int max_o) {
-  int i;
-  for (i = 0; i <= max_i / 2; ++i) {
-    Weight** temp = w[i];
-    w[i] = w[max_i - i];
-    w[max_i - i] = temp;
+// forward or backward sums for one training example: for each (i,o) (input,output) position pair, only the
+// states with nonzero weight, sorted by state.  this replaces a dense (nIn+1) x (nOut+1) x n_states cube, which
+// was almost all zeros (and cleared for every example)
+struct sparse_lattice {
+  typedef std::pair<unsigned, Weight> entry;  // (state, weight)
+  typedef std::vector<entry> cell_t;
+  std::vector<cell_t> cells;  // (i,o) at i*n_o+o; only the first n_cells are in use
+  unsigned n_o, n_cells;
+  sparse_lattice() : n_o(), n_cells() {}
+
+  // keeps the cells' capacity from previous examples
+  void reset(unsigned nIn, unsigned nOut) {
+    n_o = nOut + 1;
+    n_cells = (nIn + 1) * n_o;
+    if (cells.size() < n_cells) cells.resize(n_cells);
+    for (unsigned c = 0; c < n_cells; ++c) cells[c].clear();
+  }
+  cell_t& operator()(unsigned i, unsigned o) { return cells[i * n_o + o]; }
+  cell_t const& operator()(unsigned i, unsigned o) const { return cells[i * n_o + o]; }
+
+  struct less_state {
+    bool operator()(entry const& a, unsigned s) const { return a.first < s; }
+    bool operator()(entry const& a, entry const& b) const { return a.first < b.first; }
+  };
+  Weight get(unsigned i, unsigned o, unsigned s) const {
+    cell_t const& c = (*this)(i, o);
+    cell_t::const_iterator e = std::lower_bound(c.begin(), c.end(), s, less_state());
+    return e != c.end() && e->first == s ? e->second : Weight();
   }
-  for (i = 0; i <= max_i; ++i)
-    for (int o = 0; o <= max_o / 2; ++o) {
-      Weight* temp = w[i][o];
-      w[i][o] = w[i][max_o - o];
-      w[i][max_o - o] = temp;
-    }
-}
+
+  // similar to transposition but not quite: instead of replacing w.ij with w.ji, replace w.ij with
+  // w.(I-i)(J-j) ... it's a 180 degree rotation, not a reflection about the identity line
+  void reverse_io() { std::reverse(cells.begin(), cells.begin() + n_cells); }
+};
 
 namespace for_arcs {
 
@@ -224,7 +246,7 @@ struct add_weighted_scratch {
 struct forward_backward : public cached_derivs<arc_counts> {
   typedef cached_derivs<arc_counts> cache_t;
   cascade_parameters& cascade;
-  unsigned n_in, n_out, n_st;
+  unsigned n_st;
   typedef arcs_table<arc_counts> arcs_t;
   training_corpus* trn;
 
@@ -234,10 +256,78 @@ struct forward_backward : public cached_derivs<arc_counts> {
   bool use_matrix;
   bool remove_bad_training;
   matrix_io_index mio;
-  Weight*** f, ***b;
-  List<unsigned> e_forward_topo, e_backward_topo;  // epsilon edges that don't make cycles are handled by
-  // propogating forward/backward in these orders (state = int
-  // because of graph.h)
+  // epsilon edges that don't make cycles are handled by propogating forward/backward in topological order;
+  // e_*_rank[s] is s's place in that order, or no_rank if s has no (in/backward: incoming) epsilon edges
+  fixed_array<unsigned> e_forward_rank, e_backward_rank;
+  enum { no_rank = ~0u };
+
+  /// --threads: each E-step worker gets a contiguous range of the corpus and its own counts (and f,b
+  /// matrices); reduce_workers sums them into arcs in worker order, so results depend only on n_threads
+  struct estimate_worker : boost::noncopyable {
+    forward_backward* fb;
+    fixed_array<Weight> counts;  // indexed like arcs
+    Weight unweighted_corpus_prob, weighted_corpus_prob;
+    sparse_lattice f, b;  // use_matrix only
+    fixed_array<Weight> scratch;  // use_matrix: counts for current example, indexed like arcs
+    fixed_array<unsigned> cell_index;  // use_matrix: state -> index in the lattice cell being summed, or no_rank
+    fixed_array<Weight> b_near;  // use_matrix: b(i+d_i,o+d_o) for d_i,d_o in {0,1}, dense: [(2*d_i+d_o)*n_st+s]
+    std::vector<std::pair<unsigned, unsigned> > agenda;  // use_matrix: (rank,state) heap for epsilon edges
+    dynamic_array<unsigned> no_derivation;  // use_matrix: (0-based) corpus index of examples with no path
+    fixed_array<double> real_counts;  // --semiring=real: counts added in double precision, indexed like arcs
+    estimate_worker() : fb() {}
+    void clear() {
+      counts.reinit(fb->arcs.size());
+      if (fb->semiring == WFST::real_semiring) real_counts.reinit(fb->arcs.size(), 0.);
+      unweighted_corpus_prob.setOne();
+      weighted_corpus_prob.setOne();
+      no_derivation.clear();
+    }
+    // for foreach_deriv_threads; Derivations is derivations or (--disk-cache-format) packed_derivation
+    template <class Derivations>
+    void operator()(unsigned n, Derivations& derivs)
+    {
+      fb->progress();
+      Weight prob;
+      if (fb->semiring == WFST::max_semiring)
+        prob = derivs.collect_counts(best_path(), fb->arcs, counts);
+      else if (fb->semiring == WFST::real_semiring) {
+        prob = derivs.collect_counts(real_paths(fb->real_weights.begin()), fb->arcs, real_counts);
+        if (prob.isZero())  // underflow: this example in log space
+          prob = derivs.collect_counts(log_paths(), fb->arcs, counts);
+      } else
+        prob = derivs.collect_counts(log_paths(), fb->arcs, counts);
+      unweighted_corpus_prob *= prob;
+      weighted_corpus_prob *= prob.pow(derivs.weight);
+    }
+  };
+  unsigned n_threads;
+  WFST::path_semiring semiring;
+  fixed_array<double> real_weights;  // --semiring=real: arc weights this iteration, indexed like arcs
+  fixed_array<estimate_worker> workers;
+  std::mutex progress_mutex;
+  unsigned n_done;
+  void progress() {
+    std::lock_guard<std::mutex> lock(progress_mutex);
+    training_progress_scale(++n_done, corpus().size());
+  }
+  void clear_workers() {
+    n_done = 0;
+    for (unsigned t = 0; t < n_threads; ++t) workers[t].clear();
+  }
+  Weight reduce_workers(Weight& unweighted_corpus_prob_accum) {
+    Weight weighted = 1;
+    for (unsigned t = 0; t < n_threads; ++t) {
+      estimate_worker const& w = workers[t];
+      unweighted_corpus_prob_accum *= w.unweighted_corpus_prob;
+      weighted *= w.weighted_corpus_prob;
+      for (unsigned i = 0, N = arcs.size(); i != N; ++i)
+        if (!w.counts[i].isZero()) arcs[i].counts += w.counts[i];
+      for (unsigned i = 0, N = w.real_counts.size(); i != N; ++i)
+        if (w.real_counts[i] != 0) arcs[i].counts += Weight(w.real_counts[i]);
+    }
+    return weighted;
+  }
+
   bool exists_some_derivation() const {
     if (trn->examples.empty()) {
       Config::warn() << "No training example had a derivation - check your models, quotes, manually compose "
@@ -251,50 +341,65 @@ struct forward_backward : public cached_derivs<arc_counts> {
       throw std::runtime_error("No training example had a derivation - aborting training.");
   }
 
-  inline void matrix_compute(IOSymSeq const& s, bool backward = false) {
+  inline void matrix_compute(IOSymSeq const& s, estimate_worker& w, bool backward = false) {
     if (backward) {
-      matrix_compute(s.i.n, s.i.rLet, s.o.n, s.o.rLet, x.final, b, mio.backward, e_backward_topo);
+      matrix_compute(w, s.i.n, s.i.rLet, s.o.n, s.o.rLet, x.final, w.b, mio.backward, e_backward_rank);
       // since the backward paths were obtained on the reversed input/output, reverse them back
-      matrix_reverse_io(b, s.i.n, s.o.n);
+      w.b.reverse_io();
     } else
-      matrix_compute(s.i.n, s.i.let, s.o.n, s.o.let, 0, f, mio.forward, e_forward_topo);
+      matrix_compute(w, s.i.n, s.i.let, s.o.n, s.o.let, 0, w.f, mio.forward, e_forward_rank);
   }
 
-  void matrix_compute(unsigned nIn, int* inLet, unsigned nOut, int* outLet, unsigned start, Weight*** w,
-                      matrix_io_index::states_t& io, List<unsigned> const& eTopo);
+  void matrix_compute(estimate_worker& w, unsigned nIn, int* inLet, unsigned nOut, int* outLet, unsigned start,
+                      sparse_lattice& m, matrix_io_index::states_t& io, fixed_array<unsigned> const& eRank);
 
-  inline void matrix_forward_prop(Weight*** m, matrix_io_index::for_io const* fio, unsigned s, unsigned i,
-                                  unsigned o, unsigned d_i, unsigned d_o) {
+  // the (nonzero) weight from (i,o,s) along each arc in fio, appended to the (i+d_i,o+d_o) cell, which is summed
+  // (in the order things were appended) when matrix_compute reaches it
+  inline void matrix_forward_prop(sparse_lattice& m, matrix_io_index::for_io const* fio, unsigned s,
+                                  Weight const& from, unsigned i, unsigned o, unsigned d_i, unsigned d_o) {
     if (!fio) return;
+    sparse_lattice::cell_t& to = m(i + d_i, o + d_o);
     for (matrix_io_index::for_io::const_iterator dw = fio->begin(), e = fio->end(); dw != e; ++dw) {
       arc_counts& a = arcs[dw->id];
       unsigned d = dw->dest;
       assert(a.dest() == d || a.src == d);  // first: forward, second: reverse
-      Weight& to = m[i + d_i][o + d_o][d];
-      Weight const& from = m[i][o][s];
       Weight const& w = a.weight();
 #ifdef DEBUGFB
       Config::debug() << "w[" << i + d_i << "][" << o + d_o << "][" << d << "] += "
-                      << "w[" << i << "][" << o << "][" << s << "] * weight(" << *dw << ") =" << to << " + "
-                      << from << " * " << w << " = " << to << " + " << from * w << " = " << to + (from * w)
-                      << "\n";
+                      << "w[" << i << "][" << o << "][" << s << "] * weight(" << *dw << ") = " << from << " * "
+                      << w << " = " << from * w << "\n";
 #endif
-      to += from * w;
+      to.push_back(sparse_lattice::entry(d, from * w));
     }
   }
 
   // accumulate counts for this example into scratch (so they can be weighted later all at once.  saves a few
   // mults to weighting as you go?)
-  inline void matrix_count(matrix_io_index::for_io const* fio, unsigned s, unsigned i, unsigned o,
+  inline void matrix_count(estimate_worker& w, matrix_io_index::for_io const* fio, Weight const& f,
                            unsigned d_i, unsigned d_o) {
     if (!fio) return;
+    Weight const* b = &w.b_near[(2 * d_i + d_o) * n_st];
     for (matrix_io_index::for_io::const_iterator dw = fio->begin(), e = fio->end(); dw != e; ++dw) {
       arc_counts& a = arcs[dw->id];
       assert(a.dest() == dw->dest);
-      a.scratch += f[i][o][s] * a.weight() * b[i + d_i][o + d_o][dw->dest];
+      if (!b[dw->dest].isZero()) w.scratch[dw->id] += f * a.weight() * b[dw->dest];
     }
   }
 
+  // copy (or with zero=true, clear) the b cells that (i,o) arcs reach into w.b_near
+  void matrix_near(estimate_worker& w, unsigned i, unsigned o, unsigned nIn, unsigned nOut, bool zero) {
+    for (unsigned d_i = 0; d_i < 2 && i + d_i <= nIn; ++d_i)
+      for (unsigned d_o = 0; d_o < 2 && o + d_o <= nOut; ++d_o) {
+        Weight* b = &w.b_near[(2 * d_i + d_o) * n_st];
+        sparse_lattice::cell_t const& c = w.b(i + d_i, o + d_o);
+        for (sparse_lattice::cell_t::const_iterator e = c.begin(), end = c.end(); e != end; ++e)
+          if (zero)
+            b[e->first].setZero();
+          else
+            b[e->first] = e->second;
+      }
+  }
+
   //     newPerplexity = train_estimate();
   //  lastChange = train_maximize(method);
   //    Weight train_estimate(Weight &unweighted_corpus_prob,bool remove_bad_training=true); // accumulates
@@ -312,8 +417,20 @@ struct forward_backward : public cached_derivs<arc_counts> {
   // these take an initialize unweighted_corpus_prob and counts, and accumulate over the training corpus
   Weight weighted_corpus_prob;
   Weight* unweighted_corpus_prob;
+  void set_real_weights() {
+    if (semiring == WFST::real_semiring)
+      for (unsigned i = 0, N = arcs.size(); i != N; ++i) real_weights[i] = arcs[i].weight().getReal();
+  }
   Weight estimate_cached(Weight& unweighted_corpus_prob_accum) {
     assert(!use_matrix);
+    // the worker path also reads disk caches ahead on another thread
+    if (n_threads > 1 || semiring != WFST::sum_semiring || cache_t::packed || cache_t::disk_derivs()) {
+      set_real_weights();
+      clear_workers();
+      cache_t::foreach_deriv_threads(workers, n_threads);
+      Config::log() << '\n';
+      return reduce_workers(unweighted_corpus_prob_accum);
+    }
     unweighted_corpus_prob = &unweighted_corpus_prob_accum;
     weighted_corpus_prob.setOne();
     cache_t::foreach_deriv(*this);
@@ -322,6 +439,99 @@ struct forward_backward : public cached_derivs<arc_counts> {
   }
   Weight estimate_matrix(Weight& unweighted_corpus_prob_accum);
 
+  /// --online-em: workers[0] collects the counts of each minibatch, then online_step interpolates them into
+  /// online_counts and reestimates, so later examples in the pass see the new weights
+  struct online_worker {
+    forward_backward& fb;
+    unsigned in_batch;
+    explicit online_worker(forward_backward& fb) : fb(fb), in_batch() {}
+    template <class Derivations>
+    void operator()(unsigned n, Derivations& derivs) {
+      fb.workers[0](n, derivs);
+      if (++in_batch == fb.minibatch) {
+        fb.online_step(in_batch);
+        in_batch = 0;
+      }
+    }
+  };
+  unsigned minibatch;
+  double stepsize_alpha;
+  unsigned n_steps;
+  fixed_array<Weight> online_counts;  // indexed like arcs
+  fixed_array<Weight> pass_start;  // weights before the pass, for online_change
+  WFST::NormalizeMethods const* online_methods;
+  void online_step(unsigned n_batch) {
+    estimate_worker& w = workers[0];
+    double eta = std::pow(n_steps++ + 2., -stepsize_alpha);
+    // minibatch counts are scaled up to the corpus, so priors weigh the same as in batch EM
+    Weight keep(1 - eta), scale(eta * cache_t::size() / n_batch);
+    for (unsigned i = 0, N = arcs.size(); i != N; ++i) {
+      Weight c = w.counts[i];
+      if (!w.real_counts.empty() && w.real_counts[i] != 0) {
+        c += Weight(w.real_counts[i]);
+        w.real_counts[i] = 0;
+      }
+      online_counts[i] = keep * online_counts[i] + scale * c;
+      arcs[i].counts = online_counts[i];
+      w.counts[i].setZero();
+    }
+    maximize(*online_methods, 1);
+    cascade.update();
+    set_real_weights();
+  }
+
+ public:
+  Weight online_change;  // max weight change over the last estimate_online pass
+
+  /// one --online-em pass over the corpus, reestimating after each minibatch; returns the corpus probability
+  /// (under the weights as they were when each example was seen).  restart: forget earlier passes' counts
+  Weight estimate_online(Weight& unweighted_corpus_prob, WFST::NormalizeMethods const& methods, bool restart) {
+    assert(!use_matrix);
+    online_methods = &methods;
+    unsigned N = arcs.size();
+    if (restart) {
+      // start from counts as if each example visited each state once under the current weights, so an arc
+      // the first minibatches don't use keeps some (decaying) weight rather than 0
+      n_steps = 0;
+      online_counts.reinit(N);
+      Weight n_examples((double)cache_t::size());
+      for (unsigned i = 0; i != N; ++i) online_counts[i] = arcs[i].weight() * n_examples;
+    }
+    pass_start.reinit(N);
+    for (unsigned i = 0; i != N; ++i) pass_start[i] = arcs[i].weight();
+    arcs.visit(for_arcs::clear_count());
+    set_real_weights();
+    clear_workers();
+    online_worker w(*this);
+    online_worker* ws = &w;
+    cache_t::foreach_deriv_threads(ws, 1);
+    if (w.in_batch) online_step(w.in_batch);
+    Config::log() << '\n';
+    throw_if_no_derivation();
+    online_change.setZero();
+    for (unsigned i = 0; i != N; ++i)
+      if (!WFST::isLocked(arcs[i].groupId())) {
+        Weight change = absdiff(arcs[i].weight(), pass_start[i]);
+        if (change > online_change) online_change = change;
+      }
+    unweighted_corpus_prob = workers[0].unweighted_corpus_prob;
+    return workers[0].weighted_corpus_prob;
+  }
+
+ private:
+  void estimate_matrix(estimate_worker& w, IOSymSeq const& seq, unsigned example_no);
+
+  struct estimate_matrix_range {
+    forward_backward& fb;
+    dynamic_array<IOSymSeq*> const& examples;
+    estimate_matrix_range(forward_backward& fb, dynamic_array<IOSymSeq*> const& examples)
+        : fb(fb), examples(examples) {}
+    void operator()(std::size_t t) const {
+      worker_range_type r = worker_range(t, fb.n_threads, examples.size());
+      for (std::size_t i = r.first; i != r.second; ++i) fb.estimate_matrix(fb.workers[t], *examples[i], i);
+    }
+  };
+
  public:
   void operator()(unsigned n, derivations& derivs)  // for foreach_deriv
   {
@@ -334,12 +544,11 @@ struct forward_backward : public cached_derivs<arc_counts> {
   // return max change
   Weight maximize(WFST::NormalizeMethods const& methods, FLOAT_TYPE delta_scale = 1.);
 
-  void matrix_fb(IOSymSeq& s);
+  void matrix_fb(IOSymSeq const& s, estimate_worker& w);
 
   void e_topo_populate(bool include_backward) {
     assert(use_matrix);
-    e_forward_topo.clear();
-    e_backward_topo.clear();
+    List<unsigned> e_forward_topo, e_backward_topo;  // (state = int because of graph.h)
     {
       Graph eGraph = x.makeEGraph();
       TopoSort t(eGraph, &e_forward_topo);
@@ -356,6 +565,16 @@ struct forward_backward : public cached_derivs<arc_counts> {
       }
       freeGraph(eGraph);
     }
+    e_rank_populate(e_forward_rank, e_forward_topo, mio.forward);
+    if (include_backward) e_rank_populate(e_backward_rank, e_backward_topo, mio.backward);
+  }
+  void e_rank_populate(fixed_array<unsigned>& rank, List<unsigned> const& eTopo,
+                       matrix_io_index::states_t const& io) {
+    rank.reinit(x.numStates(), no_rank);
+    IOPair eps(0, 0);
+    unsigned r = 0;
+    for (List<unsigned>::const_iterator i = eTopo.const_begin(), e = eTopo.const_end(); i != e; ++i, ++r)
+      if (find_second(io[*i], eps)) rank[*i] = r;
   }
 
   bool cache;
@@ -366,21 +585,35 @@ struct forward_backward : public cached_derivs<arc_counts> {
 
   forward_backward(WFST& x, cascade_parameters& cascade, bool per_arc_prior, Weight global_prior,
                    bool include_backward, WFST::train_opts const& opts, training_corpus& corpus)
-      : cache_t(x, cascade, corpus, opts.cache)
+      : cache_t(x, cascade, corpus, opts.cache, true, opts.threads)
       , cascade(cascade)
       , arcs(x, per_arc_prior, global_prior)
-      , mio(arcs) {
+      , mio(arcs)
+      , n_threads(opts.threads ? opts.threads : 1)
+      , semiring(opts.semiring)
+      , real_weights(0., semiring == WFST::real_semiring ? arcs.size() : 0)
+      , workers(n_threads)
+      , minibatch(opts.minibatch)
+      , stepsize_alpha(opts.stepsize_alpha)
+      , n_steps()
+      , online_methods() {
     WFST::deriv_cache_opts const& copt = opts.cache;
     odf = copt.out_derivfile;
     prune = copt.prune();
     cascade.set_composed(&x);
     trn = NULL;
-    f = b = NULL;
+    for (unsigned t = 0; t < n_threads; ++t) workers[t].fb = this;
+    if (n_threads > 1) Config::log() << "Using " << n_threads << " threads for the E-step (--threads).\n";
     remove_bad_training = true;
     cache = copt.cache();
     use_matrix = copt.use_matrix();
-    if (use_matrix)
+    if (use_matrix) {
       Config::log() << "Using (input,state,output) full matrix, not derivation lattice.  Usually slower.\n";
+      if (semiring != WFST::sum_semiring) {
+        Config::warn() << "--semiring ignored with --matrix-fb (summing over paths in log space).\n";
+        semiring = WFST::sum_semiring;
+      }
+    }
     cache_backward = cache && copt.cache_backward();
     if (cache) {
       use_matrix = false;
@@ -392,32 +625,24 @@ struct forward_backward : public cached_derivs<arc_counts> {
     n_st = x.numStates();
     trn = &corpus;
     if (use_matrix) {
-      n_in = corpus.maxIn + 1;  // because position 0->1 is first symbol, there are n+1 boundary markers
-      n_out = corpus.maxOut + 1;
-      f = NEW Weight * *[n_in];
-      if (include_backward)
-        b = NEW Weight * *[n_in];
-      else
-        b = NULL;
-      for (unsigned i = 0; i < n_in; ++i) {
-        f[i] = NEW Weight * [n_out];
-        if (b) b[i] = NEW Weight * [n_out];
-        for (unsigned o = 0; o < n_out; ++o) {
-          f[i][o] = NEW Weight[n_st];
-          if (b) b[i][o] = NEW Weight[n_st];
-        }
+      for (unsigned t = 0; t < n_threads; ++t) {
+        estimate_worker& w = workers[t];
+        w.scratch.init(arcs.size());
+        w.cell_index.init(n_st, no_rank);
+        w.b_near.init(4 * n_st);
       }
     }
   }
 
-  void matrix_dump(unsigned m_i, unsigned m_o) {
-    assert(use_matrix && f && b);
+  void matrix_dump(estimate_worker const& w, unsigned m_i, unsigned m_o) {
+    sparse_lattice const& f = w.f, &b = w.b;
+    assert(use_matrix);
     Config::debug() << "\nForwardProb/BackwardProb:\n";
     for (unsigned i = 0; i <= m_i; ++i) {
       for (unsigned o = 0; o <= m_o; ++o) {
         Config::debug() << i << ':' << o << " (";
         for (unsigned s = 0; s < n_st; ++s) {
-          Config::debug() << f[i][o][s] << '/' << b[i][o][s];
+          Config::debug() << f.get(i, o, s) << '/' << b.get(i, o, s);
           if (s < n_st - 1) Config::debug() << ' ';
         }
         Config::debug() << ')' << std::endl;
@@ -431,19 +656,11 @@ struct forward_backward : public cached_derivs<arc_counts> {
 
   // call after done using f,b matrix for a corpus
   void cleanup() {
-    if (use_matrix && f) {
-      for (unsigned i = 0; i < n_in; ++i) {
-        for (unsigned o = 0; o < n_out; ++o) {
-          delete[] f[i][o];
-          if (b) delete[] b[i][o];
-        }
-        delete[] f[i];
-        if (b) delete[] b[i];
-      }
-      delete[] f;
-      if (b) delete[] b;
+    for (unsigned t = 0; t < n_threads; ++t) {
+      estimate_worker& w = workers[t];
+      w.f = sparse_lattice();
+      w.b = sparse_lattice();
     }
-    f = b = NULL;
   }
 
   void save_best() {
@@ -503,6 +720,7 @@ Weight WFST::train(training_corpus& corpus, NormalizeMethods const& methods, boo
 Weight WFST::train(cascade_parameters& cascade, training_corpus& corpus, NormalizeMethods const& methods,
                    bool weight_is_prior_count, Weight smoothFloor, Weight converge_arc_delta,
                    Weight converge_perplexity_ratio, train_opts const& opts, bool restore_old_weights) {
+  reweighted();
   std::ostream& log = Config::log();
   graehl::time_space_report ts(log, "Training took ");
   cascade.set_composed(this);
@@ -516,8 +734,14 @@ Weight WFST::train(cascade_parameters& cascade, training_corpus& corpus, Normali
   if (opts.max_iter + 1 == 0) // -1 indicates "-M"
     return fb.estimate(corpus_p).ppxper(corpus.totalEmpiricalWeight);
 
+  bool online = opts.online;
+  if (online && fb.use_matrix) {
+    Config::warn() << "--online-em not supported with --matrix-fb.  Using batch EM." << std::endl;
+    online = false;
+  }
+
   // when you just want frac counts or a single iteration:
-  if (opts.max_iter == 0 || (opts.max_iter == 1 && opts.ran_restarts == 0)) {
+  if (opts.max_iter == 0 || (opts.max_iter == 1 && opts.ran_restarts == 0 && !online)) {
     if (opts.max_iter == 0)
       log << "0 iterations specified for training; output weights will be unnormalized fractional counts "
              "(except locked arcs).\n";
@@ -541,10 +765,10 @@ Weight WFST::train(cascade_parameters& cascade, training_corpus& corpus, Normali
   Weight bestPerplexity;
   bestPerplexity.setInfinity();
   bool using_cascade = !cascade.trivial;
-  if (using_cascade) {
+  if (using_cascade || online) {
     if (learning_rate_growth_factor != 1) {
-      Config::warn() << "Overrelaxed EM not supported for --train-cascade.  Disabling (growth factor=1)."
-                     << std::endl;
+      Config::warn() << "Overrelaxed EM not supported for " << (online ? "--online-em" : "--train-cascade")
+                     << ".  Disabling (growth factor=1)." << std::endl;
       learning_rate_growth_factor = 1;
     }
   }
@@ -580,8 +804,9 @@ Weight WFST::train(cascade_parameters& cascade, training_corpus& corpus, Normali
             << "\n";
         break;
       }
-      Weight p = fb.estimate(corpus_p);  // lastPerplexity.isInfinity() // only delete no-path training the
-      // first time, in case we screw up with our learning rate
+      // lastPerplexity.isInfinity() // only delete no-path training the first time, in case we screw up with
+      // our learning rate
+      Weight p = online ? fb.estimate_online(corpus_p, methods, first_time) : fb.estimate(corpus_p);
       Weight newPerplexity = p.ppxper(corpus.totalEmpiricalWeight);
       DWSTAT("\nAfter estimate");
       log << "i=" << train_iter << " (rate=" << learning_rate << "): ";
@@ -596,7 +821,7 @@ Weight WFST::train(cascade_parameters& cascade, training_corpus& corpus, Normali
         log << " (new best)";
         bestPerplexity = newPerplexity;
         have_good_weights = true;
-        fb.save_best();
+        fb.save_best();  // --online-em: the end of pass weights, not the ones p was measured under (see usage)
       }
       Weight pp_ratio_scaled;
       if (first_time) {
@@ -649,7 +874,7 @@ Weight WFST::train(cascade_parameters& cascade, training_corpus& corpus, Normali
       } else  // we need to have saved counts after an estimate, so we can't save a global best at i=1
         last_was_reset = false;
       //            DWSTAT("Before maximize");
-      lastChange = fb.maximize(methods, learning_rate);
+      lastChange = online ? fb.online_change : fb.maximize(methods, learning_rate);
       if (lastChange <= converge_arc_delta && have_good_weights) {
         log << "Converged - maximum weight change less than " << converge_arc_delta << " after " << train_iter
             << " iterations.\n";
@@ -677,66 +902,96 @@ Weight WFST::train(cascade_parameters& cascade, training_corpus& corpus, Normali
   return bestPerplexity;
 }
 
-// possible speedups:
-// * exclude states that are definitely not on any path start->finish matching i:o
-// ** quick check: exclude if none of the outgoing transitions are (input|*e*):(output|*e*) for some input,
-// output in sequence
-/*
-// ** complete check: integrate search and summation of paths - search state: (s,i,o)
-constraint: can't visit (dequeue) (s,i,o) until already for all t (t,i-1,o-1),(t,i,o-1),(t,i-1,o) and all u
-(u,i,o) s.t. u->*e*->s
-easy to meet first 3 using for i: for o: loop; add state to agenda for next (i|i+1,o|o+1)
-when you have an *e* leaving something on the agenda, you need to add the dest to the head of the agenda, and,
-you must preorder the agenda so that if a->*e*->b, a cannot occur after b in the agenda.  you could sort the
-agenda by reverse dfs finishing times (dfs on the whole e graph though)
-
-*/
-// ** in order for excluding states to be worthwhile in O(s*i*o) terms, have to take as input a 0-initialized
-// w matrix and clear each non-0 entry after it is no longer in play.  ouch - that means all the lists (of
-// nonzero values) need to be kept around until after people are done playing with the w
-
-void forward_backward::matrix_compute(unsigned nIn, int* inLet, unsigned nOut, int* outLet, unsigned start,
-                                      Weight*** w, matrix_io_index::states_t& io, List<unsigned> const& eTopo) {
-
-  unsigned i, o, s;
-  for (i = 0; i <= nIn; ++i)
-    for (o = 0; o <= nOut; ++o)
-      for (s = 0; s < n_st; ++s) w[i][o][s].setZero();
-
-  w[0][0][start] = 1;
+// only (i,o,s) reachable from the start (matching the first i inputs and o outputs) are visited: cells are
+// visited for i: for o:, and each cell's nonzero states propagate (appending) into the (i,o+1), (i+1,o+1),
+// (i+1,o) cells.  when a cell is reached, everything that can reach it has been appended, so it's summed
+// (in the order appended, so sums are exactly as when the cube was dense), then closed under the
+// (non-cyclic) epsilon edges: an agenda ordered by topological rank of the *e*:*e* subgraph, starting with the
+// cell's states and adding any newly reached state that comes later in that order
+void forward_backward::matrix_compute(estimate_worker& w, unsigned nIn, int* inLet, unsigned nOut, int* outLet,
+                                      unsigned start, sparse_lattice& m, matrix_io_index::states_t& io,
+                                      fixed_array<unsigned> const& eRank) {
+  typedef sparse_lattice::cell_t cell_t;
+  typedef std::pair<unsigned, unsigned> agendum;  // (rank,state)
+  typedef std::greater<agendum> agenda_later;  // min-heap
+  fixed_array<unsigned>& index = w.cell_index;
+  std::vector<agendum>& agenda = w.agenda;
+
+  m.reset(nIn, nOut);
+  m(0, 0).push_back(sparse_lattice::entry(start, one_weight()));
 
   IOPair IO;
-
-  for (i = 0; i <= nIn; ++i) {
-    for (o = 0; o <= nOut; ++o) {
+  for (unsigned i = 0; i <= nIn; ++i) {
+    for (unsigned o = 0; o <= nOut; ++o) {
 #ifdef DEBUGFB
       Config::debug() << "(" << i << "," << o << ")\n";
 #endif
+      cell_t& c = m(i, o);
+      // sum (in place) what was appended
+      unsigned n = 0;
+      for (unsigned k = 0, N = c.size(); k < N; ++k) {
+        unsigned s = c[k].first;
+        Weight add = c[k].second;  // n <= k: c[n] was already read
+        if (index[s] == no_rank) {
+          index[s] = n;
+          c[n++] = sparse_lattice::entry(s, Weight());
+        }
+        c[index[s]].second += add;
+      }
+      c.resize(n);
+
       IO.in = 0;
       IO.out = 0;
-      for (List<unsigned>::const_iterator topI = eTopo.const_begin(), end = eTopo.const_end(); topI != end;
-           ++topI) {
-        s = *topI;
-        matrix_io_index::for_state const& fs = io[s];
-        matrix_forward_prop(w, find_second(fs, IO), s, i, o, 0, 0);
+      agenda.clear();
+      for (unsigned k = 0; k < n; ++k)
+        if (eRank[c[k].first] != no_rank) agenda.push_back(agendum(eRank[c[k].first], c[k].first));
+      std::make_heap(agenda.begin(), agenda.end(), agenda_later());
+      while (!agenda.empty()) {
+        std::pop_heap(agenda.begin(), agenda.end(), agenda_later());
+        unsigned r = agenda.back().first, s = agenda.back().second;
+        agenda.pop_back();
+        matrix_io_index::for_io const* fio = find_second(io[s], IO);
+        for (matrix_io_index::for_io::const_iterator dw = fio->begin(), e = fio->end(); dw != e; ++dw) {
+          unsigned d = dw->dest;
+          Weight from = c[index[s]].second;  // (not hoisted: d may be s)
+          if (index[d] == no_rank) {
+            index[d] = c.size();
+            c.push_back(sparse_lattice::entry(d, Weight()));
+            if (eRank[d] != no_rank && eRank[d] > r) {
+              agenda.push_back(agendum(eRank[d], d));
+              std::push_heap(agenda.begin(), agenda.end(), agenda_later());
+            }
+          }
+#ifdef DEBUGFB
+          Config::debug() << "w[" << i << "][" << o << "][" << d << "] += w[" << i << "][" << o << "][" << s
+                          << "] * weight(" << *dw << ")\n";
+#endif
+          c[index[d]].second += from * arcs[dw->id].weight();
+        }
       }
-      for (s = 0; s < n_st; ++s) {
-        if (w[i][o][s].isZero()) continue;
+
+      for (cell_t::const_iterator a = c.begin(), e = c.end(); a != e; ++a) index[a->first] = no_rank;
+      std::sort(c.begin(), c.end(), sparse_lattice::less_state());
+
+      for (cell_t::const_iterator a = c.begin(), e = c.end(); a != e; ++a) {
+        unsigned s = a->first;
+        Weight const& from = a->second;
+        if (from.isZero()) continue;
         matrix_io_index::for_state const& fs = io[s];
         if (o < nOut) {
           IO.in = 0;
           IO.out = outLet[o];
-          matrix_forward_prop(w, find_second(fs, IO), s, i, o, 0, 1);
+          matrix_forward_prop(m, find_second(fs, IO), s, from, i, o, 0, 1);
           if (i < nIn) {
             IO.in = inLet[i];
             IO.out = outLet[o];
-            matrix_forward_prop(w, find_second(fs, IO), s, i, o, 1, 1);
+            matrix_forward_prop(m, find_second(fs, IO), s, from, i, o, 1, 1);
           }
         }
         if (i < nIn) {
           IO.in = inLet[i];
           IO.out = 0;
-          matrix_forward_prop(w, find_second(fs, IO), s, i, o, 1, 0);
+          matrix_forward_prop(m, find_second(fs, IO), s, from, i, o, 1, 0);
         }
       }
     }
@@ -744,18 +999,18 @@ void forward_backward::matrix_compute(unsigned nIn, int* inLet, unsigned nOut, i
 }
 
 
-void forward_backward::matrix_fb(IOSymSeq& s) {
+void forward_backward::matrix_fb(IOSymSeq const& s, estimate_worker& w) {
 #ifdef DEBUGFB
   Config::debug() << "training example: \n" << s << "\nForward\n";
 #endif
-  matrix_compute(s, false);
+  matrix_compute(s, w, false);
 #ifdef DEBUGFB
   Config::debug() << "\nBackward\n";
 #endif
-  matrix_compute(s, true);
+  matrix_compute(s, w, true);
 
 #ifdef DEBUGTRAINDETAIL  // Yaser 7-20-2000
-  matrix_dump(s.i.n, s.o.n);
+  matrix_dump(w, s.i.n, s.o.n);
 #endif
 }
 
@@ -774,92 +1029,106 @@ Weight forward_backward::estimate(Weight& unweighted_corpus_prob) {
 
 
 Weight forward_backward::estimate_matrix(Weight& unweighted_corpus_prob) {
-  assert(use_matrix && b);
-  unsigned i, o, s, nIn, nOut;
-  int* letIn, *letOut;
-
-  // for perplexity
-  Weight ret = 1;
-
-  IOPair io;
-
-  List<IOSymSeq>::erase_iterator seq = corpus().examples.erase_begin(),
-                                 lastExample = corpus().examples.erase_end();
-  //#ifdef DEBUGTRAIN
-  int train_example_no = 0;  // Yaser 7-13-2000
-//#endif
+  assert(use_matrix);
+  List<IOSymSeq>& ex = corpus().examples;
+  dynamic_array<IOSymSeq*> examples;
+  for (List<IOSymSeq>::val_iterator i = ex.val_begin(), e = ex.val_end(); i != e; ++i) examples.push_back(&*i);
 
 #ifdef DEBUG_ESTIMATE_PP
   Config::debug() << " Exampleprobs:";
 #endif
+  clear_workers();
+  estimate_matrix_range range(*this, examples);
+  run_workers(range, n_threads);
+  Weight ret = reduce_workers(unweighted_corpus_prob);  // for perplexity
+
+  // workers' no_derivation lists are each increasing, and so is their concatenation
+  unsigned train_example_no = 0;
+  List<IOSymSeq>::erase_iterator seq = ex.erase_begin(), lastExample = ex.erase_end();
+  for (unsigned t = 0; t < n_threads; ++t) {
+    dynamic_array<unsigned> const& bad = workers[t].no_derivation;
+    for (dynamic_array<unsigned>::const_iterator b = bad.begin(), e = bad.end(); b != e; ++b) {
+      for (; train_example_no < *b; ++train_example_no) ++seq;
+      assert(seq != lastExample);
+      warn_no_derivations(x, *seq, ++train_example_no);
+      if (remove_bad_training)
+        seq = ex.erase(seq);
+      else
+        ++seq;
+    }
+  }
+  return ret;  // ,trn->totalEmpiricalWeight); // return per-example perplexity = 2^entropy=p(corpus)^(-1/N)
+}
 
-  while (seq != lastExample) {  // loop over all training examples
-
-    //#ifdef DEBUGTRAIN // Yaser 13-7-2000 - Debugging messages ..
-    ++train_example_no;
-    training_progress(train_example_no, corpus().size());
-    //#endif
-    nIn = seq->i.n;
-    nOut = seq->o.n;
-    matrix_fb(*seq);
-    Weight fin = f[nIn][nOut][x.final];
+void forward_backward::estimate_matrix(estimate_worker& w, IOSymSeq const& seq, unsigned example_no) {
+  unsigned i, o;
+  unsigned nIn = seq.i.n, nOut = seq.o.n;
+  IOPair io;
+  {
+    std::lock_guard<std::mutex> lock(progress_mutex);
+    training_progress(++n_done, corpus().size());
+  }
+  matrix_fb(seq, w);
+  Weight fin = w.f.get(nIn, nOut, x.final);
 #ifdef DEBUG_ESTIMATE_PP
-    Config::debug() << ',' << fin;
+  Config::debug() << ',' << fin;
 #endif
 
-    ret *= fin.pow(seq->weight);  // since perplexity = 2^(- avg log likelihood)=2^((-1/n)*sum(log2 prob)) =
-    // (2^sum(log2 prob))^(-1/n) , we can take prod(prob)^(1/n) instead;
-    // prod(prob) = ret, of course.  raising ^N does the multiplication N times
-    // for an example that is weighted N
-    unweighted_corpus_prob *= fin;
-
+  w.weighted_corpus_prob *= fin.pow(seq.weight);  // since perplexity = 2^(- avg log likelihood)=2^((-1/n)*sum(log2 prob)) =
+  // (2^sum(log2 prob))^(-1/n) , we can take prod(prob)^(1/n) instead;
+  // prod(prob) = ret, of course.  raising ^N does the multiplication N times
+  // for an example that is weighted N
+  w.unweighted_corpus_prob *= fin;
 
-    if (!(fin.isPositive())) {
-      warn_no_derivations(x, *seq, train_example_no);
-      if (remove_bad_training) seq = corpus().examples.erase(seq);
-      continue;
-    }
-    check_fb_agree(fin, b[0][0][0]);
-
-    letIn = seq->i.let;
-    letOut = seq->o.let;
-
-    arcs.visit(for_arcs::clear_scratch());
-
-    // accumulate counts for each arc's contribution throughout all uses it has in explaining the training
-    for (i = 0; i <= nIn; ++i)  // go over all symbols in input in the training pair
-      for (o = 0; o <= nOut; ++o)  // go over all symbols in the output pair
-        for (s = 0; s < n_st; ++s) {
-          matrix_io_index::for_state const& fs = mio.forward[s];
-          if (i < nIn) {  // input is not epsilon
-            io.in = letIn[i];
-            if (o < nOut) {  // output is also not epsilon
-              io.out = letOut[o];
-              matrix_count(find_second(fs, io), s, i, o, 1, 1);
-            }
-            io.out = 0;  // output is epsilon, input is not
-            matrix_count(find_second(fs, io), s, i, o, 1, 0);
-          }
-          io.in = 0;  // input is epsilon
-          if (o < nOut) {  // input is epsilon, output is not
+  if (!(fin.isPositive())) {
+    w.no_derivation.push_back(example_no);
+    return;
+  }
+  check_fb_agree(fin, w.b.get(0, 0, 0));
+
+  int* letIn = seq.i.let;
+  int* letOut = seq.o.let;
+
+  for (Weight* c = w.scratch.begin(), *e = w.scratch.end(); c != e; ++c) c->setZero();
+
+  // accumulate counts for each arc's contribution throughout all uses it has in explaining the training
+  for (i = 0; i <= nIn; ++i)  // go over all symbols in input in the training pair
+    for (o = 0; o <= nOut; ++o) {  // go over all symbols in the output pair
+      sparse_lattice::cell_t const& fc = w.f(i, o);
+      if (fc.empty()) continue;
+      matrix_near(w, i, o, nIn, nOut, false);
+      for (sparse_lattice::cell_t::const_iterator fi = fc.begin(), fe = fc.end(); fi != fe; ++fi) {
+        unsigned s = fi->first;
+        Weight const& f = fi->second;
+        if (f.isZero()) continue;
+        matrix_io_index::for_state const& fs = mio.forward[s];
+        if (i < nIn) {  // input is not epsilon
+          io.in = letIn[i];
+          if (o < nOut) {  // output is also not epsilon
             io.out = letOut[o];
-            matrix_count(find_second(fs, io), s, i, o, 0, 1);
+            matrix_count(w, find_second(fs, io), f, 1, 1);
           }
-          io.out = 0;  // input and output are both epsilon
-          matrix_count(find_second(fs, io), s, i, o, 0, 0);
+          io.out = 0;  // output is epsilon, input is not
+          matrix_count(w, find_second(fs, io), f, 1, 0);
         }
+        io.in = 0;  // input is epsilon
+        if (o < nOut) {  // input is epsilon, output is not
+          io.out = letOut[o];
+          matrix_count(w, find_second(fs, io), f, 0, 1);
+        }
+        io.out = 0;  // input and output are both epsilon
+        matrix_count(w, find_second(fs, io), f, 0, 0);
+      }
+      matrix_near(w, i, o, nIn, nOut, true);
+    }
 
-    arcs.visit(for_arcs::add_weighted_scratch(seq->weight / fin));
-    //        Weight mult=seq->weight;
-    //        EACHDW(if (!dw->scratch.isZero()) dw->counts += mult*(dw->scratch / fin););
-
-    ++seq;
-  }  // end of while (training examples)
-
-  return ret;  // ,trn->totalEmpiricalWeight); // return per-example perplexity = 2^entropy=p(corpus)^(-1/N)
+  Weight scale = seq.weight / fin;
+  for (unsigned a = 0, N = w.scratch.size(); a != N; ++a)
+    if (!w.scratch[a].isZero()) w.counts[a] += scale * w.scratch[a];
 }
 
 void WFST::train_prune() {
+  thaw();
   /*
     int n_states=numStates();
     bool *dead_states=NEW bool[n_states]; // blah: won't really work unless we also delete stuff from trn, so
@@ -922,12 +1191,8 @@ Weight forward_backward::maximize(WFST::NormalizeMethods const& methods, FLOAT_T
     return 10;
 }
 
-Weight WFST::sumOfAllPaths(List<unsigned>& inSeq, List<unsigned>& outSeq) {
+Weight WFST::sumOfAllPaths(List<unsigned>& inSeq, List<unsigned>& outSeq, path_semiring semiring) {
   Assert(valid());
-  training_corpus corpus;
-  corpus.add(inSeq, outSeq);
-  corpus.finish_adding();
-  IOSymSeq const& s = corpus.examples.front();
   /*
     cascade_parameters trivial;
     train_opts topt;
@@ -936,12 +1201,26 @@ Weight WFST::sumOfAllPaths(List<unsigned>& inSeq, List<unsigned>& outSeq) {
     fb.matrix_compute(s,false);
     return fb.f[s.i.n][s.o.n][final];
   */
-  WFST& x = *this;
-  derivations d;
+  return path_sums(*this, semiring)(inSeq, outSeq);
+}
+
+struct WFST::path_sums::index {
   typedef arcs_table<arc_counts_base> arcs_t;
-  arcs_t arcs(x, false, 0);
-  wfst_io_index io(x);
-  return d.init_and_compute(x, io, arcs, s.i, s.o) ? d.prob(arcs) : Weight::ZERO();
+  arcs_t arcs;
+  wfst_io_index io;
+  explicit index(WFST& x) : arcs(x, false, 0), io(x) {}
+};
+
+WFST::path_sums::path_sums(WFST& x, path_semiring semiring) : x(x), semiring(semiring), p(new index(x)) {}
+
+WFST::path_sums::~path_sums() {
+  delete p;
+}
+
+Weight WFST::path_sums::operator()(List<unsigned> const& inSeq, List<unsigned> const& outSeq) const {
+  derivations d;
+  // prob only reads the arcs table
+  return d.init_and_compute(x, p->io, p->arcs, inSeq, outSeq) ? d.prob(p->arcs, semiring) : Weight::ZERO();
 }
 
 ostream& operator<<(ostream& out, struct State& s) {  // Yaser 7-20-2000
@@ -2,6 +2,7 @@
 #include <graehl/shared/config.h>
 #include <string>
 #include <map>
+#include <algorithm>
 #include <graehl/shared/myassert.h>
 #include <carmel/src/fst.h>
 #include <iterator>
@@ -11,6 +12,8 @@
 #include <graehl/shared/input_error.hpp>
 #include <graehl/shared/assoc_container.hpp>
 #include <graehl/shared/graphviz.hpp>
+#include <graehl/shared/memmap.hpp>
+#include <stdint.h>
 
 namespace graehl {
 
@@ -510,6 +513,232 @@ bool WFST::readLegible(const string& str, bool alwaysNamed) {
   return (readLegible(istr, alwaysNamed));
 }
 
+static bool is_regular_file(char const* filename) {
+  struct stat info;
+  return filename && !stat(filename, &info) && S_ISREG(info.st_mode);
+}
+
+bool WFST::read(istream& istr, bool alwaysNamed, char const* filename) {
+  thaw();
+  if (!isBinary(istr)) return readLegible(istr, alwaysNamed);
+  return is_regular_file(filename) ? readBinaryFilename(filename) : readBinary(istr);  // pipes can't be mmapped
+}
+
+/* binary format (--write-binary), in native byte order (checked on read).  all offsets are from the start of
+   the file, and all sections are 8-byte aligned:
+
+   wfst_binary_header
+   uint64 arc_begin[n_states+1]: arcs leaving state s are arcs[arc_begin[s]...arc_begin[s+1])
+   wfst_binary_arc arcs[n_arcs]
+   symbol tables (input, output unless it's the same alphabet, state names if named): uint64 begin[n+1] then
+   the '\0'-terminated names, begin[i] being the offset of name i from the first name
+*/
+namespace {
+char const wfst_binary_magic[8] = {(char)WFST::binary_magic_first, 'c', 'a', 'r', 'm', 'e', 'l', '\n'};
+uint32_t const wfst_binary_byte_order = 0x01020304;
+enum { wfst_binary_named_states = 1, wfst_binary_same_alphabet = 2 };
+
+struct wfst_binary_header {
+  char magic[8];
+  uint32_t version, byte_order;
+  uint32_t n_states, final;
+  uint32_t flags;
+  uint32_t n_symbols[2];
+  uint32_t n_state_names;
+  uint64_t n_arcs;
+  uint64_t arc_begin, arcs, symbols[2], state_names;  // section offsets
+  uint64_t size;  // whole file (detects truncation)
+};
+
+struct wfst_binary_arc {
+  uint32_t in, out, dest, group;
+  double ln_weight;
+};
+
+inline uint64_t align8(uint64_t n) {
+  return (n + 7) & ~(uint64_t)7;
+}
+
+template <class Alph>
+uint64_t symbols_bytes(Alph const& a) {
+  uint64_t n = 0;
+  for (unsigned i = 0, N = a.size(); i < N; ++i) n += strlen(a[i].c_str()) + 1;
+  return align8(8 * ((uint64_t)a.size() + 1) + n);
+}
+
+struct binary_writer {
+  ostream& o;
+  uint64_t pos;
+  explicit binary_writer(ostream& o) : o(o), pos() {}
+  void write(void const* p, std::size_t n) {
+    o.write((char const*)p, n);
+    pos += n;
+  }
+  void align() {
+    static char const zeros[8] = {0};
+    write(zeros, align8(pos) - pos);
+  }
+  template <class Alph>
+  void symbols(Alph const& a) {
+    uint64_t begin = 0;
+    for (unsigned i = 0, N = a.size(); i < N; ++i) {
+      write(&begin, 8);
+      begin += strlen(a[i].c_str()) + 1;
+    }
+    write(&begin, 8);
+    for (unsigned i = 0, N = a.size(); i < N; ++i) {
+      char const* name = a[i].c_str();
+      write(name, strlen(name) + 1);
+    }
+    align();
+  }
+};
+
+// returns false unless the n names at offset in [data,data+size) are well formed
+template <class Alph>
+bool read_symbols(Alph& a, char const* data, std::size_t size, uint64_t offset, uint32_t n) {
+  if (offset % 8 || offset > size || (size - offset) / 8 < (uint64_t)n + 1) return false;
+  uint64_t const* begin = (uint64_t const*)(data + offset);
+  char const* names = (char const*)(begin + n + 1);
+  uint64_t names_size = size - (names - data);
+  if (begin[0] || begin[n] > names_size) return false;
+  a.reserve(n);
+  for (uint32_t i = 0; i < n; ++i) {  // each name is nonempty, NUL terminated and within names[0, begin[n])
+    if (begin[i] >= begin[i + 1] || begin[i + 1] > begin[n] || names[begin[i + 1] - 1]) return false;
+    if (a.indexOf(names + begin[i]) != i) return false;  // duplicate, or *e* / *w* not first
+  }
+  return true;
+}
+}
+
+void WFST::writeBinary(ostream& os) const {
+  if (!valid()) return;
+  unsigned n_states = numStates();
+  bool same_alphabet = alph[kInput] == alph[kOutput];
+  wfst_binary_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, wfst_binary_magic, sizeof(h.magic));
+  h.version = binary_version;
+  h.byte_order = wfst_binary_byte_order;
+  h.n_states = n_states;
+  h.final = final;
+  h.flags = (named_states ? wfst_binary_named_states : 0) | (same_alphabet ? wfst_binary_same_alphabet : 0);
+  h.n_symbols[kInput] = alphabet(kInput).size();
+  h.n_symbols[kOutput] = alphabet(kOutput).size();
+  h.n_state_names = named_states ? stateNames.size() : 0;
+  for (unsigned s = 0; s < n_states; ++s) h.n_arcs += std::distance(states[s].arcs.const_begin(), states[s].arcs.const_end());
+  h.arc_begin = align8(sizeof(h));
+  h.arcs = h.arc_begin + 8 * ((uint64_t)n_states + 1);
+  h.symbols[kInput] = h.arcs + sizeof(wfst_binary_arc) * h.n_arcs;
+  h.symbols[kOutput] = same_alphabet ? h.symbols[kInput] : h.symbols[kInput] + symbols_bytes(alphabet(kInput));
+  h.state_names = h.symbols[kOutput] + (same_alphabet ? symbols_bytes(alphabet(kInput)) : symbols_bytes(alphabet(kOutput)));
+  h.size = h.state_names + (named_states ? symbols_bytes(stateNames) : 0);
+
+  binary_writer w(os);
+  w.write(&h, sizeof(h));
+  w.align();
+  uint64_t begin = 0;
+  for (unsigned s = 0; s < n_states; ++s) {
+    w.write(&begin, 8);
+    begin += std::distance(states[s].arcs.const_begin(), states[s].arcs.const_end());
+  }
+  w.write(&begin, 8);
+  for (unsigned s = 0; s < n_states; ++s)
+    for (List<FSTArc>::const_iterator a = states[s].arcs.const_begin(), end = states[s].arcs.const_end();
+         a != end; ++a) {
+      wfst_binary_arc b = {a->in, a->out, a->dest, a->groupId, (double)a->weight.getLn()};
+      w.write(&b, sizeof(b));
+    }
+  w.symbols(alphabet(kInput));
+  if (!same_alphabet) w.symbols(alphabet(kOutput));
+  if (named_states) w.symbols(stateNames);
+  assert(w.pos == h.size);
+}
+
+void WFST::writeBinaryFilename(std::string const& name) const {
+  std::ofstream of(name.c_str(), std::ios::binary);
+  writeBinary(of);
+}
+
+bool WFST::readBinaryFilename(std::string const& name) {
+  try {
+    mapped_file m(name, std::ios::in);
+    return readBinary(m.data(), m.size());
+  } catch (std::exception& e) {
+    Config::warn() << "Couldn't map binary transducer " << name << ": " << e.what() << "\n";
+    invalidate();
+    return false;
+  }
+}
+
+// read straight into 8-byte aligned storage (doubling it until istr runs out)
+bool WFST::readBinary(istream& istr) {
+  std::vector<uint64_t> aligned;
+  std::size_t size = 0;
+  do {
+    aligned.resize(std::max(aligned.size() * 2, (std::size_t)8192));
+    istr.read((char*)&aligned[0] + size, aligned.size() * 8 - size);
+    size += (std::size_t)istr.gcount();
+  } while (istr);
+  return readBinary((char const*)&aligned[0], size);
+}
+
+// no text is parsed: names are interned as whole strings and arcs are copied from the CSR arrays into the
+// states' lists (see frozen_arcs.h for why the lists aren't replaced), so every arc is still read and built
+bool WFST::readBinary(char const* data, std::size_t size) {
+  wfst_binary_header const& h = *(wfst_binary_header const*)data;
+  char const* why = "not a carmel binary transducer";
+  if (size < sizeof(h) || memcmp(h.magic, wfst_binary_magic, sizeof(h.magic))) goto INVALID;
+  why = "unsupported binary transducer version";
+  if (h.version != binary_version) goto INVALID;
+  why = "binary transducer has the wrong byte order for this machine";
+  if (h.byte_order != wfst_binary_byte_order) goto INVALID;
+  why = "binary transducer is truncated or corrupt";
+  if (h.size != size || !h.n_states || h.final >= h.n_states || h.arc_begin % 8
+      || h.arc_begin + 8 * ((uint64_t)h.n_states + 1) > h.arcs || h.arcs % 8
+      || h.arcs + sizeof(wfst_binary_arc) * h.n_arcs > size)
+    goto INVALID;
+  {
+    uint64_t const* arc_begin = (uint64_t const*)(data + h.arc_begin);
+    wfst_binary_arc const* arcs = (wfst_binary_arc const*)(data + h.arcs);
+    if (arc_begin[0] || arc_begin[h.n_states] != h.n_arcs) goto INVALID;
+
+    bool same_alphabet = h.flags & wfst_binary_same_alphabet;
+    clear();
+    initAlphabet(kInput);
+    if (same_alphabet) {
+      alph[kOutput] = alph[kInput];
+      owner_alph[kOutput] = 0;
+    } else
+      initAlphabet(kOutput);
+    if (!read_symbols(alphabet(kInput), data, size, h.symbols[kInput], h.n_symbols[kInput])) goto INVALID;
+    if (!same_alphabet && !read_symbols(alphabet(kOutput), data, size, h.symbols[kOutput], h.n_symbols[kOutput]))
+      goto INVALID;
+    named_states = h.flags & wfst_binary_named_states;
+    if (named_states
+        && (h.n_state_names != h.n_states || !read_symbols(stateNames, data, size, h.state_names, h.n_states)))
+      goto INVALID;
+
+    states.resize(h.n_states);
+    State::arc_adder arc_add(states);
+    for (uint32_t s = 0; s < h.n_states; ++s) {
+      if (arc_begin[s] > arc_begin[s + 1] || arc_begin[s + 1] > h.n_arcs) goto INVALID;
+      for (wfst_binary_arc const* a = arcs + arc_begin[s], *end = arcs + arc_begin[s + 1]; a != end; ++a) {
+        if (a->dest >= h.n_states || a->in >= h.n_symbols[kInput]
+            || a->out >= (same_alphabet ? h.n_symbols[kInput] : h.n_symbols[kOutput]))
+          goto INVALID;
+        arc_add(s, FSTArc(a->in, a->out, a->dest, Weight(a->ln_weight, ln_weight()), a->group));
+      }
+    }
+    final = h.final;
+    return true;
+  }
+INVALID:
+  Config::warn() << why << ".\n";
+  invalidate();
+  return false;
+}
+
 static ostream& writeQuoted(ostream& os, const char* s) {
   os << '"';
   for (; *s; ++s) {
@@ -649,6 +878,20 @@ void WFST::symbolList(List<unsigned>* ret, const char* buf, LabelType output, un
 #endif
   }
 }
+
+bool WFST::knownSymbolList(List<unsigned>* ret, const char* buf, LabelType output) const {
+  List<unsigned>::back_insert_iterator cursor(*ret);
+  istringstream line(buf);
+  char symbol[DEFAULTSTRBUFSIZE];
+  alphabet_type const& alph = alphabet(output);
+  while (line) {
+    if (!getString(line, symbol)) break;
+    unsigned const* pI = alph.find(symbol);
+    if (!pI) return false;
+    *cursor++ = *pI;
+  }
+  return true;
+}
 }
 
 #undef REQUIRE
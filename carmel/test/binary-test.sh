@@ -0,0 +1,35 @@
+#!/bin/bash
+# --write-binary round trips (from a file and from a pipe), and corrupt binary transducers are refused
+# usage: binary-test.sh [carmel]
+cd `dirname $0`
+B=${1:-../bin/linux/carmel}
+S=/tmp/carmel-binary-test.$$
+W=word.names.50000wds.transducer
+fail=0
+check() {
+  if cmp -s $1 $2; then echo "ok: $3"; else echo "FAILED: $3"; fail=1; fi
+}
+refused() {
+  if $B -n $1 > /dev/null 2> $S.err; then
+    echo "FAILED: $2 was read"; fail=1
+  elif grep -q "truncated or corrupt" $S.err; then
+    echo "ok: $2 refused"
+  else
+    echo "FAILED: $2 exited without saying it's corrupt"; fail=1
+  fi
+}
+$B -n $W > $S.want 2> /dev/null
+$B -n --write-binary $W > $S.bin 2> /dev/null
+$B -n $S.bin > $S.got 2> /dev/null
+check $S.want $S.got "binary from a file"
+cat $S.bin | $B -n /dev/stdin > $S.got 2> /dev/null
+check $S.want $S.got "binary from a pipe"
+size=`wc -c < $S.bin`
+head -c $((size - 1)) $S.bin > $S.short
+refused $S.short "truncated binary"
+# the input symbols' begin[1] (just after begin[0], at the offset in header bytes 64-71) past the names
+perl -e 'open F, "+<", $ARGV[0] or die; binmode F; seek F, 64, 0; read F, $o, 8; $o = unpack "Q", $o;
+  seek F, $o + 8, 0; print F pack "Q", 1 << 40; close F' $S.bin
+refused $S.bin "binary with a symbol offset out of range"
+rm -f $S.*
+exit $fail
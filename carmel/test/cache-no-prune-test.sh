@@ -0,0 +1,23 @@
+#!/bin/bash
+# --disk-cache-derivations --cache-no-prune trains as the pruned disk cache does, in each --disk-cache-format
+# usage: cache-no-prune-test.sh [carmel]
+cd `dirname $0`
+B=${1:-../bin/linux/carmel}
+S=/tmp/carmel-cache-no-prune-test.$$
+train="-q -R 3 -M 3 -t span.spell.corpus span.spell.wfst"
+fail=0
+check() {
+  if cmp -s $1 $2; then echo "ok: $3"; else echo "FAILED: $3"; fail=1; fi
+}
+for f in packed lz4 serialize; do
+  $B --disk-cache-derivations=$S.cache.XXXXXX --disk-cache-format=$f -F $S.want $train > /dev/null 2>&1
+  if $B --disk-cache-derivations=$S.cache.XXXXXX --disk-cache-format=$f --cache-no-prune -F $S.got $train \
+      > /dev/null 2>&1; then
+    check $S.want $S.got "--disk-cache-format=$f --cache-no-prune"
+  else
+    echo "FAILED: --disk-cache-format=$f --cache-no-prune exited $?"
+    fail=1
+  fi
+done
+rm -f $S.*
+exit $fail
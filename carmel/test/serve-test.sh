@@ -0,0 +1,41 @@
+#!/bin/bash
+# carmel --serve answers b, k and S requests (from two clients at once) as -b, -k and -S do, and refuses -a
+# usage: serve-test.sh [carmel]
+cd `dirname $0`
+B=${1:-../bin/linux/carmel}
+C=../carmel-client.pl
+S=/tmp/carmel-serve-test.$$
+casc="span.spell.wfst span.spell.wfst"
+lines=serve-test.lines
+head -c 2000 span.spell.corpus | sed -n 'n;p' | cut -d' ' -f1-12 | grep . > $lines
+$B -q --serve=$S -r -IE -k 3 $casc &
+sed 's/^/b /' $lines | $C $S > $S.b1 &
+sed 's/^/b 2 /' $lines | $C $S > $S.b2
+wait %2
+fail=0
+check() {
+  if cmp -s $1 $2; then echo "ok: $3"; else echo "FAILED: $3"; fail=1; fi
+}
+$B -q -rsIbE -k 3 $casc < $lines > $S.want
+check $S.want $S.b1 "b requests as -b -k 3"
+$B -q -rsIbE -k 2 $casc < $lines > $S.want
+check $S.want $S.b2 "b 2 requests as -b -k 2"
+$C $S 'k 4' > $S.k
+$B -q -IE -k 4 $casc > $S.want
+check $S.want $S.k "k 4 as -k 4"
+$C $S shutdown
+wait
+$B -q --serve=$S span.spell.wfst &
+paste -d'\t' <(sed -n 'p;n' span.spell.corpus) <(sed -n 'n;p' span.spell.corpus) | sed 's/^/S /' | $C $S > $S.S
+$B -q -S span.spell.corpus span.spell.wfst > $S.want
+check $S.want $S.S "S requests as -S"
+$C $S shutdown
+wait
+# -a builds State::Index in the shared cascade as it composes, so it can't serve concurrent requests
+if $B -q -a --serve=$S span.spell.wfst 2> $S.err; then
+  echo "FAILED: --serve with -a"; fail=1
+else
+  grep -q -- "-a composes" $S.err && echo "ok: --serve rejects -a" || { echo "FAILED: --serve -a message"; fail=1; }
+fi
+rm -f $S.* $lines
+exit $fail
@@ -1,7 +1,7 @@
 #ifndef GRAEHL_TT__FOREST_EM_PARAMS_HPP
 #define GRAEHL_TT__FOREST_EM_PARAMS_HPP
 
-#define FOREST_EM_VERSION "v20"
+#define FOREST_EM_VERSION "v24"
 
 #include <graehl/shared/em.hpp>
 #include <graehl/shared/myassert.h>
@@ -38,6 +38,7 @@ struct ForestEmParams {
   unsigned watch_rule;
   unsigned watch_depth;
   unsigned forest_tick_period;
+  unsigned threads;
   Weight prior_counts;
   bool help, human_probs, normalize_initial, initial_1_params, checkpoint_parameters, zero_zerocounts;
   std::string tempfile_prefix, byid_prob_field, byid_count_field;
@@ -79,6 +80,8 @@ struct ForestEmParams {
          "specify a 32-bit unsigned random seed for exact repeatability")
         ("use-double-precision,U", bool_switch(&double_precision),
          "use double-precision floats (8 bytes instead of 4) for params and counts")
+        ("threads", defaulted_value(&threads),
+         "collect counts for the forests of each batch on this many threads (the counts depend only on the number of threads; viterbi and per-forest outputs are still computed on one)")
         ;
     OD training("Training options (use '-' to specify STDIN)");
     training.add_options()
@@ -215,6 +218,7 @@ struct ForestEmParams {
     per_forest_counts_per = 0;
     log_file = graehl::stderr_arg();
     forest_tick_period = 10000;
+    threads = 1;
     byid_rule_file = istream_arg();
     byid_prob_field="emprob";
     byid_count_field="emcount";
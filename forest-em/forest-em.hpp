@@ -41,8 +41,10 @@
 #include <graehl/shared/memmap.hpp>
 #include <graehl/shared/swapbatch.hpp>
 #include <graehl/shared/gibbs.hpp>
+#include <graehl/shared/parallel_workers.hpp>
 
 #include <map>
+#include <vector>
 
 namespace graehl {
 
@@ -111,7 +113,7 @@ struct FForests : public gibbs_base {
   }
   void print_stats(std::ostream &out = std::cerr) const {
     BACKTRACE;
-    out << n_nodes << " forest nodes total (" << n_nodes*sizeof(ForestNode)<<" bytes), max #nodes " << max_nodes << ", average " << n_nodes * (1. / total_forests) << "\n";
+    out << n_nodes << " forest nodes total (" << n_nodes*(sizeof(ForestNode)+sizeof(unsigned))<<" bytes), max #nodes " << max_nodes << ", average " << n_nodes * (1. / total_forests) << "\n";
     forests.print_stats(out);
     out << "\n ";
     norm_groups.print_stats(out);
@@ -258,7 +260,7 @@ struct FForests : public gibbs_base {
       viterbi_enable(false),
       per_forest_counts_enable(false),
       logstream(_log),
-      forests(tempfile_prefix + ".forests.swap.", _n_nodes*sizeof(ForestNode), false),
+      forests(tempfile_prefix + ".forests.swap.", _n_nodes*(sizeof(ForestNode)+sizeof(unsigned)), false), // nodes + order
                                                             rule_names(_rule_names),
                                                             norm_groups(tempfile_prefix + ".normgroups.swap.", _max_norm*sizeof(NormIndex)),
                                                             max_norm_ruleid(0)
@@ -278,6 +280,7 @@ struct FForests : public gibbs_base {
   }
   ~FForests() {
     BACKTRACE;
+    free_workers();
   }
 
 
@@ -374,7 +377,13 @@ struct FForests : public gibbs_base {
     }
     restart = 0;
     iteration = 0;
-    counts_accum = Forest::prepare_accumulate(counts.begin(), &overflows);
+    count_sums.alloc(rulespace);
+    clear_sums(count_sums);
+    counts_accum = Forest::prepare_accumulate(count_sums.begin());
+    free_workers();
+    if (p.threads > 1)
+      for (unsigned i = 0; i < p.threads; ++i)
+        workers.push_back(new estimate_worker(max_nodes, rulespace));
   }
   void converge_em() {
     BACKTRACE;
@@ -442,14 +451,18 @@ struct FForests : public gibbs_base {
       }
     }
   };
+  auto_array<extended_sum> count_sums; // # params
   typename Forest::accumulate_counts counts_accum;
+  static void clear_sums(auto_array<extended_sum> &sums) {
+    for (size_t r = 0, n = sums.size(); r < n; ++r)
+      sums[r].clear();
+  }
   void begin_visit() {
     //        DBPC2("estimate",rule_weights);DBP_SCOPE;
     if (collect_counts) {
       count_t weighted_prior = prior_count*total_forests;
       enumerate(counts, value_setter(weighted_prior));
       total_logprob = 0;
-      counts_accum.reset_stats();
     }
     forest_no = 0;
     n_zeroprob = 0;
@@ -459,11 +472,10 @@ struct FForests : public gibbs_base {
   void end_visit() {
     delete forest_prep;
     if (collect_counts) {
-      counts_accum.finish_counts();
+      counts_accum.finish_counts(counts.begin(), counts.size());
       DBPC3("Done collecting counts:", forest_no, total_logprob/forest_no);
       DBP_ADD_VERBOSE(4);
       DBP(counts);
-      counts_accum.print(logstream);
     }
   }
 
@@ -505,8 +517,6 @@ struct FForests : public gibbs_base {
     logstream << "\n";
 
   }
-  typedef typename Forest::count_overflows count_overflows;
-  count_overflows overflows;
   //for estimate/estimate_visit:
   void operator()(Forest &f) {
     BACKTRACE;
@@ -573,10 +583,93 @@ struct FForests : public gibbs_base {
   void estimate_visit()
   {
     begin_visit();
-    forests.enumerate(boost::ref(*this));
+    if (parallel_visit()) {
+      parallel_estimate p;
+      p.self = this;
+      forests.enumerate_batches(boost::ref(p));
+      reduce_workers();
+    } else
+      forests.enumerate(boost::ref(*this));
     end_visit();
   }
 
+  // --threads: each worker has its own inside/outside scratch and count sums for its range of each batch's
+  // forests; reduce_workers adds them in worker order, so the counts depend only on the number of threads
+  struct estimate_worker {
+    auto_array<inside_t> inside, outside;
+    auto_array<extended_sum> sums;
+    typename Forest::accumulate_counts accum;
+    double total_logprob;
+    std::vector<unsigned> zeroprob; // forest_no of each, for the first_time warning
+    estimate_worker(size_t max_nodes, size_t rulespace) {
+      inside.alloc(max_nodes);
+      outside.alloc(max_nodes);
+      sums.alloc(rulespace);
+      clear_sums(sums);
+      accum = Forest::prepare_accumulate(sums.begin());
+    }
+  };
+  std::vector<estimate_worker *> workers;
+  void free_workers() {
+    for (unsigned i = 0; i < workers.size(); ++i)
+      delete workers[i];
+    workers.clear();
+  }
+  // per-forest outputs are written in forest order, so those visits stay serial
+  bool parallel_visit() const {
+    return workers.size() > 1 && collect_counts && !viterbi_go && !per_forest_counts_go && !per_forest_inside_go;
+  }
+  struct parallel_estimate {
+    Forests *self;
+    std::vector<Forest *> const* batch;
+    // a batch (valid only until the next is loaded):
+    void operator()(std::vector<Forest *> const& forests) {
+      batch = &forests;
+      std::vector<estimate_worker *> &workers = self->workers;
+      for (unsigned i = 0; i < workers.size(); ++i) {
+        workers[i]->total_logprob = 0;
+        workers[i]->zeroprob.clear();
+      }
+      run_workers(*this, workers.size());
+      for (unsigned i = 0; i < workers.size(); ++i) {
+        estimate_worker &w = *workers[i];
+        self->total_logprob += w.total_logprob;
+        for (unsigned j = 0; j < w.zeroprob.size(); ++j) {
+          if (self->first_time)
+            self->logstream << "Warning: 0 probability for forest #" << w.zeroprob[j] << std::endl;
+          ++self->n_zeroprob;
+        }
+      }
+      for (unsigned j = 0; j < forests.size(); ++j)
+        self->ticker();
+      self->forest_no += forests.size();
+    }
+    // worker i's range of the batch:
+    void operator()(std::size_t i) {
+      estimate_worker &w = *self->workers[i];
+      typename Forest::prepare_inside_outside prep(self->counts.begin(), self->rule_weights.begin(), w.inside.begin(), w.outside.begin(), 0);
+      worker_range_type r = worker_range(i, self->workers.size(), batch->size());
+      for (std::size_t j = r.first; j < r.second; ++j) {
+        Forest &f = *(*batch)[j];
+        inside_t sumptrees = f.compute_inside();
+        f.collect_counts(w.accum);
+        if (sumptrees.isZero())
+          w.zeroprob.push_back(self->forest_no + j + 1);
+        else
+          w.total_logprob += sumptrees.getLn();
+      }
+    }
+  };
+  void reduce_workers() {
+    for (unsigned i = 0; i < workers.size(); ++i) {
+      estimate_worker &w = *workers[i];
+      for (size_t r = 0, n = count_sums.size(); r < n; ++r) {
+        count_sums[r] += w.sums[r];
+        w.sums[r].clear();
+      }
+    }
+  }
+
   // renormalizes parameters; learning_rate may be ignored, but is intended to magnify the delta from the previous parameter set to the normalized new parameter set.  should return largest absolute change to any parameter.  should also save the un-magnified (raw normalized counts) version for undo_maximize (if you only use learning_rate==1, then you don't need to do anything but normalize)
   bool firsttime;
   void watch_report() {
@@ -731,6 +824,7 @@ struct FForests : public gibbs_base {
     define_gibbs(true);
     alphas.clear();
     finish_params();
+    if (gopt.cache_inside) init_cache();
   }
   void from_gibbs()
   {
@@ -750,16 +844,45 @@ struct FForests : public gibbs_base {
   void resample_block(unsigned block)
   {
     Forest &f = forests[block];
-    f.compute_inside(inside.begin(), *this);
-    if (gopt.expectation) {
+    if (gopt.expectation)
       unimplemented("--expectation in forest-em not yet implemented");
+    blockp=&sample[block].id;
+    if (gopt.cache_inside) {
+      size_t base = node_base[block];
+      f.update_inside(cached_inside.begin()+base, cached_prob.begin()+base, cached_cdf.begin()+base, proposal_probs(*this), cached_power[block] != power);
+      cached_power[block] = power;
+      f.choose_cached(cached_inside.begin()+base, cached_cdf.begin()+base, *this, power);
     } else {
-      blockp=&sample[block].id;
+      f.compute_inside(inside.begin(), *this);
       f.choose_random(inside.begin(), *this, power);
     }
-
+  }
+  // --cache-inside: per node of all forests (forest i's are from node_base[i]), kept between resamplings
+  auto_array<inside_t> cached_inside;
+  auto_array<double> cached_prob, cached_cdf;
+  auto_array<size_t> node_base;
+  auto_array<double> cached_power; // power forest i's cache was computed with; -1 if none yet
+  void init_cache()
+  {
+    cached_inside.alloc(n_nodes);
+    cached_prob.alloc(n_nodes);
+    cached_cdf.alloc(n_nodes);
+    node_base.alloc(total_forests);
+    cached_power.alloc(total_forests);
+    size_t base = 0;
+    for (unsigned i = 0; i<total_forests; ++i) {
+      node_base[i] = base;
+      base += forests[i].size();
+      cached_power[i] = -1;
+    }
   }
   Weight operator()(unsigned i) const { return proposal_prob(i); } // for compute_inside
+  struct proposal_probs // for update_inside
+  {
+    FForests const& f;
+    proposal_probs(FForests const& f) : f(f) {}
+    double operator()(unsigned i) const { return f.proposal_prob(i); }
+  };
   void record(unsigned rule) // for choose_random
   {
     blockp->push_back(rule);
@@ -3,6 +3,7 @@
 
 #include <fstream>
 #include <cstring>
+#include <vector>
 #include <graehl/shared/gibbs.hpp>
 #include <graehl/shared/random.hpp>
 #include <graehl/shared/os.hpp>
@@ -12,10 +13,15 @@
 #include <graehl/shared/genio.h>
 #include <graehl/shared/list.h>
 #include <graehl/shared/weight.h>
+#include <graehl/shared/log_sum_exp.hpp>
+#include <graehl/shared/extended_sum.hpp>
 #include <graehl/shared/threadlocal.hpp>
 #undef THREADLOCAL
 #define THREADLOCAL
 // disable THREADLOCAL since we have non-pod (should group them all via a single pointer)
+// the inside/outside scratch is C++11 thread_local instead (which allows non-pod), so each --threads worker
+// computes with its own buffers (set by its own prepare_inside_outside)
+#define FOREST_THREADLOCAL thread_local
 #include <graehl/shared/graphviz.hpp>
 #include <graehl/shared/funcs.hpp>
 #include <graehl/shared/stackalloc.hpp>
@@ -91,20 +97,29 @@ struct FForest {
   typedef logweight<Float> prob_t;
 
   ForestNode* nodes;
+  // the node indices in postorder (each node after its children, and so after anything its back-references
+  // point at), stored after the nodes by read(..., StackAlloc&): inside is then one sweep forward over it and
+  // outside one sweep back, without recursion or outside_order.  0 (e.g. for the GENIO_read forests) means
+  // use inside_rec
+  unsigned* order;
   typedef ForestNode* iterator;
   iterator begin() const { return nodes; }
   iterator& end() { return nodes->next; }
   iterator end() const { return nodes->next; }
+  // the inside of the children of the OR-nodes being computed (a stack, since the children are computed
+  // recursively), so each OR-node's sum is a single log_sum
+  static FOREST_THREADLOCAL std::vector<inside_t> or_terms;
+  static FOREST_THREADLOCAL std::vector<char> changed_nodes;  // update_inside scratch
   // made static so we can open swapbatch in read-only mode (just as well could be member var otherwise)
-  static THREADLOCAL inside_t *inside, *norm_outside;  // changed "outside" to "norm_outside" denoting that
+  static FOREST_THREADLOCAL inside_t *inside, *norm_outside;  // changed "outside" to "norm_outside" denoting that
   // the value is actually outside/inside[0] (so count +=
   // inside*norm_outside)
-  static THREADLOCAL count_t* counts;
-  static THREADLOCAL prob_t* rule_weights;
+  static FOREST_THREADLOCAL count_t* counts;
+  static FOREST_THREADLOCAL prob_t* rule_weights;
 
   static THREADLOCAL size_t max_ruleid;  // static global return value
   static THREADLOCAL std::ostream* viterbi_out;
-  static THREADLOCAL ForestNode** viterbi;
+  static FOREST_THREADLOCAL ForestNode** viterbi;
 
 
   /// you own this space:
@@ -324,11 +339,28 @@ struct FForest {
   void reset(ForestNode* _begin, ForestNode* _end) {
     nodes = _begin;
     end() = _end;
+    order = 0;
+  }
+  void reset(ForestNode* _begin) {
+    nodes = _begin;
+    order = 0;
+  }
+  FForest() : nodes(0), order(0) {}
+  FForest(const Forest& f) : nodes(f.nodes), order(f.order) {}
+  explicit FForest(ForestNode* _begin) : nodes(_begin), order(0) {}
+  // fills order_ (size() of them) from the nodes' next links
+  void compute_order(unsigned* order_) {
+    order = order_;
+    std::vector<unsigned> open;  // ancestors of node i still waiting for their last child
+    for (unsigned i = 0, n = size(); i != n; ++i) {
+      while (!open.empty() && next(open.back()) <= i) {
+        *order_++ = open.back();
+        open.pop_back();
+      }
+      open.push_back(i);
+    }
+    for (; !open.empty(); open.pop_back()) *order_++ = open.back();
   }
-  void reset(ForestNode* _begin) { nodes = _begin; }
-  FForest() : nodes(0) {}
-  FForest(const Forest& f) : nodes(f.nodes) {}
-  explicit FForest(ForestNode* _begin) : nodes(_begin) {}
   unsigned toi(ForestNode* p) const { return p - nodes; }
   // property maps (like Weight *)
   inside_t compute_inside(prob_t* _rule_weights, inside_t* _inside) {
@@ -336,7 +368,14 @@ struct FForest {
     SetLocal<inside_t*> guard2(inside, _inside);
     return compute_inside();
   }
+  struct rule_weight {
+    prob_t operator()(unsigned rule) const { return rule_weights[rule]; }
+  };
   inside_t compute_inside() {
+    if (order) {
+      inside_sweep(rule_weight());
+      return inside[0];
+    }
     outside_order.clear_nodestroy();
     DBPC4("Prepared to compute inside", toi(nodes), toi(end()), *this);
     DBP_ADD_VERBOSE(20);
@@ -356,59 +395,27 @@ struct FForest {
         , guardc(counts, _counts)
         , guardv(viterbi, _viterbi) {}
   };
-  typedef HashTable<unsigned, count_t> count_overflows;
+  // each rule's count is summed in an extended_sum (double precision at any size, and no underflow), rather
+  // than in count_t, which stops growing once it's near e^15 (float) or e^33 (double); finish_counts adds
+  // them to the counts (which hold the prior)
   struct accumulate_counts {
-    count_t total_overflow;
-    unsigned n_overflows;
-    unsigned n_rule_overflows;
-    std::ostream& print(std::ostream& os) {
-      if (n_overflows)
-        os << " (Overflowed: " << n_rule_overflows << " rules, " << n_overflows << " times, "
-           << total_overflow << " total counts"
-           << ")";
-      return os;
-    }
-    void reset_stats() {
-      n_overflows = n_rule_overflows = 0;
-      total_overflow.setZero();
-    }
-    count_t* counts;
-    count_overflows* overflows;
-    typedef typename count_overflows::iterator oit;
+    extended_sum* sums;
     inline void operator()(unsigned rule, inside_t inside, inside_t norm_outside) {
-      DBP_VERBOSE(2);
-      if (counts[rule].isNearAddOneLimit()) {
-        (*overflows)[rule] += counts[rule];  // default 0 init!
-        /*
-          std::pair <oit,bool> iret=overflows->insert(make_pair(rule,counts[rule]));
-          if (!iret.second)
-          iret.first->second += counts[rule];
-        */
-        ++n_overflows;
-        DBPC5("overflow #", n_overflows, rule, counts[rule], (*overflows)[rule]);
-
-        counts[rule] = inside * norm_outside;
-      } else {
-        counts[rule] += inside * norm_outside;
-      }
-    }
-    void visit(unsigned rule, count_t overflow_count) {
-      DBP_VERBOSE(1);
-      DBPC4("combine overflow", rule, counts[rule], overflow_count);
-      counts[rule] += overflow_count;
-      total_overflow += overflow_count;
-      ++n_rule_overflows;
+      sums[rule].add_ln((double)inside.getLn() + norm_outside.getLn());
     }
-    void finish_counts() {
-      // TODO: make process/delete generic?
-      overflows->visit_key_val(*this);
-      overflows->clear();
+    // counts[r] += sums[r] for r in [0,n), and clears the sums
+    void finish_counts(count_t* counts, std::size_t n) {
+      for (std::size_t r = 0; r < n; ++r)
+        if (!sums[r].is_zero()) {
+          sums[r].add_ln(counts[r].getLn());
+          counts[r].setLn((Float)sums[r].ln());
+          sums[r].clear();
+        }
     }
   };
-  static accumulate_counts prepare_accumulate(count_t* c, count_overflows* o) {
+  static accumulate_counts prepare_accumulate(extended_sum* s) {
     accumulate_counts a;
-    a.counts = c;
-    a.overflows = o;
+    a.sums = s;
     return a;
   }
   // caller should 0 (or by smoothing)-initialize counts then call this for each forest
@@ -454,7 +461,9 @@ struct FForest {
     // we compute norm_outside=(outside/inside[root]) directly instead of first
     // computing outsides.
     for (; oi < oe; ++oi) *oi = 0;
-    {
+    if (order) {
+      outside_sweep();
+    } else {
       DBP_INC_VERBOSE;
       for (Ancestry* i = outside_order.end(), * beg = outside_order.begin(); i > beg;) {
         --i;
@@ -489,6 +498,24 @@ struct FForest {
     DBPC2("final normalized outside(/ inside[0])", array<inside_t>(norm_outside, oe));
     return true;
   }
+  // parents before children (reverse order), adding to the same norm_outside as the outside_order loop above
+  void outside_sweep() {
+    for (unsigned* o = order + size(); o > order;) {
+      unsigned parenti = *--o;
+      ForestNode* p = nodes + parenti;
+      if (p->is_backref()) continue;  // its target gets the parent's share directly
+      ForestNode* e = p->next;
+      if (IS_OR_INT(p->l.integer())) {
+        for (ForestNode* c = p + 1; c < e; c = c->next)
+          norm_outside[toi(c->is_backref() ? c->l.pointer() : c)] += norm_outside[parenti];
+      } else if (!inside[parenti].isZero()) {  // otherwise you get 0/0 NaN
+        for (ForestNode* c = p + 1; c < e; c = c->next) {
+          unsigned childi = toi(c->is_backref() ? c->l.pointer() : c);
+          norm_outside[childi] += norm_outside[parenti] * inside[parenti] / inside[childi];
+        }
+      }
+    }
+  }
   struct Ancestry {
     ForestNode *parent, *child;
     Ancestry(ForestNode* p, ForestNode* c) : parent(p), child(c) {}
@@ -498,7 +525,7 @@ struct FForest {
   typedef dynamic_array<Ancestry> Ancestries;  // FIXME: could make this faster by preallocing maximum #
   // needed (definitely max = max # nodes (instead of useless
   // check: size < capacity)
-  static THREADLOCAL Ancestries outside_order;  // read backwards (reverse iterated), gives an order of adding
+  static FOREST_THREADLOCAL Ancestries outside_order;  // read backwards (reverse iterated), gives an order of adding
   // outside scores from parent to child ... topological sort on
   // ancestor relation (must know parent outside first)
   // also record leaves with c=NULL
@@ -510,7 +537,35 @@ struct FForest {
     SetLocal<ForestNode**> guard3(viterbi, _viterbi);
     compute_viterbi();
   }
-  void compute_viterbi() { viterbi_rec(nodes); }
+  void compute_viterbi() {
+    if (!order) {
+      viterbi_rec(nodes);
+      return;
+    }
+    for (unsigned *o = order, *oe = order + size(); o != oe; ++o) {
+      unsigned i = *o;
+      ForestNode* b = nodes + i;
+      ForestNode* e = b->next;
+      if (b->is_backref()) {
+        inside[i] = inside[toi(b->l.pointer())];
+        continue;
+      }
+      unsigned rule_or = b->l.integer();
+      ++b;
+      if (IS_OR_INT(rule_or)) {  // first best child wins ties, as in viterbi_rec
+        inside[i] = inside[i + 1];
+        viterbi[i] = b;
+        for (b = b->next; b < e; b = b->next)
+          if (inside[i] < inside[toi(b)]) {
+            inside[i] = inside[toi(b)];
+            viterbi[i] = b;
+          }
+      } else {
+        inside[i] = rule_weights[rule_or];
+        for (; b < e; b = b->next) inside[i] *= inside[toi(b)];
+      }
+    }
+  }
   void viterbi_rec(ForestNode* b) {
     ForestNode* e = b->next;
     DBPC4W("computing viterbi", toi(b), toi(e), FForest(b), b);
@@ -649,20 +704,17 @@ struct FForest {
       if (IS_OR_INT(rule_or)) {
         ++b;
         Assert(e != b);
-        ForestNode* n = b->next;
-        inside_rec(b);  // moved outside so instead of OR<-0, for children,
-        // OR+=inside[child], do OR=inside[first-child],
-        // OR+=inside[rest] - don't need to do this for AND
-        // OR INIT
-        inside[i] = inside[i + 1];
-        DBPC4("  OR=", i, inside[i], inside[i + 1]);
-        for (b = n; b < e; b = n) {  // 2nd and subsequent children
+        ForestNode* n;
+        std::size_t base = or_terms.size();
+        for (; b < e; b = n) {  // all children
           n = b->next;
           inside_rec(b);
-          // OR FOLD
-          inside[i] += inside[toi(b)];
-          DBPC5("  OR+=", i, inside[i], toi(b), inside[toi(b)]);
+          or_terms.push_back(inside[toi(b)]);
         }
+        // OR FOLD: the children's sum at once (see or_terms)
+        inside[i] = sum_all(&or_terms[base], or_terms.size() - base);
+        or_terms.resize(base);
+        DBPC3("  OR=", i, inside[i]);
       } else {  // and-node
         // AND INIT
         inside[i] = rule_weights[rule_or];
@@ -730,7 +782,7 @@ struct FForest {
     ForestNode* e = b->next;
     ForestNode::Label& l = b->l;
     if (l.is_pointer())
-      choose_random(l.pointer(), v);
+      choose_random(l.pointer(), v, power);
     else {
       unsigned rule_or = l.integer();
       if (IS_OR_INT(rule_or)) {
@@ -757,11 +809,119 @@ struct FForest {
     }
   }
 
+  /* --cache-inside: ins, prob and cdf are this forest's share of per-node arrays kept from its last
+     resampling.  prob[i] is the (real, not yet inside_t) w(rule) and-node i's inside was computed with; only
+     nodes whose prob changed, or with a child that was recomputed, are recomputed (all of them if fresh), so
+     ins is what compute_inside(ins, w) would give.  a recomputed OR-node's choice distribution is marked
+     stale (cdf of its first child < 0) for choose_cached to rebuild if it visits it.  needs order.  returns
+     the number of nodes recomputed */
+  template <class W>
+  unsigned update_inside(inside_t* ins, double* prob, double* cdf, W const& w, bool fresh) {
+    SetLocal<inside_t*> guard2(inside, ins);
+    unsigned n = size(), n_changed = 0;
+    changed_nodes.assign(n, 0);
+    char* changed = &changed_nodes[0];
+    for (unsigned *o = order, *oe = order + n; o != oe; ++o) {
+      unsigned i = *o;
+      ForestNode* b = nodes + i;
+      ForestNode* e = b->next;
+      if (b->is_backref()) {
+        unsigned shared = toi(b->l.pointer());
+        if ((changed[i] = changed[shared] || fresh)) inside[i] = inside[shared];
+        continue;
+      }
+      unsigned rule_or = b->l.integer();
+      bool is_or = IS_OR_INT(rule_or);
+      bool change = fresh;
+      if (!is_or) {
+        double p = w(rule_or);
+        if (!(p == prob[i])) {
+          prob[i] = p;
+          change = true;
+        }
+      }
+      ++b;
+      for (ForestNode* c = b; c < e && !change; c = c->next) change = changed[toi(c)];
+      if (!change) continue;
+      changed[i] = 1;
+      ++n_changed;
+      if (is_or) {
+        std::size_t base = or_terms.size();
+        for (ForestNode* c = b; c < e; c = c->next) or_terms.push_back(inside[toi(c)]);
+        inside[i] = sum_all(&or_terms[base], or_terms.size() - base);
+        or_terms.resize(base);
+        cdf[toi(b)] = -1;
+      } else {
+        inside[i] = inside_t(prob[i]);
+        for (; b < e; b = b->next) inside[i] *= inside[toi(b)];
+      }
+    }
+    return n_changed;
+  }
+
+  // like choose_random, from the ins left by update_inside, keeping each visited OR-node's cumulative
+  // normalized children's inside^power in cdf[child] until update_inside changes its inside
+  template <class V>
+  void choose_cached(inside_t* ins, double* cdf, V& v, Float power = 1) {
+    SetLocal<inside_t*> guard2(inside, ins);
+    choose_cached(nodes, cdf, v, power);
+  }
+  template <class V>
+  void choose_cached(ForestNode* b, double* cdf, V& v, Float power) {
+    ForestNode* e = b->next;
+    if (b->is_backref()) return choose_cached(b->l.pointer(), cdf, v, power);
+    unsigned rule_or = b->l.integer();
+    ++b;
+    if (IS_OR_INT(rule_or)) {
+      if (cdf[toi(b)] < 0) {
+        choose_norm.setZero();
+        for (ForestNode* c = b; c != e; c = c->next) choose_norm += inside[toi(c)].pow(power);
+        double sum = 0;
+        for (ForestNode* c = b; c != e; c = c->next)
+          cdf[toi(c)] = sum += (inside[toi(c)].pow(power) / choose_norm).getReal();
+      }
+      double choice = random01();
+      while (b->next != e && !(choice < cdf[toi(b)])) b = b->next;
+      choose_cached(b, cdf, v, power);
+    } else {
+      v.record(rule_or);
+      for (; b < e; b = b->next) choose_cached(b, cdf, v, power);
+    }
+  }
+
   // ins is ptr to array big enough for forest
   template <class W>
   void compute_inside(inside_t* ins, W const& w) {
     SetLocal<inside_t*> guard2(inside, ins);
-    compute_inside(nodes, w);
+    if (order)
+      inside_sweep(w);
+    else
+      compute_inside(nodes, w);
+  }
+
+  // w(ruleid)=Weight; the same sums and products as compute_inside(nodes, w), in order
+  template <class W>
+  void inside_sweep(W const& w) {
+    for (unsigned *o = order, *oe = order + size(); o != oe; ++o) {
+      unsigned i = *o;
+      ForestNode* b = nodes + i;
+      ForestNode* e = b->next;
+      if (b->is_backref()) {
+        inside[i] = inside[toi(b->l.pointer())];
+        continue;
+      }
+      unsigned rule_or = b->l.integer();
+      ++b;
+      if (IS_OR_INT(rule_or)) {
+        std::size_t base = or_terms.size();
+        for (; b < e; b = b->next) or_terms.push_back(inside[toi(b)]);
+        inside[i] = sum_all(&or_terms[base], or_terms.size() - base);
+        or_terms.resize(base);
+      } else {
+        inside[i] = w(rule_or);
+        for (; b < e; b = b->next) inside[i] *= inside[toi(b)];
+      }
+    }
   }
 
   // w(ruleid)=Weight
@@ -783,20 +943,17 @@ struct FForest {
       if (IS_OR_INT(rule_or)) {
         ++b;
         Assert(e != b);
-        ForestNode* n = b->next;
-        compute_inside(b, w);  // moved outside so instead of OR<-0, for children,
-        // OR+=inside[child], do OR=inside[first-child],
-        // OR+=inside[rest] - don't need to do this for AND
-        // OR INIT
-        inside[i] = inside[i + 1];
-        DBPC4("  OR=", i, inside[i], inside[i + 1]);
-        for (b = n; b < e; b = n) {  // 2nd and subsequent children
+        ForestNode* n;
+        std::size_t base = or_terms.size();
+        for (; b < e; b = n) {  // all children
           n = b->next;
           compute_inside(b, w);
-          // OR FOLD
-          inside[i] += inside[toi(b)];
-          DBPC5("  OR+=", i, inside[i], toi(b), inside[toi(b)]);
+          or_terms.push_back(inside[toi(b)]);
         }
+        // OR FOLD: the children's sum at once (see or_terms)
+        inside[i] = sum_all(&or_terms[base], or_terms.size() - base);
+        or_terms.resize(base);
+        DBPC3("  OR=", i, inside[i]);
       } else {  // and-node
         // AND INIT
         inside[i] = w(rule_or);  // proposal prob (used nowhere else)
@@ -1024,6 +1181,7 @@ void read(std::istream& in, FForest<Float>& f, StackAlloc& a)  // throw(genio_ex
 done:
   f.end() = ANEXT;  // FIXME: is this now redundant?
 #undef ANEXT
+  f.compute_order(a.aligned_alloc<unsigned>(f.size()));  // may Overflow, like the nodes
   DBPC2("Successfully read forest", f);
   suicide.cancel();
 
@@ -1085,24 +1243,28 @@ inline std::ostream& operator<<(std::ostream& o, const typename FForest<Float>::
 template <class Float>
 THREADLOCAL gibbs_base* FForest<Float>::gibbs;
 template <class Float>
-THREADLOCAL dynamic_array<typename FForest<Float>::Ancestry> FForest<Float>::outside_order;
+FOREST_THREADLOCAL dynamic_array<typename FForest<Float>::Ancestry> FForest<Float>::outside_order;
 template <class Float>
 THREADLOCAL size_t FForest<Float>::max_ruleid;  // static global return value;
 template <class Float>
-THREADLOCAL ForestNode**
+FOREST_THREADLOCAL ForestNode**
     FForest<Float>::viterbi;  // records which OR-node subforest is taken (values don't matter otherwise)
 template <class Float>
 THREADLOCAL std::ostream* FForest<Float>::viterbi_out;
 template <class Float>
 THREADLOCAL typename FForest<Float>::inside_t FForest<Float>::choose_norm;
 template <class Float>
-THREADLOCAL typename FForest<Float>::inside_t* FForest<Float>::inside;
+FOREST_THREADLOCAL typename FForest<Float>::inside_t* FForest<Float>::inside;
+template <class Float>
+FOREST_THREADLOCAL std::vector<typename FForest<Float>::inside_t> FForest<Float>::or_terms;
+template <class Float>
+FOREST_THREADLOCAL std::vector<char> FForest<Float>::changed_nodes;
 template <class Float>
-THREADLOCAL typename FForest<Float>::inside_t* FForest<Float>::norm_outside;
+FOREST_THREADLOCAL typename FForest<Float>::inside_t* FForest<Float>::norm_outside;
 template <class Float>
-THREADLOCAL typename FForest<Float>::prob_t* FForest<Float>::rule_weights;
+FOREST_THREADLOCAL typename FForest<Float>::prob_t* FForest<Float>::rule_weights;
 template <class Float>
-THREADLOCAL typename FForest<Float>::count_t* FForest<Float>::counts;
+FOREST_THREADLOCAL typename FForest<Float>::count_t* FForest<Float>::counts;
 
 #endif
 
@@ -0,0 +1,109 @@
+// Copyright 2014 Jonathan Graehl-http://graehl.org/
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+/** \file
+
+    alias_table: Walker's alias method (Vose's construction) for repeatedly sampling an index from a fixed
+    discrete distribution in O(1) per draw, after O(n) setup.
+
+    each of the n columns holds prob[i] of i and 1-prob[i] of alias[i]; one uniform picks the column and
+    another (or the fractional part of the first, scaled by n, if it has enough precision to spare) picks
+    between the two.
+*/
+
+#ifndef GRAEHL_SHARED__ALIAS_TABLE_HPP
+#define GRAEHL_SHARED__ALIAS_TABLE_HPP
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+namespace graehl {
+
+struct alias_table {
+  alias_table() {}
+  template <class It>
+  alias_table(It begin, It end) {
+    build(begin, end);
+  }
+
+  /// from the (unnormalized, nonnegative) weights [begin, end).  if they're all 0, uniform
+  template <class It>
+  void build(It begin, It end) {
+    prob.assign(begin, end);
+    std::size_t n = prob.size();
+    alias.resize(n);
+    if (!n) return;
+    double sum = 0;
+    for (std::size_t i = 0; i < n; ++i) sum += prob[i];
+    double scale = sum > 0 ? n / sum : 0;
+    std::vector<unsigned> small, large;
+    for (std::size_t i = 0; i < n; ++i) {
+      alias[i] = (unsigned)i;
+      if (scale > 0)
+        prob[i] *= scale;
+      else
+        prob[i] = 1;
+      (prob[i] < 1 ? small : large).push_back((unsigned)i);
+    }
+    while (!small.empty() && !large.empty()) {
+      unsigned s = small.back(), l = large.back();
+      small.pop_back();
+      alias[s] = l;
+      if ((prob[l] -= 1 - prob[s]) < 1) {
+        large.pop_back();
+        small.push_back(l);
+      }
+    }
+    // what's left is 1 up to rounding
+    for (std::size_t i = 0; i < small.size(); ++i) prob[small[i]] = 1;
+    for (std::size_t i = 0; i < large.size(); ++i) prob[large[i]] = 1;
+  }
+
+  std::size_t size() const { return prob.size(); }
+  bool empty() const { return prob.empty(); }
+
+  /// the index chosen by u, uniform on [0,1)
+  unsigned operator()(double u) const {
+    std::size_t n = prob.size();
+    double x = u * n;
+    std::size_t i = column(x);
+    return x - i < prob[i] ? (unsigned)i : alias[i];
+  }
+
+  /// the index chosen by independent uniforms on [0,1): u_column and u_coin
+  unsigned operator()(double u_column, double u_coin) const {
+    std::size_t i = column(u_column * prob.size());
+    return u_coin < prob[i] ? (unsigned)i : alias[i];
+  }
+
+  /// using rng() uniform on [0,1)
+  template <class Random>
+  unsigned choose(Random& rng) const {
+    double u = rng();
+    return (*this)(u, rng());
+  }
+
+ private:
+  std::size_t column(double x) const {
+    std::size_t i = (std::size_t)x;
+    return i < prob.size() ? i : prob.size() - 1;
+  }
+  std::vector<double> prob;
+  std::vector<unsigned> alias;
+};
+
+
+}
+
+#endif
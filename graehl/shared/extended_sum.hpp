@@ -0,0 +1,83 @@
+// Copyright 2014 Jonathan Graehl-http://graehl.org/
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+/** \file
+
+    extended_sum: a sum of nonnegative terms given by their natural logs (as logweight stores them; -inf is
+    0), kept as a double mantissa m times 2^e with a separate (double, integer valued) exponent e.
+
+    adding a term is an exp2 and an add in the usual case, without the log1p of logweight +=, and the sum
+    has double precision whatever its size: it doesn't stop growing (a logweight<float> sum can't add 1 to
+    anything over about e^15, or logweight<double> over e^33) and terms far below 1 (e^-100000) don't
+    underflow as they would in a plain double.  m stays >= 1 once nonzero, so terms 2^-1074 below it (lost
+    to rounding anyway) simply add nothing; a term more than 2^max_gap above it moves e up.
+*/
+
+#ifndef GRAEHL_SHARED__EXTENDED_SUM_HPP
+#define GRAEHL_SHARED__EXTENDED_SUM_HPP
+#pragma once
+
+#include <cmath>
+
+namespace graehl {
+
+struct extended_sum {
+  double m, e;  // the sum is m * 2^e; m is 0 or >= 1
+
+  extended_sum() : m(0), e(0) {}
+  void clear() { m = e = 0; }
+  bool is_zero() const { return m == 0; }
+
+  static double log2e() { return 1.4426950408889634074; }
+  static double ln2() { return 0.69314718055994530942; }
+  static double max_gap() { return 512; }
+
+  /// m * 2^d without overflowing ldexp's int (d is integer valued)
+  static double shifted(double m, double d) { return d < -1100 ? 0 : std::ldexp(m, (int)d); }
+
+  /// += e^ln
+  void add_ln(double ln) {
+    double x = ln * log2e() - e;  // the term is 2^x * 2^e
+    if (m != 0 && x <= max_gap())
+      m += std::exp2(x);
+    else if (x > -HUGE_VAL)
+      rebase(x);
+  }
+
+  void operator+=(extended_sum const& o) {
+    if (o.m == 0) return;
+    if (m == 0)
+      *this = o;
+    else if (o.e > e) {
+      m = shifted(m, e - o.e) + o.m;
+      e = o.e;
+    } else
+      m += shifted(o.m, o.e - e);
+  }
+
+  /// ln of the sum (-inf for 0)
+  double ln() const { return m == 0 ? -HUGE_VAL : std::log(m) + e * ln2(); }
+
+ private:
+  // a term 2^x * 2^e that's the first, or more than 2^max_gap above m: e moves up to it
+  void rebase(double x) {
+    double shift = std::floor(x);
+    m = shifted(m, -shift) + std::exp2(x - shift);
+    e += shift;
+  }
+};
+
+
+}
+
+#endif
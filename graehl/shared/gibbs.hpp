@@ -30,6 +30,7 @@
    init_run(r): for r=[0,gopt.restarts]
    init_iteration(i)
    resample_block(blocki): for blocki=[0,n_pairs): choose new random sample[blocki] using p^power (this->power, don't forget to use it :)
+   resample_block_local(blocki,into,local): (only for --gibbs-threads, a carmel option) like resample_block, but put the sample in into, use local.proposal_prob(id) and local.rng, and be safe to call concurrently for different blocks
    print_sample(sample):
    print_param(out,parami): like out<<gps[i] but customized
 
@@ -87,7 +88,11 @@
 #include <graehl/shared/print_width.hpp>
 #include <graehl/shared/unimplemented.hpp>
 #include <graehl/shared/debugprint.hpp>
+#include <graehl/shared/random.hpp>
+#include <graehl/shared/parallel_workers.hpp>
 #include <boost/math/distributions/normal.hpp>
+#include <algorithm>
+#include <cmath>
 
 //#define DEBUG_GIBBS
 
@@ -292,23 +297,35 @@ struct gibbs_base
     ids_t id;
     wts_t wt;
 
+    /* addc's view of an unweighted block of at least compact_min ids: its params sorted and deduplicated,
+       with how many times each occurs (or the sum of its wt, for compress).  built by compact() on first use
+       after clear(); id and wt must not change after that.  shorter blocks (a few distinct params each,
+       usually) aren't worth sorting, and summing a weighted block's wt first would change the rounding */
+    ids_t uid;
+    wts_t ucount;
+    enum { compact_min = 256 };
+
     // only used for --expectation (online-em)
     void randomize()
     {
       force_weights();
       for (wts_t::iterator i = wt.begin(), e = wt.end(); i!=e; ++i)
         *i *= random01();
+      uncompact();
     }
 
     void clear()
     {
       id.clear();
       wt.clear();
+      uncompact();
     }
     void swap(block_delta &o)
     {
       id.swap(o.id);
       wt.swap(o.wt);
+      uid.swap(o.uid);
+      ucount.swap(o.ucount);
     }
 
     unsigned size() const { return id.size(); }
@@ -336,11 +353,52 @@ struct gibbs_base
       id.push_back(i);
       wt.push_back(w);
     }
+
+    bool compacted() const { return !uid.empty() || id.empty(); }
+    bool worth_compacting() const { return size()>=compact_min && wt.empty(); }
+    /* tally, if given, is all 0 for every id (and left that way), so an unweighted block is counted in one
+       pass and only its distinct ids are sorted */
+    void compact(wt_t *tally = 0)
+    {
+      if (compacted()) return;
+      if (have_weights()) {
+        pairs_t p;
+        to_pairs(p);
+        std::sort(p.begin(), p.end(), order_first());
+        combine_from_pairs(p, uid, ucount);
+      } else if (tally) {
+        for (ids_t::const_iterator i = id.begin(), e = id.end(); i!=e; ++i)
+          if (tally[*i]++ == 0) uid.push_back(*i);
+        std::sort(uid.begin(), uid.end());
+        ucount.reserve(uid.size());
+        for (ids_t::const_iterator i = uid.begin(), e = uid.end(); i!=e; ++i) {
+          ucount.push_back(tally[*i]);
+          tally[*i] = 0;
+        }
+      } else {
+        uid.append_ra(id.begin(), id.end());
+        std::sort(uid.begin(), uid.end());
+        count_runs(uid, ucount);
+      }
+    }
+    void uncompact()
+    {
+      uid.clear();
+      ucount.clear();
+    }
+    // replace id (and wt) by the compacted block (losing the order of id)
+    void compress()
+    {
+      compact();
+      id.swap(uid);
+      wt.swap(ucount);
+      uncompact();
+    }
+
    private:
-    //TODO: test all below before using
     typedef std::pair<id_t, wt_t> pair_t;
     typedef dynamic_array<pair_t > pairs_t;
-    void to_pairs(pairs_t &c)
+    void to_pairs(pairs_t &c) const
     {
       assert(have_weights());
       unsigned i = 0, N = id.size();
@@ -349,9 +407,10 @@ struct gibbs_base
         c.push_back(pair_t(id[i], wt[i]));
     }
     // consecutive (id,wt) (id,wt2) -> id,(wt+wt2)
-    void combine_from_pairs(pairs_t const& c)
+    static void combine_from_pairs(pairs_t const& c, ids_t &id, wts_t &wt)
     {
-      clear();
+      id.clear();
+      wt.clear();
       unsigned N = c.size();
       if (N==0) return;
       id_t last = c[0].first;
@@ -371,23 +430,24 @@ struct gibbs_base
       id.push_back(last);
       wt.push_back(sum);
     }
+    // sorted id with repeats -> id unique, n[i] = # of repeats of id[i]
+    static void count_runs(ids_t &id, wts_t &n)
+    {
+      n.clear();
+      ids_t::iterator o = id.begin();
+      for (ids_t::const_iterator i = id.begin(), e = id.end(); i!=e;) {
+        ids_t::const_iterator j = i;
+        while (++j!=e && *j==*i) ;
+        *o++ = *i;
+        n.push_back((wt_t)(j-i));
+        i = j;
+      }
+      id.resize(o-id.begin());
+    }
     struct order_first
     {
       bool operator()(pair_t const& a, pair_t const& b) const { return a.first<b.first; }
     };
-
-    //TODO: test
-    void compress()
-    {
-      if (have_weights()) {
-        pairs_t p;
-        to_pairs(p);
-        std::sort(p.begin(), p.end(), order_first());
-        combine_from_pairs(p);
-      }
-    }
-
-
   };
 
   typedef fixed_array<block_delta> blocks_t;
@@ -397,6 +457,7 @@ struct gibbs_base
   gps_t gps;
   unsigned nnorm;
   normsum_t normsum;
+  fixed_array<double> tally; // 0 for every param except during block_delta::compact
   blocks_t sample;
   double temperature;
   double power; // for deterministic annealing (temperature) = 1/temperature if temp positive.
@@ -620,6 +681,7 @@ struct gibbs_base
     normsum.reinit_nodestroy(nnorm);
     for (gps_t::iterator i = gps.begin(), e = gps.end(); i!=e; ++i)
       i->restore_p0(normsum);
+    tally.reinit(gps.size(), 0);
   }
 
   // finalize avged counts over burned in iters; now proposal_prob = avged over all samples
@@ -781,14 +843,39 @@ struct gibbs_base
     for (block_t::const_iterator i = b.begin(), e = b.end(); i!=e; ++i)
       addc(*i, scale);
   }
+  // a long block's params once each, with their multiplicity (bd.compact()), and each run of params sharing
+  // a normgroup adds its total to normsum once
   void addc(block_delta &bd, double scale)
   {
-    block_t & b = bd.id;
-    if (gopt.expectation)
-      for (unsigned i = 0, N = b.size(); i<N; ++i)
-        addc(b[i], bd.wt[i]*scale);
-    else
-      addc(b, scale);
+    assert(time>=0);
+    if (!bd.worth_compacting()) {
+      block_t & b = bd.id;
+      if (gopt.expectation)
+        for (unsigned i = 0, N = b.size(); i<N; ++i)
+          addc(b[i], bd.wt[i]*scale);
+      else
+        addc(b, scale);
+      return;
+    }
+    bd.compact(tally.begin());
+    block_t const& b = bd.uid;
+    block_delta::wts_t const& n = bd.ucount;
+    unsigned norm = gibbs_param::NONORM;
+    double normd = 0;
+    for (unsigned i = 0, N = b.size(); i<N; ++i) {
+      gibbs_param &p = gps[b[i]];
+      if (!p.has_norm()) continue;
+      assert(time>=p.sumcount.tmax);
+      double d = n[i]*scale;
+      p.sumcount.add_delta(d, time);
+      if (p.norm!=norm) {
+        if (norm!=gibbs_param::NONORM) normsum[norm] += normd;
+        norm = p.norm;
+        normd = 0;
+      }
+      normd += d;
+    }
+    if (norm!=gibbs_param::NONORM) normsum[norm] += normd;
   }
 
   void clear_blocks()
@@ -797,12 +884,73 @@ struct gibbs_base
       sample[i].clear();
   }
 
+  /// --gibbs-threads: a worker's private copy of the counts, taken at the start of each iteration and
+  /// afterwards updated only by the worker's own blocks
+  struct local_counts
+  {
+    gps_t const* gps;
+    fixed_array<double> count, tally;
+    normsum_t normsum;
+    graehl::random rng;
+    local_counts() : gps() {}
+    void snapshot(gibbs_base const& g, random_seed_type seed)
+    {
+      gps = &g.gps;
+      unsigned N = g.gps.size();
+      count.reinit_nodestroy(N);
+      for (unsigned i = 0; i<N; ++i)
+        count[i] = g.gps[i].count();
+      tally.reinit_nodestroy(N, 0);
+      normsum.reinit_nodestroy(g.normsum.size());
+      std::copy(g.normsum.begin(), g.normsum.end(), normsum.begin());
+      rng.set_random_seed(seed);
+    }
+    double proposal_prob(unsigned paramid) const
+    {
+      gibbs_param const& p = (*gps)[paramid];
+      return p.has_norm() ? count[paramid]/normsum[p.norm] : p.prior;
+    }
+    Weight proposal_prob(block_t const& b) const
+    {
+      Weight prob = 1;
+      for (block_t::const_iterator i = b.begin(), e = b.end(); i!=e; ++i)
+        prob *= proposal_prob(*i);
+      return prob;
+    }
+    void addc(unsigned paramid, double d)
+    {
+      gibbs_param const& p = (*gps)[paramid];
+      if (p.has_norm()) {
+        count[paramid] += d;
+        normsum[p.norm] += d;
+      }
+    }
+    void addc(block_delta &bd, double scale)
+    {
+      bool compact = bd.worth_compacting();
+      if (compact) bd.compact(tally.begin());
+      block_t const& b = compact ? bd.uid : bd.id;
+      bool weighted = compact || !bd.wt.empty();
+      block_delta::wts_t const& n = compact ? bd.ucount : bd.wt;
+      for (unsigned i = 0, N = b.size(); i<N; ++i)
+        addc(b[i], weighted ? n[i]*scale : scale);
+    }
+  };
+
+  // --gibbs-threads is only offered (gibbs_opts carmel_opts) to impls that override this
+  void resample_block_local(unsigned block, block_delta &into, local_counts &local)
+  {
+    unimplemented("--gibbs-threads (parallel resampling of blocks)");
+  }
+
  private:
   //actual impl:
   template <class G>
   gibbs_stats run(unsigned runi, G &imp)
   {
     stats.clear(n_sym, n_blocks);
+    sum_drift = 0;
+    n_drift_iter = 0;
     Ni = gopt.iter;
     restore_p0(); // sets counts to prior, and normsums so prob is right
     imp.init_run(runi);
@@ -821,6 +969,10 @@ struct gibbs_base
       iteration(imp, false);
     }
     log<<"\nGibbs stats: "<<stats<<"\n";
+    if (n_drift_iter)
+      log<<"--gibbs-threads="<<gopt.threads<<" drift from sequential sampling: avg "<<sum_drift/n_drift_iter
+         <<" bits/block (|log2 proposal prob of each new sample under its worker's counts - under the sequential counts|) over "
+         <<n_drift_iter<<" iterations\n";
     if (gopt.prior_inference_show)
       log<<"Final prior-scale="<<prior_scale.cumulative<<"\n";
 
@@ -839,8 +991,24 @@ struct gibbs_base
     power = (temperature>0)?1./temperature:1;
     itername(log);
     if (use_cache_prob) reset_cache();
-    Weight p = 1;
     imp.init_iteration(iter);
+    if (gopt.threads>1 && n_blocks>1)
+      iteration_threads(imp, randomize);
+    else
+      iteration_sequential(imp, randomize);
+    if (iter>0 && inferring())
+      propose_new_priors();
+    record_iteration(iter_prob);
+    maybe_print_periodic(imp);
+  }
+
+  Weight iter_prob;
+
+  template <class G>
+  void iteration_sequential(G &imp, bool randomize)
+  {
+    Weight &p = iter_prob;
+    p = 1;
     for (unsigned b = 0; b<n_blocks; ++b) {
       if (gopt.tick_every)
         num_progress(log, b+1, gopt.tick_every, 70,".",""); //FIXME: use proportional progress so total #blocks = 2 lines of status or so
@@ -870,11 +1038,98 @@ struct gibbs_base
         addc(include_self_save, -wt);
       addc(block, wt); //todo: can efficiently compute cache prob as we do this
     }
-    if (iter>0 && inferring())
-      propose_new_priors();
-    record_iteration(p);
-    maybe_print_periodic(imp);
   }
+
+  fixed_array<local_counts> locals;
+  blocks_t next_sample; // resampled blocks, before merging into sample
+
+  template <class G>
+  struct resample_range
+  {
+    gibbs_base &g;
+    G &imp;
+    unsigned n_threads;
+    resample_range(gibbs_base &g, G &imp, unsigned n_threads) : g(g), imp(imp), n_threads(n_threads) {}
+    void operator()(std::size_t t) const
+    {
+      local_counts &local = g.locals[t];
+      worker_range_type r = worker_range(t, n_threads, g.n_blocks);
+      for (unsigned b = (unsigned)r.first; b!=r.second; ++b) {
+        block_delta &old = g.sample[b], &bd = g.next_sample[b];
+        double wt = imp.block_weight(b);
+        if (!g.gopt.include_self)
+          local.addc(old, -wt);
+        bd.clear();
+        imp.resample_block_local(b, bd, local);
+        if (!g.gopt.expectation)
+          bd.prob = local.proposal_prob(bd.id); // what this worker saw; compared to the sequential view on merge
+        if (g.gopt.include_self)
+          local.addc(old, -wt);
+        local.addc(bd, wt);
+      }
+    }
+  };
+
+  // AD-LDA: workers resample contiguous ranges of blocks against snapshots of the counts; then the new samples
+  // replace the old in block order, exactly as the sequential sampler would have added them.  drift: mean
+  // |log2 p_worker(sample) - log2 p_sequential(sample)| per block, where p is the proposal (HMM) prob of the
+  // new sample given the counts each would have used
+  template <class G>
+  void iteration_threads(G &imp, bool randomize)
+  {
+    unsigned n_threads = std::min(gopt.threads, n_blocks);
+    locals.reinit(n_threads);
+    for (unsigned t = 0; t<n_threads; ++t)
+      locals[t].snapshot(*this, (random_seed_type)(random01()*4294967296.));
+    next_sample.reinit(n_blocks);
+    resample_range<G> run(*this, imp, n_threads);
+    run_workers(run, n_threads);
+    Weight &p = iter_prob;
+    p = 1;
+    double drift = 0;
+    unsigned n_drift = 0;
+    for (unsigned b = 0; b<n_blocks; ++b) {
+      if (gopt.tick_every)
+        num_progress(log, b+1, gopt.tick_every, 70,".","");
+      else
+        num_progress_scale(log, b+1, n_blocks, 70, 2,".","\n ");
+      block_delta &block = sample[b];
+      double wt = imp.block_weight(b);
+      if (!gopt.include_self)
+        addc(block, -wt);
+      block_delta include_self_save;
+      include_self_save.swap(block);
+      block.swap(next_sample[b]);
+      block.prob = next_sample[b].prob;
+      if (gopt.expectation) {
+        if (randomize) {
+          block.randomize();
+          block.prob = 0;
+        }
+      } else {
+        Weight pw = block.prob, ps = proposal_prob(block.id);
+        if (!pw.isZero() && !ps.isZero()) {
+          drift += std::fabs(pw.getLn()-ps.getLn());
+          ++n_drift;
+        }
+        block.prob = prob(block.id);
+      }
+      p *= block.prob;
+      if (gopt.include_self)
+        addc(include_self_save, -wt);
+      addc(block, wt);
+    }
+    next_sample.clear();
+    if (n_drift) {
+      drift /= n_drift*std::log(2.);
+      log<<" drift-from-sequential="<<drift<<" bits/block";
+      sum_drift += drift;
+      ++n_drift_iter;
+    }
+  }
+  double sum_drift;
+  unsigned n_drift_iter;
+
   unsigned beststart;
  public:
   template <class G>
@@ -94,6 +94,8 @@ struct gibbs_opts
            "prior applied to initial param values: alpha*p0*N (where N is # of items in normgroup, so uniform has p0*N=1)")
           ("n-symbols", defaulted_value(&n_sym),
            "N for per-point perplexity (total number of symbols the derivations explain).  there's no way to deduce this automatically since a single rule may produce multiple symbols")
+          ("cache-inside", defaulted_value(&cache_inside)->zero_tokens(),
+           "keep each forest's inside scores and OR-node choice distributions from its last resampling, and recompute only the nodes above rules whose proposal prob has changed since; the same samples as without, for 20 (-U: 24) more bytes per forest node")
 #ifdef FOREST_EM_VERSION
           ("alpha", defaulted_value(&alpha_file),
            "per-parameter alpha file parallel to -I (overrides const-alpha); negative alpha means locked (use init prob but don't update/normalize)")
@@ -124,6 +126,8 @@ struct gibbs_opts
            "Print arc counts in normgroup (consecutive gibbs param id) order rather than WFST file order")
           ("expectation", defaulted_value(&expectation)->zero_tokens(),
            "use full forward/backward fractional counts instead of a single count=1 random sample")
+          ("gibbs-threads", defaulted_value(&threads),
+           "(if >1) approximate distributed sampling: each thread resamples a contiguous share of the blocks against its own copy of the counts from the start of the iteration; the samples are merged in block order after every iteration.  the drift from exact sequential sampling is reported each iteration")
           ("random-start", defaulted_value(&random_start)->zero_tokens(),
            "for expectation, scale the initial per-example counts by random [0,1).  without this, every run would have the same outcome.  this is implicitly enabled for restarts, of course.")
           ;
@@ -165,6 +169,7 @@ struct gibbs_opts
   //carmel only:
   bool expectation; // instead of sampling, ask the gibbs impl. to compute full forward/backward fractional counts
   bool random_start;
+  unsigned threads; // >1: resample blocks in parallel against per-iteration snapshots of the counts (AD-LDA)
 
   unsigned init_em;
   bool em_p0;
@@ -176,6 +181,7 @@ struct gibbs_opts
   //forest-em only:
   double alpha; //TODO: per-normgroup (or per-param) alphas
   unsigned n_sym;
+  bool cache_inside;
 
 #ifdef FOREST_EM_VERSION
   ostream_arg sample_file, print_file;
@@ -221,6 +227,7 @@ struct gibbs_opts
     prior_inference_restart_fresh = false;
     prior_inference_stddev = 0;
     n_sym = 0;
+    cache_inside = false;
 #ifdef FOREST_EM_VERSION
     sample_file = ostream_arg();
     print_file = stdout_arg();
@@ -228,6 +235,7 @@ struct gibbs_opts
     rich_counts = false;
     alpha = .1;
     tick_every = 0;
+    threads = 1;
     width = 7;
     iter = 0;
     burnin = 0;
@@ -253,6 +261,7 @@ struct gibbs_opts
   void validate()
   {
     if (width<4) width = 20;
+    if (threads<1) threads = 1;
     if (no_prob) {
       cache_prob = cheap_prob = false;
     }
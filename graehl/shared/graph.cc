@@ -25,8 +25,8 @@ std::ostream& operator<<(std::ostream& out, const GraphArc& a) {
   return out << ')';
 }
 
-void (*dfsFunc)(unsigned, unsigned) = NULL;
-void (*dfsExitFunc)(unsigned, unsigned) = NULL;
+THREADLOCAL void (*dfsFunc)(unsigned, unsigned) = NULL;
+THREADLOCAL void (*dfsExitFunc)(unsigned, unsigned) = NULL;
 
 void depthFirstSearch(Graph graph, unsigned startState, bool* visited,
                       void (*func)(unsigned state, unsigned pred)) {
@@ -71,8 +71,8 @@ Graph reverseGraph(Graph g, bool data_point_to_forward)
   return ret;
 }
 
-Graph dfsGraph;
-bool* dfsVis;
+THREADLOCAL Graph dfsGraph;
+THREADLOCAL bool* dfsVis;
 
 
 void dfsRec(unsigned state, unsigned pred) {
@@ -90,8 +90,8 @@ void dfsRec(unsigned state, unsigned pred) {
 }
 
 
-FLOAT_TYPE* DistToState::weights = NULL;
-DistToState** DistToState::stateLocations = NULL;
+THREADLOCAL FLOAT_TYPE* DistToState::weights = NULL;
+THREADLOCAL DistToState** DistToState::stateLocations = NULL;
 FLOAT_TYPE DistToState::unreachable = HUGE_VAL;
 
 inline bool operator<(DistToState lhs, DistToState rhs) {
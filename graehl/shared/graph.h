@@ -19,14 +19,17 @@
 
 #include <iostream>
 #include <vector>
+#include <type_traits>
 #include <iterator>
 
 #include <graehl/shared/dynamic_array.hpp>
 #include <graehl/shared/config.h>
 #include <graehl/shared/weight.h>
+#include <graehl/shared/log_sum_exp.hpp>
 #include <graehl/shared/2heap.h>
 #include <graehl/shared/list.h>
 #include <graehl/shared/push_backer.hpp>
+#include <graehl/shared/threadlocal.hpp>
 
 //#include <boost/serialization/access.hpp>
 
@@ -150,8 +153,9 @@ void add_reversed_arcs(GraphState* destination, GraphState const* src, unsigned
 
 Graph reverseGraph(Graph g, bool data_point_to_forward = true);
 
-extern Graph dfsGraph;
-extern bool* dfsVis;
+// per thread, as are DistToState's, so separate threads may search their own graphs
+extern THREADLOCAL Graph dfsGraph;
+extern THREADLOCAL bool* dfsVis;
 
 void dfsRec(unsigned state, unsigned pred);
 
@@ -291,8 +295,8 @@ struct reverse_topo_order {
 // serves as adjustable heap (tracks where each state is, and its weight)
 struct DistToState {
   unsigned state;
-  static DistToState** stateLocations;
-  static FLOAT_TYPE* weights;
+  static THREADLOCAL DistToState** stateLocations;
+  static THREADLOCAL FLOAT_TYPE* weights;
   static FLOAT_TYPE unreachable;
   operator FLOAT_TYPE() const { return weights[state]; }
   void operator=(DistToState rhs) {
@@ -386,18 +390,60 @@ Weight countNoCyclePathsTo(Graph g, unsigned src, unsigned dest, unsigned* p_n_b
   return wd;
 }
 
+// how propagate_paths_in_order combines the weights of alternative paths: sum them (the default), or keep
+// only the best (max, i.e. the tropical/Viterbi semiring - no log-add for logweight)
+struct sum_paths {
+  template <class W>
+  void operator()(W& to, W const& w) const {
+    to += w;
+  }
+};
+
+struct max_paths {
+  template <class W>
+  void operator()(W& to, W const& w) const {
+    if (to < w) to = w;
+  }
+};
+
 // w is an array with as many entries as g has states.   w[start] is nonzero
 
-template <class Weight_get, class Weight_array, class Order>
+template <class Weight_get, class Weight_array, class Order, class Plus>
 void propagate_paths_in_order(Graph g, Order t, Order const& t_order_end, Weight_get const& getwt,
-                              Weight_array& w) {
+                              Weight_array& w, Plus const& plus) {
   for (; t != t_order_end; ++t) {
     unsigned src = *t;
     const List<GraphArc>& arcs = g.states[src].arcs;
     for (List<GraphArc>::const_iterator i = arcs.const_begin(), end = arcs.const_end(); i != end; ++i) {
       GraphArc const& a = *i;
-      w[a.dest] += w[src] * getwt(a);
+      plus(w[a.dest], w[src] * getwt(a));
+    }
+  }
+}
+
+template <class Weight_get, class Weight_array, class Order>
+void propagate_paths_in_order(Graph g, Order t, Order const& t_order_end, Weight_get const& getwt,
+                              Weight_array& w) {
+  propagate_paths_in_order(g, t, t_order_end, getwt, w, sum_paths());
+}
+
+// the same sums as propagate_paths_in_order on the reversed graph, but pulled: for s in order, w[s] += the sum
+// over s's arcs a in g of w[a.dest] * getwt(a), added all at once (for logweight, a single vectorized
+// log_sum_exp rather than a log-add per arc)
+template <class Weight_get, class Weight_array, class Order>
+void gather_paths_in_order(Graph g, Order t, Order const& t_order_end, Weight_get const& getwt,
+                           Weight_array& w) {
+  typedef typename std::decay<decltype(w[0])>::type W;
+  std::vector<W> terms;
+  for (; t != t_order_end; ++t) {
+    unsigned s = *t;
+    const List<GraphArc>& arcs = g.states[s].arcs;
+    terms.clear();
+    for (List<GraphArc>::const_iterator i = arcs.const_begin(), end = arcs.const_end(); i != end; ++i) {
+      GraphArc const& a = *i;
+      terms.push_back(w[a.dest] * getwt(a));
     }
+    if (!terms.empty()) w[s] += sum_all(&terms[0], terms.size());
   }
 }
 
@@ -0,0 +1,322 @@
+// Copyright 2014 Jonathan Graehl - http://graehl.org/
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+/** \file
+
+    lazy_kbest_paths: the k shortest (not necessarily simple) paths from src to dest in a Graph, best first,
+    one at a time.  Eppstein's algorithm as in kbest.h, but with the sidetrack heaps built lazily (as Huang &
+    Chiang suggest in "Better k-best parsing", 2005): H_G(v), the persistent heap of the sidetracks off the
+    shortest path from v to dest, is only made when a path enumerated so far reaches v, along with those of the
+    states on v's shortest path that don't have theirs yet.  so after the one (reverse Dijkstra) pass for the
+    shortest path tree, the cost of the first k paths is in the states they touch, not the whole graph.
+
+    unlike kbest.h, there are no globals: all the state is in the object, so separate enumerations may run
+    concurrently.  arc weights are costs (e.g. WFST::makeGraph) and must be nonnegative; arcs of infinite cost
+    are never taken.  the graph must outlive the enumeration and not change during it.
+*/
+
+#ifndef GRAEHL_SHARED__LAZY_KBEST_PATHS_HPP
+#define GRAEHL_SHARED__LAZY_KBEST_PATHS_HPP
+#pragma once
+
+#include <graehl/shared/graph.h>
+#include <boost/noncopyable.hpp>
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <queue>
+#include <utility>
+#include <vector>
+
+namespace graehl {
+
+struct lazy_kbest_paths : boost::noncopyable {
+  typedef GraphArc const* arc_p;
+  typedef std::vector<arc_p> path_type;
+
+  lazy_kbest_paths(Graph g, unsigned src, unsigned dest)
+      : src(src), dest(dest), n_found(0), n_cands(0) {
+    index_arcs(g);
+    shortest_paths_to_dest();
+  }
+
+  /// the next best path's arcs (from src to dest) and cost.  false if there are no more
+  bool next(path_type& path, FLOAT_TYPE& cost) {
+    path.clear();
+    if (!n_found) {
+      if (src >= dist.size() || dist[src] == HUGE_VAL) return false;
+      ++n_found;
+      unsigned root = sidetracks_from(src);
+      if (root != none) push(delta(nodes[root].arc), root, none, none);
+      cost = dist[src];
+      shortest_path(src, path);
+      return true;
+    }
+    if (queue.empty()) return false;
+    std::pop_heap(queue.begin(), queue.end());
+    cand const c = queue.back();
+    queue.pop_back();
+    ++n_found;
+    heap_node const& n = nodes[c.node];
+    unsigned arc = c.pos == none ? n.arc : rest[n.rest_first + c.pos];
+    unsigned r = (unsigned)found.size();
+    found.push_back(found_path(arc, c.prev));
+
+    // the next candidates: replace the last sidetrack by its children in H_G, or add a sidetrack after it
+    FLOAT_TYPE before = c.cost - delta(arc);
+    if (c.pos == none) {
+      if (n.left != none) push(before + delta(nodes[n.left].arc), n.left, none, c.prev);
+      if (n.right != none) push(before + delta(nodes[n.right].arc), n.right, none, c.prev);
+      if (n.rest_size) push(before + delta(rest[n.rest_first]), c.node, 0, c.prev);
+    } else {
+      for (unsigned i = 2 * c.pos + 1, e = std::min(i + 2, n.rest_size); i < e; ++i)
+        push(before + delta(rest[n.rest_first + i]), c.node, i, c.prev);
+    }
+    unsigned root = sidetracks_from(out_arcs[arc]->dest);
+    if (root != none) push(c.cost + delta(nodes[root].arc), root, none, r);
+
+    cost = dist[src] + c.cost;
+    sidetracks.clear();
+    for (unsigned p = r; p != none; p = found[p].prev) sidetracks.push_back(found[p].arc);
+    unsigned s = src;
+    for (unsigned i = (unsigned)sidetracks.size(); i--;) {
+      arc_p a = out_arcs[sidetracks[i]];
+      for (; s != a->src; s = next_state[s]) path.push_back(tree_arc[s]);
+      path.push_back(a);
+      s = a->dest;
+    }
+    shortest_path(s, path);
+    return true;
+  }
+
+  /// as kbest.h bestPaths, but every arc is visited by v.visit_best_arc: v.start_path(rank, cost) (rank from
+  /// 1), then v.visit_best_arc(GraphArc const&) for each arc in the path, then v.end_path(), for up to k
+  /// paths.  returns the number of paths visited
+  template <class Visitor>
+  unsigned visit(unsigned k, Visitor& v) {
+    path_type path;
+    FLOAT_TYPE cost;
+    unsigned n = 0;
+    for (; n < k && next(path, cost); ++n) {
+      v.start_path(n_found, cost);
+      for (path_type::const_iterator i = path.begin(), e = path.end(); i != e; ++i) v.visit_best_arc(**i);
+      v.end_path();
+    }
+    return n;
+  }
+
+ private:
+  enum { none = (unsigned)-1, unbuilt = (unsigned)-2 };
+  unsigned src, dest;
+  unsigned n_found;  // paths so far
+
+  // arcs (numbered by source): arcs out of s are out_arcs[out_first[s] .. out_first[s+1])
+  std::vector<unsigned> out_first;
+  std::vector<arc_p> out_arcs;
+
+  std::vector<FLOAT_TYPE> dist;  // best cost to dest
+  std::vector<unsigned> tree;  // the arc starting s's best path to dest, or none
+  // (and for walking the shortest path, that arc and its destination)
+  std::vector<arc_p> tree_arc;
+  std::vector<unsigned> next_state;
+
+  /// the extra cost of taking arc i instead of staying on the shortest path tree
+  FLOAT_TYPE delta(unsigned i) const {
+    arc_p a = out_arcs[i];
+    return a->weight + dist[a->dest] - dist[a->src];
+  }
+
+  void index_arcs(Graph const& g) {
+    unsigned n = g.nStates;
+    out_first.resize(n + 1);
+    for (unsigned s = 0; s < n; ++s) {
+      out_first[s] = (unsigned)out_arcs.size();
+      for (GraphState::arcs_type::const_iterator a = g.states[s].arcs.const_begin(),
+                                                 e = g.states[s].arcs.const_end();
+           a != e; ++a)
+        out_arcs.push_back(&*a);
+    }
+    out_first[n] = (unsigned)out_arcs.size();
+  }
+
+  void shortest_paths_to_dest() {
+    unsigned n = (unsigned)out_first.size() - 1;
+    dist.assign(n, HUGE_VAL);
+    tree.assign(n, none);
+    tree_arc.assign(n, 0);
+    next_state.assign(n, none);
+    hg.assign(n, unbuilt);
+    if (dest >= n) return;
+    // arcs into s are in_arc[in_first[s] .. in_first[s+1]) (as out_arcs indices)
+    std::vector<unsigned> in_first(n + 1), in_arc(out_arcs.size());
+    for (unsigned i = 0, e = (unsigned)out_arcs.size(); i < e; ++i) ++in_first[out_arcs[i]->dest + 1];
+    for (unsigned s = 0; s < n; ++s) in_first[s + 1] += in_first[s];
+    std::vector<unsigned> fill(in_first.begin(), in_first.end() - 1);
+    for (unsigned i = 0, e = (unsigned)out_arcs.size(); i < e; ++i) in_arc[fill[out_arcs[i]->dest]++] = i;
+    typedef std::pair<FLOAT_TYPE, unsigned> queued;  // cost, state
+    std::priority_queue<queued, std::vector<queued>, std::greater<queued> > q;
+    std::vector<char> done(n);
+    dist[dest] = 0;
+    q.push(queued(0, dest));
+    while (!q.empty()) {
+      unsigned s = q.top().second;
+      q.pop();
+      if (done[s]) continue;
+      done[s] = true;
+      for (unsigned j = in_first[s], e = in_first[s + 1]; j < e; ++j) {
+        unsigned i = in_arc[j];
+        unsigned from = out_arcs[i]->src;
+        FLOAT_TYPE d = dist[s] + out_arcs[i]->weight;
+        if (d < dist[from] && !done[from]) {
+          dist[from] = d;
+          tree[from] = i;
+          tree_arc[from] = out_arcs[i];
+          next_state[from] = s;
+          q.push(queued(d, from));
+        }
+      }
+    }
+  }
+
+  void shortest_path(unsigned s, path_type& path) const {
+    for (; s != dest; s = next_state[s]) path.push_back(tree_arc[s]);
+  }
+
+  /* H_G(s): a node per state on the shortest path from s to dest that has sidetracks, holding its least
+     sidetrack (arc) and the rest of them (a binary heap by delta, rest[rest_first .. rest_first+rest_size)),
+     arranged in a balanced heap (by arc's delta) shared with the H_G further along the path
+  */
+  struct heap_node {
+    unsigned left, right, n_descend;
+    unsigned arc;
+    unsigned rest_first, rest_size;
+  };
+  std::vector<heap_node> nodes;
+  std::vector<unsigned> rest;
+  std::vector<unsigned> hg;  // root node of H_G(s), none if empty, or unbuilt
+  std::vector<unsigned> chain;
+
+  struct worse_sidetrack {
+    lazy_kbest_paths const& k;
+    explicit worse_sidetrack(lazy_kbest_paths const& k) : k(k) {}
+    bool operator()(unsigned a, unsigned b) const {
+      FLOAT_TYPE da = k.delta(a), db = k.delta(b);
+      return da > db || (da == db && a > b);
+    }
+  };
+
+  unsigned sidetracks_from(unsigned s) {
+    if (hg[s] != unbuilt) return hg[s];
+    chain.clear();
+    for (;;) {
+      chain.push_back(s);
+      if (s == dest) break;
+      s = next_state[s];
+      if (hg[s] != unbuilt) break;
+    }
+    for (unsigned i = (unsigned)chain.size(); i--;) {
+      unsigned t = chain[i];
+      hg[t] = add_sidetracks(t, t == dest ? none : hg[next_state[t]]);
+    }
+    return hg[chain[0]];
+  }
+
+  /// H_G(s) given H_G of the next state on the shortest path
+  unsigned add_sidetracks(unsigned s, unsigned next) {
+    unsigned first = (unsigned)rest.size();
+    for (unsigned i = out_first[s], e = out_first[s + 1]; i < e; ++i)
+      if (i != tree[s] && dist[out_arcs[i]->dest] != HUGE_VAL && delta(i) != HUGE_VAL) rest.push_back(i);
+    if (first == rest.size()) return next;
+    worse_sidetrack worse(*this);
+    std::vector<unsigned>::iterator b = rest.begin() + first;
+    std::make_heap(b, rest.end(), worse);
+    std::pop_heap(b, rest.end(), worse);
+    heap_node n;
+    n.arc = rest.back();
+    rest.pop_back();
+    n.rest_first = first;
+    n.rest_size = (unsigned)rest.size() - first;
+    unsigned i = (unsigned)nodes.size();
+    nodes.push_back(n);
+    return insert(next, i);
+  }
+
+  /// persistent insert of node i (not yet in any heap) into the heap at root (which is left as it was)
+  unsigned insert(unsigned root, unsigned i) {
+    if (root == none) {
+      nodes[i].left = nodes[i].right = none;
+      nodes[i].n_descend = 0;
+      return i;
+    }
+    unsigned copy = (unsigned)nodes.size();
+    nodes.push_back(nodes[root]);
+    heap_node& c = nodes[copy];
+    ++c.n_descend;
+    bool go_left = c.left == none || (c.right != none && nodes[c.right].n_descend > nodes[c.left].n_descend);
+    if (delta(nodes[i].arc) < delta(c.arc)) {  // i becomes the root, and the old root goes below
+      nodes[i].left = c.left;
+      nodes[i].right = c.right;
+      nodes[i].n_descend = c.n_descend;
+      if (go_left) {
+        unsigned l = insert(nodes[i].left, copy);
+        nodes[i].left = l;
+      } else {
+        unsigned r = insert(nodes[i].right, copy);
+        nodes[i].right = r;
+      }
+      return i;
+    }
+    if (go_left) {
+      unsigned l = insert(c.left, i);
+      nodes[copy].left = l;
+    } else {
+      unsigned r = insert(c.right, i);
+      nodes[copy].right = r;
+    }
+    return copy;
+  }
+
+  // a candidate path: the found path prev's sidetracks (prev none: no sidetracks) then the sidetrack in H_G
+  // node (the node's arc, or if pos isn't none, its rest[pos]).  cost is the sum of the sidetracks' deltas
+  struct cand {
+    FLOAT_TYPE cost;
+    unsigned node, pos, prev;
+    unsigned id;  // ties are broken by order of creation
+    bool operator<(cand const& o) const { return cost > o.cost || (cost == o.cost && id > o.id); }
+  };
+  std::vector<cand> queue;  // heap
+  unsigned n_cands;
+  void push(FLOAT_TYPE cost, unsigned node, unsigned pos, unsigned prev) {
+    cand c;
+    c.cost = cost;
+    c.node = node;
+    c.pos = pos;
+    c.prev = prev;
+    c.id = n_cands++;
+    queue.push_back(c);
+    std::push_heap(queue.begin(), queue.end());
+  }
+
+  struct found_path {
+    unsigned arc;  // last sidetrack
+    unsigned prev;  // the found path with the sidetracks before it, or none
+    found_path(unsigned arc, unsigned prev) : arc(arc), prev(prev) {}
+  };
+  std::vector<found_path> found;
+  std::vector<unsigned> sidetracks;
+};
+
+
+}
+
+#endif
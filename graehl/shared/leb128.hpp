@@ -43,11 +43,10 @@ typedef byte* byteptr;
 template <class Uint>
 const_byteptr decode_leb128(Uint& result, const_byteptr p) {
   Uint x = 0;
-  for (;;) {
+  for (unsigned shift = 0;; shift += 7) {
     byte const c = *p;
     byte const sig = c & 0x7f;
-    x <<= 7;
-    x |= sig;
+    x |= (Uint)sig << shift;
     ++p;
     if (c == sig) {
       result = x;
@@ -58,13 +57,11 @@ const_byteptr decode_leb128(Uint& result, const_byteptr p) {
 
 template <class Uint>
 const_byteptr decode_leb128(Uint& result, const_byteptr p, const_byteptr end) {
-  // TODO: test
   Uint x = 0;
-  for (;;) {
+  for (unsigned shift = 0;; shift += 7) {
     byte const c = *p;
     byte const sig = c & 0x7f;
-    x <<= 7;
-    x |= sig;
+    x |= (Uint)sig << shift;
     ++p;
     if (c == sig) {
       result = x;
@@ -82,7 +79,6 @@ unsigned leb128_max_bytes(Uint) {
 
 template <class Uint>
 byteptr encode_leb128(byteptr p, Uint x) {
-  // TODO: test
   for (;;) {
     byte c = x;
     x >>= 7;
@@ -109,8 +105,8 @@ struct leb128_codec {
   static const_byteptr decode(Uint& x, const_byteptr p, const_byteptr end) {
     return decode_leb128(x, p, end);
   }
-  static byteptr encode(byteptr p, Uint x) { return encode_leb128(x, p); }
-  static byteptr encode(byteptr p, const_byteptr end, Uint x) { return encode_leb128(x, p, end); }
+  static byteptr encode(byteptr p, Uint x) { return encode_leb128(p, x); }
+  static byteptr encode(byteptr p, const_byteptr end, Uint x) { return encode_leb128(p, (byteptr)end, x); }
 };
 
 template <class Uint>
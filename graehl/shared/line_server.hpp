@@ -0,0 +1,188 @@
+// Copyright 2014 Jonathan Graehl-http://graehl.org/
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+/** \file
+
+    line_server: answers newline terminated requests on a (POSIX) Unix domain socket, each connection on its
+    own thread, so clients are served concurrently.
+
+    serve(path, connect) listens on path (replacing a stale socket there, but not any other kind of file).
+    connect() is called on each new connection's thread, and returns the reply function for that connection
+    (which may keep state for it): for each request line (without its '\n', or "\r\n"), reply(request,
+    response) appends the response (normally whole lines) to send back.  replies for different connections
+    run at once.  reply returns false to close its connection after sending the response; if it (or connect)
+    throws, the response is "error " and the exception's what().  stop() (from any thread, e.g. in a reply)
+    stops accepting, closes the connections once the requests already received are answered, and then serve
+    returns.  socket errors throw std::runtime_error.
+*/
+
+#ifndef GRAEHL_SHARED__LINE_SERVER_HPP
+#define GRAEHL_SHARED__LINE_SERVER_HPP
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace graehl {
+
+struct line_server : boost::noncopyable {
+  typedef std::function<bool(std::string const&, std::string&)> reply_type;
+  typedef std::function<reply_type()> connect_type;
+
+  line_server() : listen_fd(-1), stopping(false), n_open(0), n_connections(0) {}
+
+  /// returns after stop(), once every connection is closed
+  void serve(std::string const& path, connect_type const& connect) {
+    this->connect = connect;
+    listen_on(path);
+    std::string err;
+    for (;;) {
+      int fd = ::accept(listen_fd, 0, 0);
+      std::lock_guard<std::mutex> lock(mutex);
+      if (stopping) {
+        if (fd >= 0) ::close(fd);
+        break;
+      }
+      if (fd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) continue;
+        err = std::string("accept on ") + path + ": " + std::strerror(errno);
+        stopping = true;
+        close_all();
+        break;
+      }
+      open.insert(fd);
+      ++n_open;
+      ++n_connections;
+      std::thread(&line_server::converse, this, fd).detach();
+    }
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (n_open) closed.wait(lock);
+    }
+    ::close(listen_fd);
+    listen_fd = -1;
+    ::unlink(path.c_str());
+    if (!err.empty()) throw std::runtime_error(err);
+  }
+
+  void stop() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (stopping) return;
+    stopping = true;
+    close_all();
+  }
+
+  /// how many connections were accepted
+  unsigned long connections() const { return n_connections; }
+
+ private:
+  connect_type connect;
+  int listen_fd;
+  bool stopping;
+  unsigned n_open;
+  unsigned long n_connections;
+  std::set<int> open;
+  std::mutex mutex;
+  std::condition_variable closed;
+
+  void listen_on(std::string const& path) {
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) throw std::runtime_error("socket path too long: " + path);
+    std::strcpy(addr.sun_path, path.c_str());
+    struct stat st;
+    if (::stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) ::unlink(path.c_str());
+    if ((listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || ::bind(listen_fd, (sockaddr*)&addr, sizeof(addr))
+        || ::listen(listen_fd, SOMAXCONN)) {
+      std::string err = std::string("listening on ") + path + ": " + std::strerror(errno);
+      if (listen_fd >= 0) ::close(listen_fd);
+      throw std::runtime_error(err);
+    }
+  }
+
+  // under the lock: wakes accept and each connection's read
+  void close_all() {
+    if (listen_fd >= 0) ::shutdown(listen_fd, SHUT_RDWR);
+    for (std::set<int>::const_iterator i = open.begin(), e = open.end(); i != e; ++i) ::shutdown(*i, SHUT_RD);
+  }
+
+  static bool send_all(int fd, std::string const& s) {
+    for (std::size_t i = 0, n = s.size(); i < n;) {
+      ssize_t sent = ::send(fd, s.data() + i, n - i, MSG_NOSIGNAL);
+      if (sent < 0) {
+        if (errno == EINTR) continue;
+        return false;
+      }
+      i += sent;
+    }
+    return true;
+  }
+
+  void converse(int fd) {
+    std::string buf, request, response;
+    char chunk[4096];
+    bool more = true;
+    reply_type reply;
+    try {
+      reply = connect();
+    } catch (std::exception& e) {
+      send_all(fd, std::string("error ") + e.what() + "\n");
+      more = false;
+    }
+    std::size_t start = 0;
+    while (more) {
+      std::size_t nl = buf.find('\n', start);
+      if (nl == std::string::npos) {
+        buf.erase(0, start);
+        start = 0;
+        ssize_t got = ::recv(fd, chunk, sizeof(chunk), 0);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) break;
+        buf.append(chunk, got);
+        continue;
+      }
+      request.assign(buf, start, nl - start);
+      start = nl + 1;
+      if (!request.empty() && request[request.size() - 1] == '\r') request.resize(request.size() - 1);
+      response.clear();
+      try {
+        more = reply(request, response);
+      } catch (std::exception& e) {
+        response = std::string("error ") + e.what() + "\n";
+      }
+      if (!send_all(fd, response)) break;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    open.erase(fd);
+    ::close(fd);
+    if (!--n_open) closed.notify_all();
+  }
+};
+
+
+}
+
+#endif
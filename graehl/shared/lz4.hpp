@@ -23,6 +23,12 @@
 #endif
 #endif
 
+// lz4.c defines (non-inline) functions, so include this from only one translation unit.  its system
+// headers are included first, outside the namespace
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
 namespace lz4 {
 #include "lz4.c"
 #include "lz4.h"
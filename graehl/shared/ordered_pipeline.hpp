@@ -0,0 +1,226 @@
+// Copyright 2014 Jonathan Graehl-http://graehl.org/
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+/** \file
+
+    run_ordered_pipeline(stages, n_workers, window): a reader thread, n_workers worker threads and the calling
+    thread as writer, for processing a stream of items concurrently but with output in input order.
+
+    stages.read(Item &) (on the reader thread, in order) fills the next item and returns false at end;
+    stages.work(Item &, unsigned worker) processes it on one of the workers, in any order;
+    stages.write(Item &) (on the calling thread, in input order) consumes it, and may return false to stop early.
+
+    at most window items are between read and written (the reorder buffer), and their storage is reused, so
+    read may keep buffers in Item.  an exception thrown by any stage stops the pipeline and is rethrown.
+
+    item_latencies (optional) gets, for each item written, the seconds from its read to its write, and
+    work_latencies the seconds its work took; latency_percentiles summarizes them.
+*/
+
+#ifndef GRAEHL_SHARED__ORDERED_PIPELINE_HPP
+#define GRAEHL_SHARED__ORDERED_PIPELINE_HPP
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+namespace graehl {
+
+struct latency_percentiles {
+  std::vector<double> secs;
+  void add(double s) { secs.push_back(s); }
+  std::size_t size() const { return secs.size(); }
+
+  /// the smallest latency that at least fraction p of them are <= (nearest rank; sorts secs)
+  double percentile(double p) {
+    std::size_t n = secs.size();
+    if (!n) return 0;
+    std::sort(secs.begin(), secs.end());
+    std::size_t rank = (std::size_t)std::ceil(p * n);
+    return secs[rank ? std::min(rank, n) - 1 : 0];
+  }
+
+  /// e.g. "p50=1.2ms p90=3.4ms p99=8ms max=12ms"
+  void print(std::ostream& o) {
+    o << "p50=" << 1e3 * percentile(.5) << "ms p90=" << 1e3 * percentile(.9) << "ms p99=" << 1e3 * percentile(.99)
+      << "ms max=" << 1e3 * percentile(1) << "ms";
+  }
+};
+
+namespace detail {
+typedef std::chrono::steady_clock pipeline_clock;
+
+inline double seconds_since(pipeline_clock::time_point t) {
+  return std::chrono::duration<double>(pipeline_clock::now() - t).count();
+}
+
+template <class Item, class Stages>
+struct ordered_pipeline {
+  Stages& stages;
+  std::size_t window;
+  std::vector<Item> items;  // item i is in items[i % window]
+  std::vector<char> worked;
+  std::vector<pipeline_clock::time_point> read_at;
+  std::vector<double> work_secs;
+  std::size_t n_read, n_taken, n_written;
+  bool at_end, stop;
+  std::exception_ptr err;
+  std::mutex mutex;
+  std::condition_variable changed;
+
+  ordered_pipeline(Stages& stages, std::size_t window)
+      : stages(stages)
+      , window(window)
+      , items(window)
+      , worked(window)
+      , read_at(window)
+      , work_secs(window)
+      , n_read()
+      , n_taken()
+      , n_written()
+      , at_end()
+      , stop() {}
+
+  void fail() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!err) err = std::current_exception();
+    stop = true;
+    changed.notify_all();
+  }
+
+  void read() {
+    try {
+      for (;;) {
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          while (!stop && n_read - n_written >= window) changed.wait(lock);
+          if (stop) return;
+        }
+        std::size_t slot = n_read % window;  // free: only we touch it until n_read is advanced
+        bool more = stages.read(items[slot]);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!more) {
+          at_end = true;
+          changed.notify_all();
+          return;
+        }
+        read_at[slot] = pipeline_clock::now();
+        ++n_read;
+        changed.notify_all();
+      }
+    } catch (...) {
+      fail();
+    }
+  }
+
+  void work(unsigned worker) {
+    try {
+      for (;;) {
+        std::size_t slot;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          while (!stop && n_taken == n_read && !at_end) changed.wait(lock);
+          if (stop || n_taken == n_read) return;
+          slot = n_taken++ % window;
+        }
+        pipeline_clock::time_point t = pipeline_clock::now();
+        stages.work(items[slot], worker);
+        double secs = seconds_since(t);
+        std::lock_guard<std::mutex> lock(mutex);
+        work_secs[slot] = secs;
+        worked[slot] = true;
+        changed.notify_all();
+      }
+    } catch (...) {
+      fail();
+    }
+  }
+
+  void write(latency_percentiles* item_latencies, latency_percentiles* work_latencies) {
+    try {
+      for (;;) {
+        std::size_t slot = n_written % window;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          while (!stop && !worked[slot] && !(at_end && n_written == n_read)) changed.wait(lock);
+          if (stop || !worked[slot]) return;
+        }
+        bool more = stages.write(items[slot]);
+        if (item_latencies) item_latencies->add(seconds_since(read_at[slot]));
+        if (work_latencies) work_latencies->add(work_secs[slot]);
+        std::lock_guard<std::mutex> lock(mutex);
+        worked[slot] = false;
+        ++n_written;
+        if (!more) stop = true;
+        changed.notify_all();
+      }
+    } catch (...) {
+      fail();
+    }
+  }
+
+  void finish() {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+    changed.notify_all();
+  }
+};
+
+template <class Pipeline>
+struct pipeline_worker {
+  Pipeline* p;
+  unsigned i;
+  void operator()() const { p->work(i); }
+};
+
+template <class Pipeline>
+struct pipeline_reader {
+  Pipeline* p;
+  void operator()() const { p->read(); }
+};
+}
+
+/// see file comment.  returns the number of items written
+template <class Item, class Stages>
+std::size_t run_ordered_pipeline(Stages& stages, unsigned n_workers, std::size_t window,
+                                 latency_percentiles* item_latencies = 0, latency_percentiles* work_latencies = 0) {
+  typedef detail::ordered_pipeline<Item, Stages> P;
+  if (!n_workers) n_workers = 1;
+  if (window < n_workers) window = n_workers;
+  P p(stages, window);
+  std::vector<std::thread> threads;
+  detail::pipeline_reader<P> reader = {&p};
+  threads.push_back(std::thread(reader));
+  for (unsigned i = 0; i < n_workers; ++i) {
+    detail::pipeline_worker<P> worker = {&p, i};
+    threads.push_back(std::thread(worker));
+  }
+  p.write(item_latencies, work_latencies);
+  p.finish();
+  for (std::size_t i = 0; i < threads.size(); ++i) threads[i].join();
+  if (p.err) std::rethrow_exception(p.err);
+  return p.n_written;
+}
+
+
+}
+
+#endif
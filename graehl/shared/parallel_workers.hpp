@@ -0,0 +1,83 @@
+// Copyright 2014 Jonathan Graehl-http://graehl.org/
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+/** \file
+
+    run_workers(f, n) calls f(i) for each i in [0,n) - i=0 on the calling thread, the rest on their own
+    threads - and returns when all are done. an exception thrown by any worker is rethrown (the lowest i wins).
+
+    worker_range(i, n, N) gives the i-th of n contiguous, nearly equal pieces of [0,N).
+
+    together these give deterministic data parallelism: each worker accumulates into its own state over its
+    own range, and the caller reduces the workers in index order, so the result depends only on n and not on
+    thread scheduling.
+*/
+
+#ifndef GRAEHL_SHARED__PARALLEL_WORKERS_HPP
+#define GRAEHL_SHARED__PARALLEL_WORKERS_HPP
+#pragma once
+
+#include <graehl/shared/thread_group.hpp>
+#include <cstddef>
+#include <exception>
+#include <utility>
+#include <vector>
+
+namespace graehl {
+
+typedef std::pair<std::size_t, std::size_t> worker_range_type;
+
+inline worker_range_type worker_range(std::size_t i, std::size_t n, std::size_t N) {
+  std::size_t per = N / n, extra = N % n;
+  std::size_t begin = i * per + (i < extra ? i : extra);
+  return worker_range_type(begin, begin + per + (i < extra));
+}
+
+namespace detail {
+template <class F>
+struct run_worker {
+  F* f;
+  std::size_t i;
+  std::exception_ptr* err;
+  run_worker(F& f, std::size_t i, std::exception_ptr& err) : f(&f), i(i), err(&err) {}
+  void operator()() const {
+    try {
+      (*f)(i);
+    } catch (...) {
+      *err = std::current_exception();
+    }
+  }
+};
+}
+
+template <class F>
+void run_workers(F& f, std::size_t n) {
+  if (n <= 1) {
+    f(0);
+    return;
+  }
+  std::vector<std::exception_ptr> errs(n);
+  {
+    thread_group threads;
+    for (std::size_t i = 1; i < n; ++i) threads.create_thread(detail::run_worker<F>(f, i, errs[i]));
+    detail::run_worker<F>(f, 0, errs[0])();
+    threads.join_all();
+  }
+  for (std::size_t i = 0; i < n; ++i)
+    if (errs[i]) std::rethrow_exception(errs[i]);
+}
+
+
+}
+
+#endif
@@ -182,6 +182,18 @@ inline double random01()  // returns uniform random number on [0..1)
 }
 
 #include <graehl/shared/random.ipp>
+
+/**
+   the (thread-unsafe) global RNG, with the same interface (as far as it goes) as random below.
+*/
+struct global_random {
+  typedef double result_type;
+  result_type operator()() const { return graehl::random01(); }
+  template <class It, class P>
+  It choose_p(It begin, It end, P const& p) const {
+    return graehl::choose_p(begin, end, p);
+  }
+};
 #endif
 
 struct set_random_pos_fraction {
@@ -0,0 +1,134 @@
+// Copyright 2014 Jonathan Graehl-http://graehl.org/
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+/** \file
+
+    read_ahead<Batch>: a reader thread fills batches (in order) ahead of the consumer, so reading (i/o,
+    decompression, deserialization) of the next batches overlaps with processing the current one.
+
+    fill(Batch &b, std::size_t &bytes) returns false at end, else fills b and sets bytes to (about) how much
+    memory it holds.  the reader stays at least one batch ahead (double buffering), and more while the filled
+    but unconsumed batches hold fewer than max_bytes.  batches are recycled, so fill may reuse b's storage.
+
+    next() returns the next batch (or NULL at end); the batch returned before is recycled then.  an exception
+    thrown by fill is rethrown by next().  destroying a read_ahead early stops the reader.
+*/
+
+#ifndef GRAEHL_SHARED__READ_AHEAD_HPP
+#define GRAEHL_SHARED__READ_AHEAD_HPP
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace graehl {
+
+template <class Batch>
+struct read_ahead : boost::noncopyable {
+  typedef std::function<bool(Batch&, std::size_t&)> fill_type;
+
+  read_ahead(fill_type const& fill, std::size_t max_bytes)
+      : fill(fill), max_bytes(max_bytes), bytes_ahead(0), done(false), stop(false), held() {
+    reader = std::thread(&read_ahead::read, this);
+  }
+
+  ~read_ahead() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    room.notify_all();
+    reader.join();
+    for (std::size_t i = 0; i < batches.size(); ++i) delete batches[i];
+  }
+
+  Batch* next() {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (held) {
+      spare.push_back(held);
+      held = 0;
+    }
+    while (filled.empty() && !done) ready.wait(lock);
+    if (filled.empty()) {
+      if (err) std::rethrow_exception(err);
+      return 0;
+    }
+    held = filled.front().first;
+    bytes_ahead -= filled.front().second;
+    filled.pop_front();
+    room.notify_all();
+    return held;
+  }
+
+ private:
+  fill_type fill;
+  std::size_t max_bytes, bytes_ahead;
+  bool done, stop;
+  std::exception_ptr err;
+  Batch* held;  // by the consumer
+  std::deque<std::pair<Batch*, std::size_t> > filled;
+  std::vector<Batch*> spare, batches;  // batches: all, for deletion
+  std::mutex mutex;
+  std::condition_variable ready, room;
+  std::thread reader;
+
+  void read() {
+    for (;;) {
+      Batch* b;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stop && !filled.empty() && bytes_ahead >= max_bytes) room.wait(lock);
+        if (stop) break;
+        if (spare.empty()) {
+          batches.push_back(new Batch());
+          spare.push_back(batches.back());
+        }
+        b = spare.back();
+        spare.pop_back();
+      }
+      std::size_t bytes = 0;
+      bool more;
+      try {
+        more = fill(*b, bytes);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        err = std::current_exception();
+        more = false;
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!more) {
+        spare.push_back(b);
+        break;
+      }
+      filled.push_back(std::make_pair(b, bytes));
+      bytes_ahead += bytes;
+      ready.notify_all();
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    done = true;
+    ready.notify_all();
+  }
+};
+
+
+}
+
+#endif
@@ -110,6 +110,25 @@ struct serialize_batch {
     }
   }
 
+  /// like advance(), but a record read from file goes into spare rather than current(), so several
+  /// records may be held at once (e.g. to hand out to worker threads).  returns the record, or NULL at end
+  value_type *advance_into(value_type &spare)
+  {
+    if (use_file) {
+      unsigned header;
+      ia >> header;
+      if (header==END_RECORDS)
+        return 0;
+      else if (header==RECORD_FOLLOWS) {
+        ++current_i;
+        ia >> spare;
+        return &spare;
+      } else
+        throw serialize_batch_error();
+    } else
+      return advance() ? &*store_cursor : 0;
+  }
+
   void must_advance()
   {
     if (!advance())
@@ -170,6 +189,13 @@ struct serialize_batch {
       deref(f)(current());
   }
 
+  /// i: 0 indexed.  unlike operator[], doesn't move the cursor (so may be used from several threads at
+  /// once), but only works when !use_file; returns NULL otherwise
+  value_type *stored(unsigned i)
+  {
+    return use_file ? 0 : &store[i];
+  }
+
   /// i: 0 indexed
   value_type &operator[](unsigned i)
   {
@@ -20,7 +20,7 @@ namespace graehl {
 
 static const int MAX_TRACE_DEPTH = 64;
 
-void stacktrace(std::ostream& o = std::cerr) {
+inline void stacktrace(std::ostream& o = std::cerr) {
 #ifdef __linux__
   void* trace[MAX_TRACE_DEPTH];
   int trace_size = ::backtrace(trace, MAX_TRACE_DEPTH);
@@ -33,6 +33,7 @@
 #include <graehl/shared/checkpoint_istream.hpp>
 #include <graehl/shared/memmap.hpp>
 #include <string>
+#include <vector>
 #include <graehl/shared/dynamic_array.hpp>
 #include <boost/lexical_cast.hpp>
 #include <graehl/shared/backtrace.hpp>
@@ -452,6 +453,21 @@ struct SwapBatch {
     }
   }
 
+  /// f(items) with the items of each batch in turn (in order), once it's loaded; they stay valid until f
+  /// returns, so f may hand them to other threads
+  template <class F>
+  void enumerate_batches(F f) {
+    BACKTRACE;
+    std::vector<BatchMember *> items;
+    for (unsigned i = 0; i<n_batch; ++i) {
+      load_batch(i);
+      items.clear();
+      for (const size_type *d_next = (size_type *)memmap.begin(); *d_next; d_next+=*d_next)
+        items.push_back(data_for_header(d_next));
+      deref(f)(items);
+    }
+  }
+
   std::ios::openmode readmode, loadmode;
   SwapBatch(const std::string &basename_, size_type batch_bytesize, bool rw = true) : rw(rw), basename(basename_), batchsize(batch_bytesize), autodelete(true) {
     readmode = rw ? (std::ios::in|std::ios::out) : std::ios::out;
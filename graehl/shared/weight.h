@@ -601,6 +601,13 @@ struct logweight {  // capable of representing nonnegative reals
   base_printer as_base(Real base) const { return base_printer(base, *this); }
 };
 
+// defined here (not weight.cc) so every translation unit sees the constant initializer; otherwise
+// thread_local access from a TU lacking the definition goes through a (null) TLS init wrapper
+template <class Real>
+THREADLOCAL int logweight<Real>::default_base = logweight<Real>::EXP;
+template <class Real>
+THREADLOCAL int logweight<Real>::default_thresh = logweight<Real>::ALWAYS_LOG;
+
 
 template <class Real>
 inline Real log(logweight<Real> a) {